@@ -0,0 +1,218 @@
+#!/usr/bin/perl -w
+
+# Convert an access log written with "log_format ... encoding=binary"
+# back to the text format defined by the same log_format.
+#
+# usage: binlog2text.pl [access.bin ...] > access.log
+#        zcat access.bin.gz | binlog2text.pl > access.log
+
+use warnings;
+use strict;
+
+# field kinds, see ngx_http_log_binary_vars[] in ngx_http_log_module.c
+
+my @builtin = (undef, 'pipe', 'time_local', 'time_iso8601', 'msec',
+               'request_time', 'status', 'bytes_sent', 'body_bytes_sent',
+               'request_length');
+
+my @months = qw(Jan Feb Mar Apr May Jun Jul Aug Sep Oct Nov Dec);
+
+my %schemas;
+
+binmode STDOUT;
+
+if (@ARGV) {
+    for my $name (@ARGV) {
+        open(my $fh, '<', $name) or die "cannot open $name: $!\n";
+        binmode $fh;
+        decode($fh, $name);
+        close $fh;
+    }
+
+} else {
+    binmode STDIN;
+    decode(\*STDIN, 'stdin');
+}
+
+exit 0;
+
+
+sub decode {
+    my ($fh, $name) = @_;
+    my $data = '';
+    my $pos = 0;
+
+    while (1) {
+        my $n = read($fh, $data, 65536, length $data);
+        die "read error on $name: $!\n" unless defined $n;
+
+        while (1) {
+            my $p = $pos;
+
+            last if $p >= length $data;
+
+            my $type = substr($data, $p++, 1);
+            my $len = varint(\$data, \$p);
+
+            last if !defined $len || $p + $len > length $data;
+
+            my $record = substr($data, $p, $len);
+            $pos = $p + $len;
+
+            if ($type eq 'S') {
+                schema($record);
+
+            } elsif ($type eq 'R') {
+                print record($record), "\n";
+
+            } else {
+                die "invalid record type at offset $p in $name\n";
+            }
+        }
+
+        $data = substr($data, $pos);
+        $pos = 0;
+
+        last if $n == 0;
+    }
+
+    die "truncated record at the end of $name\n" if length $data;
+}
+
+
+sub varint {
+    my ($data, $p) = @_;
+    my ($n, $shift) = (0, 0);
+
+    while ($$p < length $$data) {
+        my $c = ord(substr($$data, $$p++, 1));
+
+        $n |= ($c & 0x7f) << $shift;
+        return $n if $c < 0x80;
+
+        $shift += 7;
+    }
+
+    return undef;
+}
+
+
+sub schema {
+    my ($record) = @_;
+    my $p = 4;
+
+    my $id = unpack('V', $record);
+
+    my $len = varint(\$record, \$p);
+    my $name = substr($record, $p, $len);
+    $p += $len;
+
+    my $n = varint(\$record, \$p);
+    my @fields;
+
+    while ($n--) {
+        my $kind = ord(substr($record, $p++, 1));
+
+        if ($kind == 0 || $kind >= 0x20) {
+            $len = varint(\$record, \$p);
+            push @fields, [ $kind, substr($record, $p, $len) ];
+            $p += $len;
+
+        } else {
+            die "unknown field kind $kind in log format \"$name\"\n"
+                unless defined $builtin[$kind];
+
+            push @fields, [ $kind ];
+        }
+    }
+
+    $schemas{$id} = \@fields;
+}
+
+
+sub record {
+    my ($record) = @_;
+    my $p = 4;
+    my $line = '';
+
+    my $id = unpack('V', $record);
+    my $fields = $schemas{$id}
+        or die sprintf("record of unknown log format %08x\n", $id);
+
+    for my $field (@$fields) {
+        my $kind = $field->[0];
+
+        if ($kind == 0) {
+            $line .= $field->[1];
+
+        } elsif ($kind >= 0x20) {
+            my $len = varint(\$record, \$p);
+
+            if ($len == 0) {
+                # not found
+                $line .= '-' if $kind == 0x20;
+                next;
+            }
+
+            my $value = substr($record, $p, $len - 1);
+            $p += $len - 1;
+
+            if ($kind == 0x20) {
+                $value =~ s/([\x00-\x1f"\\\x7f-\xff])/sprintf("\\x%02X", ord $1)/ge;
+
+            } elsif ($kind == 0x21) {
+                $value =~ s/(["\\])/\\$1/g;
+                $value =~ s/\n/\\n/g;
+                $value =~ s/\r/\\r/g;
+                $value =~ s/\t/\\t/g;
+                $value =~ s/\x08/\\b/g;
+                $value =~ s/\x0c/\\f/g;
+                $value =~ s/([\x00-\x1f])/sprintf("\\u%04X", ord $1)/ge;
+            }
+
+            $line .= $value;
+
+        } elsif ($builtin[$kind] eq 'pipe') {
+            $line .= substr($record, $p++, 1);
+
+        } elsif ($builtin[$kind] =~ /^time_/) {
+            my ($sec, $off) = unpack('Q< s<', substr($record, $p, 10));
+            $p += 10;
+
+            my @tm = gmtime($sec + $off * 60);
+            my $sign = $off < 0 ? '-' : '+';
+            $off = abs $off;
+
+            if ($builtin[$kind] eq 'time_local') {
+                $line .= sprintf("%02d/%s/%d:%02d:%02d:%02d %s%02d%02d",
+                                 $tm[3], $months[$tm[4]], $tm[5] + 1900,
+                                 $tm[2], $tm[1], $tm[0],
+                                 $sign, $off / 60, $off % 60);
+
+            } else {
+                $line .= sprintf("%4d-%02d-%02dT%02d:%02d:%02d%s%02d:%02d",
+                                 $tm[5] + 1900, $tm[4] + 1, $tm[3],
+                                 $tm[2], $tm[1], $tm[0],
+                                 $sign, $off / 60, $off % 60);
+            }
+
+        } elsif ($builtin[$kind] eq 'status') {
+            $line .= sprintf("%03d", unpack('v', substr($record, $p, 2)));
+            $p += 2;
+
+        } else {
+            my $n = unpack('Q<', substr($record, $p, 8));
+            $p += 8;
+
+            if ($builtin[$kind] eq 'msec' || $builtin[$kind] eq 'request_time')
+            {
+                $line .= sprintf("%d.%03d", int($n / 1000), $n % 1000);
+
+            } else {
+                $line .= $n;
+            }
+        }
+    }
+
+    return $line;
+}
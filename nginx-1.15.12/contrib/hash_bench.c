@@ -0,0 +1,312 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * A benchmark of ngx_hash_key(), ngx_hash_key_lc(), and ngx_hash_strlow().
+ *
+ * The driver is linked with the objects of a configured tree, so that
+ * the code being measured is exactly the one built into nginx, e.g.:
+ *
+ *     cc -O2 -I src/core -I src/event -I src/event/modules -I src/os/unix \
+ *        -I objs -o hash_bench contrib/hash_bench.c \
+ *        objs/src/core/ngx_hash.o objs/src/core/ngx_palloc.o \
+ *        objs/src/core/ngx_array.o objs/src/core/ngx_string.o \
+ *        objs/src/os/unix/ngx_alloc.o
+ *
+ *     ./hash_bench [-n iterations] [file]
+ *
+ * The file holds keys, one per line, e.g. request header names and
+ * values taken from a capture; a built-in sample of typical header
+ * names and values is used without it.  The keys of the corpus are
+ * hashed the given number of times by each of the functions, and the
+ * results are checked against the bytewise ngx_hash() loop first.
+ * To compare two versions of ngx_hash.c, build the driver with the
+ * objects of each of them.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_HASH_BENCH_MAX  65536
+
+
+typedef struct {
+    u_char      *data;
+    size_t       len;
+} ngx_hash_bench_key_t;
+
+
+static char  *ngx_hash_bench_sample[] = {
+    "Host",
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Language",
+    "User-Agent",
+    "Referer",
+    "Cookie",
+    "Connection",
+    "Content-Type",
+    "Content-Length",
+    "Cache-Control",
+    "If-Modified-Since",
+    "If-None-Match",
+    "Upgrade-Insecure-Requests",
+    "X-Requested-With",
+    "X-Forwarded-For",
+    "X-Real-IP",
+    "Authorization",
+    "Sec-Fetch-Mode",
+    "Sec-Fetch-Site",
+    "DNT",
+    "TE",
+    "www.example.com",
+    "gzip, deflate, br",
+    "en-US,en;q=0.9,de;q=0.8,fr;q=0.7",
+    "text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/webp,image/apng,*/*;q=0.8",
+    "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/74.0.3729.131 Safari/537.36",
+    "Mozilla/5.0 (X11; Linux x86_64; rv:66.0) Gecko/20100101 Firefox/66.0",
+    "application/x-www-form-urlencoded; charset=UTF-8",
+    "max-age=0",
+    "keep-alive",
+    NULL
+};
+
+
+static ngx_hash_bench_key_t *ngx_hash_bench_read(char *name, ngx_uint_t *n);
+static ngx_msec_t ngx_hash_bench_msec(void);
+
+
+volatile ngx_cycle_t  *ngx_cycle;
+
+
+void ngx_cdecl
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
+
+
+int
+main(int argc, char *const *argv)
+{
+    u_char                *buf;
+    size_t                 bytes;
+    ngx_uint_t             i, j, n, k, key, sum, iterations;
+    ngx_msec_t             start, hash, hash_lc, strlow;
+    ngx_hash_bench_key_t  *keys;
+
+    iterations = 1000000;
+
+    i = 1;
+
+    if (i + 1 < (ngx_uint_t) argc && ngx_strcmp(argv[i], "-n") == 0) {
+        iterations = atoi(argv[i + 1]);
+        i += 2;
+    }
+
+    keys = ngx_hash_bench_read(i < (ngx_uint_t) argc ? argv[i] : NULL, &n);
+    if (keys == NULL) {
+        return 1;
+    }
+
+    buf = malloc(NGX_HASH_BENCH_MAX);
+    if (buf == NULL) {
+        return 1;
+    }
+
+    bytes = 0;
+
+    for (i = 0; i < n; i++) {
+        bytes += keys[i].len;
+
+        /* check the results against the bytewise loop */
+
+        key = 0;
+
+        for (k = 0; k < keys[i].len; k++) {
+            key = ngx_hash(key, keys[i].data[k]);
+        }
+
+        if (ngx_hash_key(keys[i].data, keys[i].len) != key) {
+            fprintf(stderr, "ngx_hash_key() of key %lu is incorrect\n",
+                    (unsigned long) i);
+            return 1;
+        }
+
+        key = 0;
+
+        for (k = 0; k < keys[i].len; k++) {
+            key = ngx_hash(key, ngx_tolower(keys[i].data[k]));
+        }
+
+        if (ngx_hash_key_lc(keys[i].data, keys[i].len) != key
+            || ngx_hash_strlow(buf, keys[i].data, keys[i].len) != key)
+        {
+            fprintf(stderr, "lowercase hash of key %lu is incorrect\n",
+                    (unsigned long) i);
+            return 1;
+        }
+
+        for (k = 0; k < keys[i].len; k++) {
+            if (buf[k] != ngx_tolower(keys[i].data[k])) {
+                fprintf(stderr, "key %lu is lowercased incorrectly\n",
+                        (unsigned long) i);
+                return 1;
+            }
+        }
+    }
+
+    /* the sums keep the calls from being optimized out */
+
+    sum = 0;
+
+    start = ngx_hash_bench_msec();
+
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < n; i++) {
+            sum += ngx_hash_key(keys[i].data, keys[i].len);
+        }
+    }
+
+    hash = ngx_hash_bench_msec() - start;
+
+    start = ngx_hash_bench_msec();
+
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < n; i++) {
+            sum += ngx_hash_key_lc(keys[i].data, keys[i].len);
+        }
+    }
+
+    hash_lc = ngx_hash_bench_msec() - start;
+
+    start = ngx_hash_bench_msec();
+
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < n; i++) {
+            sum += ngx_hash_strlow(buf, keys[i].data, keys[i].len);
+        }
+    }
+
+    strlow = ngx_hash_bench_msec() - start;
+
+    printf("keys: %lu, bytes: %lu, iterations: %lu, sum: %lx\n",
+           (unsigned long) n, (unsigned long) bytes,
+           (unsigned long) iterations, (unsigned long) sum);
+
+    printf("ngx_hash_key:    %lu ms, %.2f ns/byte, %.1f ns/key\n",
+           (unsigned long) hash,
+           hash * 1e6 / ((double) bytes * iterations),
+           hash * 1e6 / ((double) n * iterations));
+
+    printf("ngx_hash_key_lc: %lu ms, %.2f ns/byte, %.1f ns/key\n",
+           (unsigned long) hash_lc,
+           hash_lc * 1e6 / ((double) bytes * iterations),
+           hash_lc * 1e6 / ((double) n * iterations));
+
+    printf("ngx_hash_strlow: %lu ms, %.2f ns/byte, %.1f ns/key\n",
+           (unsigned long) strlow,
+           strlow * 1e6 / ((double) bytes * iterations),
+           strlow * 1e6 / ((double) n * iterations));
+
+    return 0;
+}
+
+
+static ngx_hash_bench_key_t *
+ngx_hash_bench_read(char *name, ngx_uint_t *n)
+{
+    char                   line[NGX_HASH_BENCH_MAX];
+    FILE                  *f;
+    size_t                 len;
+    ngx_uint_t             i, nelts, nalloc;
+    ngx_hash_bench_key_t  *keys, *k;
+
+    f = NULL;
+
+    if (name) {
+        f = fopen(name, "r");
+        if (f == NULL) {
+            perror(name);
+            return NULL;
+        }
+    }
+
+    keys = NULL;
+    nelts = 0;
+    nalloc = 0;
+    i = 0;
+
+    for ( ;; ) {
+
+        if (f) {
+            if (fgets(line, sizeof(line), f) == NULL) {
+                break;
+            }
+
+            len = strlen(line);
+
+            while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+                len--;
+            }
+
+        } else {
+            if (ngx_hash_bench_sample[i] == NULL) {
+                break;
+            }
+
+            len = strlen(ngx_hash_bench_sample[i]);
+            ngx_memcpy(line, ngx_hash_bench_sample[i++], len);
+        }
+
+        if (nelts == nalloc) {
+            nalloc = nalloc ? nalloc * 2 : 64;
+
+            keys = realloc(keys, nalloc * sizeof(ngx_hash_bench_key_t));
+            if (keys == NULL) {
+                return NULL;
+            }
+        }
+
+        k = &keys[nelts++];
+
+        k->data = malloc(len + 1);
+        if (k->data == NULL) {
+            return NULL;
+        }
+
+        ngx_memcpy(k->data, line, len);
+        k->len = len;
+    }
+
+    if (f) {
+        fclose(f);
+    }
+
+    if (nelts == 0) {
+        fprintf(stderr, "no keys to benchmark\n");
+        return NULL;
+    }
+
+    *n = nelts;
+
+    return keys;
+}
+
+
+static ngx_msec_t
+ngx_hash_bench_msec(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ngx_msec_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
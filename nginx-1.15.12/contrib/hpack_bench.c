@@ -0,0 +1,311 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * A benchmark of the HPACK Huffman encoder and decoder.
+ *
+ * The driver is linked with the objects of a configured tree, so that
+ * the code being measured is exactly the one built into nginx, e.g.:
+ *
+ *     cc -O2 -I src/core -I src/event -I src/event/modules -I src/os/unix \
+ *        -I src/http -I src/http/modules -I src/http/v2 -I objs \
+ *        -o hpack_bench contrib/hpack_bench.c \
+ *        objs/src/http/v2/ngx_http_v2_huff_decode.o \
+ *        objs/src/http/v2/ngx_http_v2_huff_encode.o
+ *
+ *     ./hpack_bench [-n iterations] [file]
+ *
+ * The file holds header field values, one per line, e.g. taken from
+ * a capture of request headers; a built-in sample of typical request
+ * values is used without it.  Each value is Huffman-encoded once, then
+ * the whole corpus is encoded and decoded the given number of times.
+ * To compare two versions of the coder, build the driver with the
+ * objects of each of them.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HPACK_BENCH_MAX  65536
+
+
+typedef struct {
+    u_char      *data;
+    size_t       len;
+    u_char      *huff;
+    size_t       hlen;
+} ngx_hpack_bench_value_t;
+
+
+static char  *ngx_hpack_bench_sample[] = {
+    "/",
+    "/index.html",
+    "/static/js/main.3f9c2a7b.chunk.js",
+    "/static/css/main.8a41e9c0.chunk.css",
+    "/api/v2/users/1842907/notifications?limit=20&cursor=eyJpZCI6MTIzfQ",
+    "/images/products/2019/04/thumb_640x480_7c1d2e.jpg",
+    "/search?q=nginx+http2+hpack+huffman&lang=en&page=2",
+    "www.example.com",
+    "cdn.example.net",
+    "https://www.example.com/catalog/shoes/running?sort=price_asc",
+    "text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/webp,image/apng,*/*;q=0.8",
+    "image/webp,image/apng,image/*,*/*;q=0.8",
+    "gzip, deflate, br",
+    "en-US,en;q=0.9,de;q=0.8,fr;q=0.7",
+    "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/74.0.3729.131 Safari/537.36",
+    "Mozilla/5.0 (iPhone; CPU iPhone OS 12_2 like Mac OS X) "
+        "AppleWebKit/605.1.15 (KHTML, like Gecko) Version/12.1 "
+        "Mobile/15E148 Safari/604.1",
+    "Mozilla/5.0 (X11; Linux x86_64; rv:66.0) Gecko/20100101 Firefox/66.0",
+    "max-age=0",
+    "no-cache",
+    "W/\"5cc2f1a7-3e8b\"",
+    "Wed, 24 Apr 2019 09:41:27 GMT",
+    "_ga=GA1.2.1739584201.1556092311; _gid=GA1.2.488120934.1556092311; "
+        "_gat=1; session_id=9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b82"
+        "2cd15d6c15b0f00a08; csrftoken=Zk3pX8qL2vN7tR1yB4mC6wD9hJ0sF5gK; "
+        "lang=en-US; tz=Europe%2FBerlin; consent=1",
+    "sid=s%3AVq8Xy2Lk5Jm9Nb3Pc7Rd1Tf6Wg0Hh4Qj.x7Yz2Ab5Cd8Ef1Gh4Ij7Kl0Mn3Op"
+        "6Qr9St2Uv5Wx8Yz; remember_token=1842907|4a7d1ed414474e4033ac29cc"
+        "b8653d9b; _fbp=fb.1.1556092311840.1482950283",
+    "Bearer eyJhbGciOiJSUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxODQyOTA3Iiwi"
+        "aWF0IjoxNTU2MDkyMzExLCJleHAiOjE1NTYwOTU5MTF9.dBjftJeZ4CVP-mB92K27"
+        "uhbUJU1p1r_wW1gFWFOEjXk",
+    "XMLHttpRequest",
+    "application/json, text/plain, */*",
+    "application/x-www-form-urlencoded; charset=UTF-8",
+    "same-origin",
+    "navigate",
+    "?1",
+    "1",
+    NULL
+};
+
+
+static ngx_hpack_bench_value_t *ngx_hpack_bench_read(char *name,
+    ngx_uint_t *n);
+static ngx_msec_t ngx_hpack_bench_msec(void);
+
+
+/* the decoder logs its errors, they are not expected here */
+
+void ngx_cdecl
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
+
+
+void ngx_http_v2_huff_decode_init(void) __attribute__((weak));
+
+
+int
+main(int argc, char *const *argv)
+{
+    u_char                   *buf, *p, state;
+    size_t                    bytes, hbytes;
+    ngx_int_t                 rc;
+    ngx_msec_t                start, decode, encode;
+    ngx_uint_t                i, j, n, iterations;
+    ngx_hpack_bench_value_t  *values;
+
+    iterations = 100000;
+
+    i = 1;
+
+    if (i + 1 < (ngx_uint_t) argc && ngx_strcmp(argv[i], "-n") == 0) {
+        iterations = atoi(argv[i + 1]);
+        i += 2;
+    }
+
+    values = ngx_hpack_bench_read(i < (ngx_uint_t) argc ? argv[i] : NULL, &n);
+    if (values == NULL) {
+        return 1;
+    }
+
+    if (ngx_http_v2_huff_decode_init) {
+        ngx_http_v2_huff_decode_init();
+    }
+
+    buf = malloc(NGX_HPACK_BENCH_MAX);
+    if (buf == NULL) {
+        return 1;
+    }
+
+    bytes = 0;
+    hbytes = 0;
+
+    for (i = 0; i < n; i++) {
+        bytes += values[i].len;
+        hbytes += values[i].hlen;
+
+        /* check that the value is decoded back */
+
+        state = 0;
+        p = buf;
+
+        rc = ngx_http_v2_huff_decode(&state, values[i].huff, values[i].hlen,
+                                     &p, 1, NULL);
+
+        if (rc != NGX_OK || (size_t) (p - buf) != values[i].len
+            || ngx_memcmp(buf, values[i].data, values[i].len) != 0)
+        {
+            fprintf(stderr, "value %lu is decoded incorrectly\n",
+                    (unsigned long) i);
+            return 1;
+        }
+    }
+
+    start = ngx_hpack_bench_msec();
+
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < n; i++) {
+            state = 0;
+            p = buf;
+
+            (void) ngx_http_v2_huff_decode(&state, values[i].huff,
+                                           values[i].hlen, &p, 1, NULL);
+        }
+    }
+
+    decode = ngx_hpack_bench_msec() - start;
+
+    start = ngx_hpack_bench_msec();
+
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < n; i++) {
+            (void) ngx_http_v2_huff_encode(values[i].data, values[i].len, buf,
+                                           0);
+        }
+    }
+
+    encode = ngx_hpack_bench_msec() - start;
+
+    printf("values: %lu, bytes: %lu, huffman bytes: %lu, iterations: %lu\n",
+           (unsigned long) n, (unsigned long) bytes, (unsigned long) hbytes,
+           (unsigned long) iterations);
+
+    printf("decode: %lu ms, %.2f ns/byte, %.1f MB/s\n",
+           (unsigned long) decode,
+           decode * 1e6 / ((double) hbytes * iterations),
+           (double) hbytes * iterations / 1e3 / (decode ? decode : 1));
+
+    printf("encode: %lu ms, %.2f ns/byte, %.1f MB/s\n",
+           (unsigned long) encode,
+           encode * 1e6 / ((double) bytes * iterations),
+           (double) bytes * iterations / 1e3 / (encode ? encode : 1));
+
+    return 0;
+}
+
+
+static ngx_hpack_bench_value_t *
+ngx_hpack_bench_read(char *name, ngx_uint_t *n)
+{
+    char                     line[NGX_HPACK_BENCH_MAX];
+    FILE                    *f;
+    size_t                   len;
+    ngx_uint_t               i, nelts, nalloc;
+    ngx_hpack_bench_value_t *values, *v;
+
+    f = NULL;
+
+    if (name) {
+        f = fopen(name, "r");
+        if (f == NULL) {
+            perror(name);
+            return NULL;
+        }
+    }
+
+    values = NULL;
+    nelts = 0;
+    nalloc = 0;
+    i = 0;
+
+    for ( ;; ) {
+
+        if (f) {
+            if (fgets(line, sizeof(line), f) == NULL) {
+                break;
+            }
+
+            len = strlen(line);
+
+            while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+                len--;
+            }
+
+        } else {
+            if (ngx_hpack_bench_sample[i] == NULL) {
+                break;
+            }
+
+            len = strlen(ngx_hpack_bench_sample[i]);
+            ngx_memcpy(line, ngx_hpack_bench_sample[i++], len);
+        }
+
+        if (nelts == nalloc) {
+            nalloc = nalloc ? nalloc * 2 : 64;
+
+            values = realloc(values, nalloc * sizeof(ngx_hpack_bench_value_t));
+            if (values == NULL) {
+                return NULL;
+            }
+        }
+
+        v = &values[nelts];
+
+        v->data = malloc(2 * len + 1);
+        if (v->data == NULL) {
+            return NULL;
+        }
+
+        ngx_memcpy(v->data, line, len);
+        v->len = len;
+
+        /* the values that Huffman coding does not shorten are skipped */
+
+        v->huff = v->data + len;
+        v->hlen = ngx_http_v2_huff_encode(v->data, len, v->huff, 0);
+
+        if (v->hlen == 0) {
+            free(v->data);
+            continue;
+        }
+
+        nelts++;
+    }
+
+    if (f) {
+        fclose(f);
+    }
+
+    if (nelts == 0) {
+        fprintf(stderr, "no values to benchmark\n");
+        return NULL;
+    }
+
+    *n = nelts;
+
+    return values;
+}
+
+
+static ngx_msec_t
+ngx_hpack_bench_msec(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ngx_msec_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
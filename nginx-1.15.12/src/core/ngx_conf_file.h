@@ -90,6 +90,9 @@ struct ngx_open_file_s {
     ngx_fd_t              fd;
     ngx_str_t             name;
 
+    /* incremented each time the file is reopened */
+    ngx_uint_t            generation;
+
     void                (*flush)(ngx_open_file_t *file, ngx_log_t *log);
     void                 *data;
 };
@@ -725,6 +725,11 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
 #if (NGX_HAVE_DEFERRED_ACCEPT && defined SO_ACCEPTFILTER)
     struct accept_filter_arg   af;
 #endif
+#if (NGX_HAVE_REUSEPORT_CBPF)
+    ngx_core_conf_t           *ccf;
+    struct sock_fprog          prog;
+    struct sock_filter         code[3];
+#endif
 
     ls = cycle->listening.elts;
     for (i = 0; i < cycle->listening.nelts; i++) {
@@ -841,6 +846,44 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
         }
 #endif
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+        /*
+         * the program is attached to the whole reuseport group, so it is
+         * enough to set it on the first socket; the kernel picks the socket
+         * by its index in the group, and the sockets of a group are bound
+         * in the worker order, see ngx_clone_listening()
+         */
+
+        if (ls[i].reuseport_steer && ls[i].worker == 0) {
+            ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                   ngx_core_module);
+
+            value = (ls[i].reuseport_steer == NGX_REUSEPORT_STEER_QUEUE)
+                    ? SKF_AD_QUEUE : SKF_AD_CPU;
+
+            code[0] = (struct sock_filter)
+                      BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + value);
+            code[1] = (struct sock_filter)
+                      BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, ccf->worker_processes);
+            code[2] = (struct sock_filter) BPF_STMT(BPF_RET|BPF_A, 0);
+
+            prog.len = 3;
+            prog.filter = code;
+
+            if (setsockopt(ls[i].fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                           (const void *) &prog, sizeof(struct sock_fprog))
+                == -1)
+            {
+                ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                              "setsockopt(SO_ATTACH_REUSEPORT_CBPF) "
+                              "%V failed, ignored",
+                              &ls[i].addr_text);
+            }
+        }
+
+#endif
+
 #if 0
         if (1) {
             int tcp_nodelay = 1;
@@ -84,6 +84,7 @@ struct ngx_listening_s {
 #endif
     unsigned            reuseport:1;
     unsigned            add_reuseport:1;
+    unsigned            reuseport_steer:2;
     unsigned            keepalive:2;
 
     unsigned            deferred_accept:1;
@@ -103,6 +104,13 @@ struct ngx_listening_s {
 };
 
 
+typedef enum {
+    NGX_REUSEPORT_STEER_NONE = 0,
+    NGX_REUSEPORT_STEER_CPU,
+    NGX_REUSEPORT_STEER_QUEUE
+} ngx_connection_reuseport_steer_e;
+
+
 typedef enum {
     NGX_ERROR_ALERT = 0,
     NGX_ERROR_ERR,
@@ -9,6 +9,11 @@
 #include <ngx_core.h>
 
 
+#if (NGX_CRC32_SLICE8)
+static ngx_int_t ngx_crc32_slice8_init(void);
+#endif
+
+
 /*
  * The code and lookup tables are based on the algorithm
  * described at http://www.w3.org/TR/PNG/
@@ -20,6 +25,12 @@
  * CRC32 loop, but the cache misses overhead is bigger than overhead of
  * the additional code.  For example, ngx_crc32_short() of 16 bytes of data
  * takes half as much CPU clocks than ngx_crc32_long().
+ *
+ * For long data the "slicing-by-8" algorithm is used on little-endian
+ * platforms: the 8 lookup tables of 256 elements allow to process
+ * 8 bytes per iteration with independent table lookups.  The tables are
+ * derived from ngx_crc32_table256[] in ngx_crc32_table_init(), so the
+ * polynomial and the results are the same.
  */
 
 
@@ -101,12 +112,22 @@ uint32_t  ngx_crc32_table256[] = {
 
 uint32_t *ngx_crc32_table_short = ngx_crc32_table16;
 
+#if (NGX_CRC32_SLICE8)
+uint32_t *ngx_crc32_table_slice8;
+#endif
+
 // 初始化crc32(循环冗余校验)相关变量，主要是利用查表法加速
 ngx_int_t
 ngx_crc32_table_init(void)
 {
     void  *p;
 
+#if (NGX_CRC32_SLICE8)
+    if (ngx_crc32_slice8_init() != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
     if (((uintptr_t) ngx_crc32_table_short
           & ~((uintptr_t) ngx_cacheline_size - 1))
         == (uintptr_t) ngx_crc32_table_short)
@@ -127,3 +148,79 @@ ngx_crc32_table_init(void)
 
     return NGX_OK;
 }
+
+
+#if (NGX_CRC32_SLICE8)
+
+static ngx_int_t
+ngx_crc32_slice8_init(void)
+{
+    void        *p;
+    uint32_t    *t, crc;
+    ngx_uint_t   i, k;
+
+    if (ngx_crc32_table_slice8) {
+        return NGX_OK;
+    }
+
+    p = ngx_alloc(8 * 256 * sizeof(uint32_t) + ngx_cacheline_size,
+                  ngx_cycle->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_align_ptr(p, ngx_cacheline_size);
+    t = p;
+
+    /*
+     * t[k * 256 + i] is the CRC of the byte i followed by k zero bytes
+     */
+
+    for (i = 0; i < 256; i++) {
+        crc = ngx_crc32_table256[i];
+        t[i] = crc;
+
+        for (k = 1; k < 8; k++) {
+            crc = ngx_crc32_table256[crc & 0xff] ^ (crc >> 8);
+            t[k * 256 + i] = crc;
+        }
+    }
+
+    ngx_crc32_table_slice8 = t;
+
+    return NGX_OK;
+}
+
+
+uint32_t
+ngx_crc32_slice8(uint32_t crc, u_char *p, size_t len)
+{
+    uint32_t  *t, one, two;
+
+    t = ngx_crc32_table_slice8;
+
+    while (len >= 8) {
+        one = *(uint32_t *) p ^ crc;
+        two = *(uint32_t *) (p + 4);
+
+        crc = t[7 * 256 + (one & 0xff)]
+              ^ t[6 * 256 + ((one >> 8) & 0xff)]
+              ^ t[5 * 256 + ((one >> 16) & 0xff)]
+              ^ t[4 * 256 + (one >> 24)]
+              ^ t[3 * 256 + (two & 0xff)]
+              ^ t[2 * 256 + ((two >> 8) & 0xff)]
+              ^ t[1 * 256 + ((two >> 16) & 0xff)]
+              ^ t[two >> 24];
+
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#endif
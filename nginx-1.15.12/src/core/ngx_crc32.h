@@ -13,8 +13,28 @@
 #include <ngx_core.h>
 
 
+#if (NGX_HAVE_LITTLE_ENDIAN && NGX_HAVE_NONALIGNED)
+#define NGX_CRC32_SLICE8  1
+#endif
+
+/*
+ * the slicing-by-8 tables take 8K, so they are used only for data long
+ * enough to amortize the cache misses
+ */
+
+#define NGX_CRC32_SLICE8_MIN  64
+
+
 extern uint32_t  *ngx_crc32_table_short;
 extern uint32_t   ngx_crc32_table256[];
+#if (NGX_CRC32_SLICE8)
+extern uint32_t  *ngx_crc32_table_slice8;
+#endif
+
+
+#if (NGX_CRC32_SLICE8)
+uint32_t ngx_crc32_slice8(uint32_t crc, u_char *p, size_t len);
+#endif
 
 
 static ngx_inline uint32_t
@@ -42,6 +62,12 @@ ngx_crc32_long(u_char *p, size_t len)
 
     crc = 0xffffffff;
 
+#if (NGX_CRC32_SLICE8)
+    if (len >= NGX_CRC32_SLICE8_MIN && ngx_crc32_table_slice8) {
+        return ngx_crc32_slice8(crc, p, len) ^ 0xffffffff;
+    }
+#endif
+
     while (len--) {
         crc = ngx_crc32_table256[(crc ^ *p++) & 0xff] ^ (crc >> 8);
     }
@@ -59,6 +85,13 @@ ngx_crc32_update(uint32_t *crc, u_char *p, size_t len)
 {
     uint32_t  c;
 
+#if (NGX_CRC32_SLICE8)
+    if (len >= NGX_CRC32_SLICE8_MIN && ngx_crc32_table_slice8) {
+        *crc = ngx_crc32_slice8(*crc, p, len);
+        return;
+    }
+#endif
+
     c = *crc;
 
     while (len--) {
@@ -684,14 +684,75 @@ ngx_hash_wildcard_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
 }
 
 
+#if (NGX_HAVE_LITTLE_ENDIAN && NGX_HAVE_NONALIGNED && !NGX_HASH_BYTEWISE)
+
+/*
+ * ngx_hash() applied to 8 bytes at once: key * 31^8 + c0 * 31^7 + ... + c7,
+ * the products do not depend on each other and may run in parallel;
+ * the result is the same as of the bytewise loop, so keys computed
+ * by either way can be mixed
+ */
+
+#define NGX_HASH_WORDWISE  1
+
+#define ngx_hash_p2  ((ngx_uint_t) 31 * 31)
+#define ngx_hash_p4  (ngx_hash_p2 * ngx_hash_p2)
+
+#define ngx_hash_byte(w, n)  ((ngx_uint_t) ((w) >> (8 * (n))) & 0xff)
+
+
+static ngx_inline ngx_uint_t
+ngx_hash_word(ngx_uint_t key, uint64_t w)
+{
+    return key * ngx_hash_p4 * ngx_hash_p4
+           + ngx_hash_byte(w, 0) * ngx_hash_p4 * ngx_hash_p2 * 31
+           + ngx_hash_byte(w, 1) * ngx_hash_p4 * ngx_hash_p2
+           + ngx_hash_byte(w, 2) * ngx_hash_p4 * 31
+           + ngx_hash_byte(w, 3) * ngx_hash_p4
+           + ngx_hash_byte(w, 4) * ngx_hash_p2 * 31
+           + ngx_hash_byte(w, 5) * ngx_hash_p2
+           + ngx_hash_byte(w, 6) * 31
+           + ngx_hash_byte(w, 7);
+}
+
+
+/* ngx_tolower() of 8 bytes, the bytes above 0x7f are left intact */
+
+static ngx_inline uint64_t
+ngx_hash_tolower_word(uint64_t w)
+{
+    uint64_t  ascii, ge_a, gt_z;
+
+    ascii = w & 0x7f7f7f7f7f7f7f7fULL;
+
+    /* the high bit of each byte is set if it is >= 'A' and > 'Z' */
+
+    ge_a = ascii + 0x3f3f3f3f3f3f3f3fULL;
+    gt_z = ascii + 0x2525252525252525ULL;
+
+    return w | (((ge_a ^ gt_z) & ~w & 0x8080808080808080ULL) >> 2);
+}
+
+#endif
+
+
 ngx_uint_t
 ngx_hash_key(u_char *data, size_t len)
 {
     ngx_uint_t  i, key;
 
     key = 0;
+    i = 0;
 
-    for (i = 0; i < len; i++) {
+#if (NGX_HASH_WORDWISE)
+
+    for ( /* void */ ; i + 8 <= len; i += 8) {
+        key = ngx_hash_word(key, *(uint64_t *) &data[i]);
+    }
+
+#endif
+
+    for ( /* void */ ; i < len; i++) {
         key = ngx_hash(key, data[i]);
     }
 
@@ -705,8 +766,18 @@ ngx_hash_key_lc(u_char *data, size_t len)
     ngx_uint_t  i, key;
 
     key = 0;
+    i = 0;
 
-    for (i = 0; i < len; i++) {
+#if (NGX_HASH_WORDWISE)
+
+    for ( /* void */ ; i + 8 <= len; i += 8) {
+        key = ngx_hash_word(key,
+                            ngx_hash_tolower_word(*(uint64_t *) &data[i]));
+    }
+
+#endif
+
+    for ( /* void */ ; i < len; i++) {
         key = ngx_hash(key, ngx_tolower(data[i]));
     }
 
@@ -718,9 +789,24 @@ ngx_uint_t
 ngx_hash_strlow(u_char *dst, u_char *src, size_t n)
 {
     ngx_uint_t  key;
+#if (NGX_HASH_WORDWISE)
+    uint64_t    w;
+#endif
 
     key = 0;
 
+#if (NGX_HASH_WORDWISE)
+
+    for ( /* void */ ; n >= 8; n -= 8) {
+        w = ngx_hash_tolower_word(*(uint64_t *) src);
+        *(uint64_t *) dst = w;
+        key = ngx_hash_word(key, w);
+        dst += 8;
+        src += 8;
+    }
+
+#endif
+
     while (n--) {
         *dst = ngx_tolower(*src);
         key = ngx_hash(key, *dst);
@@ -114,14 +114,19 @@ ngx_md5_final(u_char result[16], ngx_md5_t *ctx)
 /*
  * The basic MD5 functions.
  *
- * F and G are optimized compared to their RFC 1321 definitions for
- * architectures that lack an AND-NOT instruction, just like in
- * Colin Plumb's implementation.
+ * F is optimized compared to its RFC 1321 definition for architectures
+ * that lack an AND-NOT instruction, just like in Colin Plumb's
+ * implementation.
+ *
+ * The terms of G do not overlap, so they may be added instead of or-ed:
+ * "(y) & ~(z)" does not depend on the result of the previous step and
+ * is computed in parallel with it.  For the same reason H xors the
+ * previous result last.
  */
 
 #define F(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
-#define G(x, y, z)  ((y) ^ ((z) & ((x) ^ (y))))
-#define H(x, y, z)  ((x) ^ (y) ^ (z))
+#define G(x, y, z)  (((x) & (z)) + ((y) & ~(z)))
+#define H(x, y, z)  ((x) ^ ((y) ^ (z)))
 #define I(x, y, z)  ((y) ^ ((x) | ~(z)))
 
 /*
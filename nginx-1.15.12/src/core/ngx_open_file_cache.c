@@ -52,6 +52,20 @@ static ngx_cached_open_file_t *
     uint32_t hash);
 static void ngx_open_file_cache_remove(ngx_event_t *ev);
 
+static ngx_int_t ngx_open_file_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_open_file_cache_sh_lookup(ngx_open_file_cache_t *cache,
+    ngx_str_t *name, uint32_t hash, ngx_open_file_info_t *of, time_t now,
+    ngx_open_file_cache_node_t *info);
+static void ngx_open_file_cache_sh_update(ngx_open_file_cache_t *cache,
+    ngx_str_t *name, uint32_t hash, ngx_open_file_info_t *of, time_t now);
+static ngx_open_file_cache_node_t *ngx_open_file_cache_sh_find(
+    ngx_open_file_cache_zone_t *ctx, ngx_str_t *name, uint32_t hash);
+static void ngx_open_file_cache_sh_expire(ngx_open_file_cache_zone_t *ctx,
+    ngx_uint_t force, time_t expire);
+static void ngx_open_file_cache_sh_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+
 
 ngx_open_file_cache_t *
 ngx_open_file_cache_init(ngx_pool_t *pool, ngx_uint_t max, time_t inactive)
@@ -72,6 +86,7 @@ ngx_open_file_cache_init(ngx_pool_t *pool, ngx_uint_t max, time_t inactive)
     cache->current = 0;
     cache->max = max;
     cache->inactive = inactive;
+    cache->shm_zone = NULL;
 
     cln = ngx_pool_cleanup_add(pool, 0);
     if (cln == NULL) {
@@ -140,17 +155,104 @@ ngx_open_file_cache_cleanup(void *data)
 }
 
 
+ngx_int_t
+ngx_open_file_cache_add_zone(ngx_conf_t *cf, ngx_open_file_cache_t *cache,
+    ngx_str_t *name, size_t size, void *tag)
+{
+    ngx_shm_zone_t              *shm_zone;
+    ngx_open_file_cache_zone_t  *ctx;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the zone may be shared by several open file caches */
+
+    if (shm_zone->data == NULL) {
+        ctx = ngx_pcalloc(cf->pool, sizeof(ngx_open_file_cache_zone_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        shm_zone->init = ngx_open_file_cache_init_zone;
+        shm_zone->data = ctx;
+    }
+
+    cache->shm_zone = shm_zone;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_open_file_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_open_file_cache_zone_t  *octx = data;
+
+    size_t                       len;
+    ngx_open_file_cache_zone_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_open_file_cache_sh_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_open_file_cache_sh_insert_value);
+
+    ngx_queue_init(&ctx->sh->queue);
+
+    len = sizeof(" in open file cache zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in open file cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    /* old entries are evicted when the zone is full */
+
+    ctx->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_pool_t *pool)
 {
-    time_t                          now;
+    time_t                          now, validated;
     uint32_t                        hash;
     ngx_int_t                       rc;
+    ngx_uint_t                      shared;
     ngx_file_info_t                 fi;
     ngx_pool_cleanup_t             *cln;
     ngx_cached_open_file_t         *file;
     ngx_pool_cleanup_file_t        *clnf;
+    ngx_open_file_cache_node_t      info;
     ngx_open_file_cache_cleanup_t  *ofcln;
 
     of->fd = NGX_INVALID_FILE;
@@ -203,6 +305,8 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     }
 
     now = ngx_time();
+    validated = now;
+    shared = 0;
 
     hash = ngx_crc32_long(name->data, name->len);
 
@@ -227,6 +331,22 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
             goto add_event;
         }
 
+        if (cache->shm_zone
+            && file->event == NULL
+            && now - file->created >= of->valid
+            && ngx_open_file_cache_sh_lookup(cache, name, hash, of, now, &info)
+               == NGX_OK
+            && info.err == file->err
+            && info.is_dir == file->is_dir
+            && (info.err || info.uniq == file->uniq))
+        {
+            /* another worker has recently found the file unchanged */
+
+            file->created = info.validated;
+            file->mtime = info.mtime;
+            file->size = info.size;
+        }
+
         if (file->use_event
             || (file->event == NULL
                 && (of->uniq == 0 || of->uniq == file->uniq)
@@ -351,6 +471,43 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
     /* not found */
 
+    if (cache->shm_zone
+        && ngx_open_file_cache_sh_lookup(cache, name, hash, of, now, &info)
+           == NGX_OK
+        && (info.err || info.is_dir || of->test_only))
+    {
+        /*
+         * no file descriptor is needed, so the result of a recent test
+         * by another worker is used as is
+         */
+
+        of->err = info.err;
+
+        if (info.err) {
+#if (NGX_HAVE_OPENAT)
+            of->failed = of->disable_symlinks ? ngx_openat_file_n
+                                              : ngx_open_file_n;
+#else
+            of->failed = ngx_open_file_n;
+#endif
+
+        } else {
+            of->uniq = info.uniq;
+            of->mtime = info.mtime;
+            of->size = info.size;
+
+            of->is_dir = info.is_dir;
+            of->is_file = info.is_file;
+            of->is_link = info.is_link;
+            of->is_exec = info.is_exec;
+        }
+
+        validated = info.validated;
+        shared = 1;
+
+        goto create;
+    }
+
     rc = ngx_open_and_stat_file(name, of, pool->log);
 
     if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
@@ -421,7 +578,11 @@ update:
         }
     }
 
-    file->created = now;
+    if (cache->shm_zone && !shared) {
+        ngx_open_file_cache_sh_update(cache, name, hash, of, now);
+    }
+
+    file->created = validated;
 
 found:
 
@@ -1223,6 +1384,240 @@ ngx_open_file_lookup(ngx_open_file_cache_t *cache, ngx_str_t *name,
 }
 
 
+static ngx_int_t
+ngx_open_file_cache_sh_lookup(ngx_open_file_cache_t *cache, ngx_str_t *name,
+    uint32_t hash, ngx_open_file_info_t *of, time_t now,
+    ngx_open_file_cache_node_t *info)
+{
+    ngx_int_t                    rc;
+    ngx_open_file_cache_zone_t  *ctx;
+    ngx_open_file_cache_node_t  *node;
+
+    ctx = cache->shm_zone->data;
+
+    rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    node = ngx_open_file_cache_sh_find(ctx, name, hash);
+
+    if (node
+        && now - node->validated < of->valid
+        && (node->err == 0 || of->errors)
+#if (NGX_HAVE_OPENAT)
+        && of->disable_symlinks == node->disable_symlinks
+        && of->disable_symlinks_from == node->disable_symlinks_from
+#endif
+       )
+    {
+        ngx_memcpy(info, node, offsetof(ngx_open_file_cache_node_t, len));
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "shared open file: %V, rc:%i", name, rc);
+
+    return rc;
+}
+
+
+static void
+ngx_open_file_cache_sh_update(ngx_open_file_cache_t *cache, ngx_str_t *name,
+    uint32_t hash, ngx_open_file_info_t *of, time_t now)
+{
+    size_t                       size;
+    ngx_open_file_cache_zone_t  *ctx;
+    ngx_open_file_cache_node_t  *node;
+
+    if (name->len > 65535) {
+        return;
+    }
+
+    ctx = cache->shm_zone->data;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    node = ngx_open_file_cache_sh_find(ctx, name, hash);
+
+    if (node) {
+        ngx_queue_remove(&node->queue);
+        goto update;
+    }
+
+    ngx_open_file_cache_sh_expire(ctx, 0, now - cache->inactive);
+
+    size = offsetof(ngx_open_file_cache_node_t, name) + name->len;
+
+    node = ngx_slab_alloc_locked(ctx->shpool, size);
+
+    if (node == NULL) {
+        ngx_open_file_cache_sh_expire(ctx, 1, now - cache->inactive);
+
+        node = ngx_slab_alloc_locked(ctx->shpool, size);
+        if (node == NULL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            return;
+        }
+    }
+
+    node->node.key = hash;
+    node->len = (u_short) name->len;
+    ngx_memcpy(node->name, name->data, name->len);
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, &node->node);
+
+update:
+
+    ngx_queue_insert_head(&ctx->sh->queue, &node->queue);
+
+    node->validated = now;
+    node->err = of->err;
+
+#if (NGX_HAVE_OPENAT)
+    node->disable_symlinks = of->disable_symlinks;
+    node->disable_symlinks_from = of->disable_symlinks_from;
+#endif
+
+    if (of->err == 0) {
+        node->uniq = of->uniq;
+        node->mtime = of->mtime;
+        node->size = of->size;
+
+        node->is_dir = of->is_dir;
+        node->is_file = of->is_file;
+        node->is_link = of->is_link;
+        node->is_exec = of->is_exec;
+
+    } else {
+        node->uniq = 0;
+        node->is_dir = 0;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+
+static ngx_open_file_cache_node_t *
+ngx_open_file_cache_sh_find(ngx_open_file_cache_zone_t *ctx, ngx_str_t *name,
+    uint32_t hash)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_open_file_cache_node_t  *file;
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        file = (ngx_open_file_cache_node_t *) node;
+
+        rc = ngx_memn2cmp(name->data, file->name, name->len,
+                          (size_t) file->len);
+
+        if (rc == 0) {
+            return file;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_open_file_cache_sh_expire(ngx_open_file_cache_zone_t *ctx,
+    ngx_uint_t force, time_t expire)
+{
+    ngx_uint_t                   n;
+    ngx_queue_t                 *q;
+    ngx_open_file_cache_node_t  *node;
+
+    /*
+     * remove up to two entries not validated since "expire",
+     * and the oldest one unconditionally if forced
+     */
+
+    for (n = 0; n < 2 + force; n++) {
+
+        if (ngx_queue_empty(&ctx->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&ctx->sh->queue);
+
+        node = ngx_queue_data(q, ngx_open_file_cache_node_t, queue);
+
+        if (!(force && n == 0) && node->validated > expire) {
+            return;
+        }
+
+        ngx_queue_remove(q);
+
+        ngx_rbtree_delete(&ctx->sh->rbtree, &node->node);
+
+        ngx_slab_free_locked(ctx->shpool, node);
+    }
+}
+
+
+static void
+ngx_open_file_cache_sh_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_open_file_cache_node_t   *file, *file_temp;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            file = (ngx_open_file_cache_node_t *) node;
+            file_temp = (ngx_open_file_cache_node_t *) temp;
+
+            p = (ngx_memn2cmp(file->name, file_temp->name,
+                              file->len, file_temp->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
 static void
 ngx_open_file_cache_remove(ngx_event_t *ev)
 {
@@ -96,9 +96,52 @@ typedef struct {
     ngx_uint_t               current;
     ngx_uint_t               max;
     time_t                   inactive;
+
+    ngx_shm_zone_t          *shm_zone;
 } ngx_open_file_cache_t;
 
 
+/* stat() results shared between workers, file descriptors are not */
+
+typedef struct {
+    ngx_rbtree_node_t        node;
+    ngx_queue_t              queue;
+
+    time_t                   validated;
+
+    ngx_file_uniq_t          uniq;
+    time_t                   mtime;
+    off_t                    size;
+    ngx_err_t                err;
+
+#if (NGX_HAVE_OPENAT)
+    size_t                   disable_symlinks_from;
+    unsigned                 disable_symlinks:2;
+#endif
+
+    unsigned                 is_dir:1;
+    unsigned                 is_file:1;
+    unsigned                 is_link:1;
+    unsigned                 is_exec:1;
+
+    u_short                  len;
+    u_char                   name[1];
+} ngx_open_file_cache_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t             rbtree;
+    ngx_rbtree_node_t        sentinel;
+    ngx_queue_t              queue;
+} ngx_open_file_cache_sh_t;
+
+
+typedef struct {
+    ngx_open_file_cache_sh_t  *sh;
+    ngx_slab_pool_t           *shpool;
+} ngx_open_file_cache_zone_t;
+
+
 typedef struct {
     ngx_open_file_cache_t   *cache;
     ngx_cached_open_file_t  *file;
@@ -122,6 +165,8 @@ typedef struct {
 
 ngx_open_file_cache_t *ngx_open_file_cache_init(ngx_pool_t *pool,
     ngx_uint_t max, time_t inactive);
+ngx_int_t ngx_open_file_cache_add_zone(ngx_conf_t *cf,
+    ngx_open_file_cache_t *cache, ngx_str_t *name, size_t size, void *tag);
 ngx_int_t ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_pool_t *pool);
 
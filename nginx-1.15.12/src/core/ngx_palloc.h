@@ -25,7 +25,6 @@
 #define NGX_MIN_POOL_SIZE                                                     \
     ngx_align((sizeof(ngx_pool_t) + 2 * sizeof(ngx_pool_large_t)),            \
               NGX_POOL_ALIGNMENT)
-0
 
 typedef void (*ngx_pool_cleanup_pt)(void *data);
 
@@ -69,18 +69,62 @@
 
 #endif
 
+
+#define NGX_SLAB_MAGAZINE_SIZE  16
+#define NGX_SLAB_CACHE_RATIO    8
+#define NGX_SLAB_NO_SLOT        ((ngx_uint_t) -1)
+
+
+typedef struct {
+    ngx_uint_t             nelts;
+    ngx_uint_t             size;
+    ngx_uint_t             hits;
+    void                  *elts[NGX_SLAB_MAGAZINE_SIZE];
+} ngx_slab_magazine_t;
+
+
+typedef struct ngx_slab_cache_s  ngx_slab_cache_t;
+
+struct ngx_slab_cache_s {
+    ngx_slab_pool_t       *pool;
+    ngx_slab_cache_t      *next;
+    ngx_uint_t             nslots;
+    ngx_uint_t             cached;
+    ngx_slab_magazine_t   *mags;
+};
+
+
+static void *ngx_slab_alloc_chunk(ngx_slab_pool_t *pool, size_t size);
+static void ngx_slab_free_chunk(ngx_slab_pool_t *pool, void *p);
 static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool,
     ngx_uint_t pages);
 static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
     ngx_uint_t pages);
 static void ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level,
     char *text);
+static ngx_uint_t ngx_slab_slot(ngx_slab_pool_t *pool, size_t size);
+static ngx_uint_t ngx_slab_chunk_slot(ngx_slab_pool_t *pool, void *p);
+static ngx_slab_cache_t *ngx_slab_cache(ngx_slab_pool_t *pool);
+static void ngx_slab_cache_stats(ngx_slab_pool_t *pool,
+    ngx_slab_cache_t *cache);
+static void ngx_slab_cache_flush_locked(ngx_slab_pool_t *pool,
+    ngx_slab_cache_t *cache);
 
 
 static ngx_uint_t  ngx_slab_max_size;
 static ngx_uint_t  ngx_slab_exact_size;
 static ngx_uint_t  ngx_slab_exact_shift;
 
+/*
+ * per-worker magazines of free chunks, one per slot of each pool;
+ * the chunks in them are still accounted as used in the pool and
+ * are returned when a worker exits: those of a worker which exited
+ * abnormally are lost until the zone is recreated, at most a page
+ * per slot for each crash, see ngx_slab_cache()
+ */
+static ngx_slab_cache_t  *ngx_slab_caches;
+static ngx_uint_t         ngx_slab_caches_flushed;
+
 
 void
 ngx_slab_sizes_init(void)
@@ -168,12 +212,64 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 void *
 ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 {
-    void  *p;
+    void                 *p, *c;
+    ngx_uint_t            i, n, nomem;
+    ngx_slab_cache_t     *cache;
+    ngx_slab_magazine_t  *mag;
+
+    cache = ngx_slab_cache(pool);
+
+    if (cache == NULL || size > ngx_slab_max_size) {
+        ngx_shmtx_lock(&pool->mutex);
+
+        p = ngx_slab_alloc_locked(pool, size);
+
+        ngx_shmtx_unlock(&pool->mutex);
+
+        return p;
+    }
+
+    mag = &cache->mags[ngx_slab_slot(pool, size)];
+
+    if (mag->nelts) {
+        mag->hits++;
+        cache->cached--;
+
+        return mag->elts[--mag->nelts];
+    }
 
     ngx_shmtx_lock(&pool->mutex);
 
+    ngx_slab_cache_stats(pool, cache);
+
     p = ngx_slab_alloc_locked(pool, size);
 
+    if (p) {
+
+        /*
+         * refill a half of the magazine while the lock is held,
+         * running short of memory here is not an allocation failure
+         */
+
+        n = mag->size / 2;
+
+        nomem = pool->log_nomem;
+        pool->log_nomem = 0;
+
+        for (i = 0; i < n; i++) {
+            c = ngx_slab_alloc_chunk(pool, size);
+            if (c == NULL) {
+                break;
+            }
+
+            mag->elts[mag->nelts++] = c;
+        }
+
+        pool->log_nomem = nomem;
+
+        cache->cached += i;
+    }
+
     ngx_shmtx_unlock(&pool->mutex);
 
     return p;
@@ -182,6 +278,70 @@ ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 
 void *
 ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
+{
+    void                 *p;
+    ngx_uint_t            slot, nomem;
+    ngx_slab_cache_t     *cache;
+    ngx_slab_magazine_t  *mag;
+
+    cache = ngx_slab_cache(pool);
+
+    slot = 0;
+
+    if (size <= ngx_slab_max_size) {
+        slot = ngx_slab_slot(pool, size);
+
+        pool->stats[slot].reqs++;
+
+        if (cache) {
+            mag = &cache->mags[slot];
+
+            if (mag->nelts) {
+                pool->stats[slot].hits++;
+                cache->cached--;
+
+                return mag->elts[--mag->nelts];
+            }
+
+            pool->stats[slot].misses++;
+        }
+    }
+
+    if (cache == NULL || cache->cached == 0) {
+        p = ngx_slab_alloc_chunk(pool, size);
+        goto done;
+    }
+
+    /*
+     * the memory we are short of may be sitting in our own magazines,
+     * so fail quietly first, return them, and try again
+     */
+
+    nomem = pool->log_nomem;
+    pool->log_nomem = 0;
+
+    p = ngx_slab_alloc_chunk(pool, size);
+
+    pool->log_nomem = nomem;
+
+    if (p == NULL) {
+        ngx_slab_cache_flush_locked(pool, cache);
+
+        p = ngx_slab_alloc_chunk(pool, size);
+    }
+
+done:
+
+    if (p == NULL && size <= ngx_slab_max_size) {
+        pool->stats[slot].fails++;
+    }
+
+    return p;
+}
+
+
+static void *
+ngx_slab_alloc_chunk(ngx_slab_pool_t *pool, size_t size)
 {
     size_t            s;
     uintptr_t         p, m, mask, *bitmap;
@@ -215,8 +375,6 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
         slot = 0;
     }
 
-    pool->stats[slot].reqs++;
-
     ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
                    "slab alloc: %uz slot: %ui", size, slot);
 
@@ -406,8 +564,6 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
     p = 0;
 
-    pool->stats[slot].fails++;
-
 done:
 
     ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
@@ -422,11 +578,10 @@ ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size)
 {
     void  *p;
 
-    ngx_shmtx_lock(&pool->mutex);
-
-    p = ngx_slab_calloc_locked(pool, size);
-
-    ngx_shmtx_unlock(&pool->mutex);
+    p = ngx_slab_alloc(pool, size);
+    if (p) {
+        ngx_memzero(p, size);
+    }
 
     return p;
 }
@@ -449,16 +604,87 @@ ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size)
 void
 ngx_slab_free(ngx_slab_pool_t *pool, void *p)
 {
-    ngx_shmtx_lock(&pool->mutex);
+    ngx_uint_t            i, n, slot;
+    ngx_slab_cache_t     *cache;
+    ngx_slab_magazine_t  *mag;
 
-    ngx_slab_free_locked(pool, p);
+    cache = ngx_slab_cache(pool);
 
-    ngx_shmtx_unlock(&pool->mutex);
+    slot = cache ? ngx_slab_chunk_slot(pool, p) : NGX_SLAB_NO_SLOT;
+
+    if (slot == NGX_SLAB_NO_SLOT) {
+        ngx_shmtx_lock(&pool->mutex);
+
+        ngx_slab_free_locked(pool, p);
+
+        ngx_shmtx_unlock(&pool->mutex);
+
+        return;
+    }
+
+    mag = &cache->mags[slot];
+
+    if (mag->nelts == mag->size) {
+
+        /* return the older half of the magazine in one batch */
+
+        n = (mag->size + 1) / 2;
+
+        ngx_shmtx_lock(&pool->mutex);
+
+        ngx_slab_cache_stats(pool, cache);
+
+        for (i = 0; i < n; i++) {
+            ngx_slab_free_chunk(pool, mag->elts[i]);
+        }
+
+        ngx_shmtx_unlock(&pool->mutex);
+
+        mag->nelts -= n;
+        cache->cached -= n;
+
+        ngx_memmove(mag->elts, &mag->elts[n], mag->nelts * sizeof(void *));
+    }
+
+    ngx_slab_junk(p, (size_t) 1 << (slot + pool->min_shift));
+
+    mag->elts[mag->nelts++] = p;
+    cache->cached++;
 }
 
 
 void
 ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
+{
+    ngx_uint_t            slot;
+    ngx_slab_cache_t     *cache;
+    ngx_slab_magazine_t  *mag;
+
+    cache = ngx_slab_cache(pool);
+
+    if (cache) {
+        slot = ngx_slab_chunk_slot(pool, p);
+
+        if (slot != NGX_SLAB_NO_SLOT) {
+            mag = &cache->mags[slot];
+
+            if (mag->nelts < mag->size) {
+                ngx_slab_junk(p, (size_t) 1 << (slot + pool->min_shift));
+
+                mag->elts[mag->nelts++] = p;
+                cache->cached++;
+
+                return;
+            }
+        }
+    }
+
+    ngx_slab_free_chunk(pool, p);
+}
+
+
+static void
+ngx_slab_free_chunk(ngx_slab_pool_t *pool, void *p)
 {
     size_t            size;
     uintptr_t         slab, m, *bitmap;
@@ -810,6 +1036,194 @@ ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
 }
 
 
+static ngx_uint_t
+ngx_slab_slot(ngx_slab_pool_t *pool, size_t size)
+{
+    size_t      s;
+    ngx_uint_t  shift;
+
+    if (size <= pool->min_size) {
+        return 0;
+    }
+
+    shift = 1;
+    for (s = size - 1; s >>= 1; shift++) { /* void */ }
+
+    return shift - pool->min_shift;
+}
+
+
+static ngx_uint_t
+ngx_slab_chunk_slot(ngx_slab_pool_t *pool, void *p)
+{
+    ngx_uint_t        shift;
+    ngx_slab_page_t  *page;
+
+    /* invalid pointers are left to ngx_slab_free_chunk() to complain about */
+
+    if ((u_char *) p < pool->start || (u_char *) p >= pool->end) {
+        return NGX_SLAB_NO_SLOT;
+    }
+
+    /*
+     * the page cannot change its type while the chunk is allocated,
+     * so it is safe to look at it without the lock
+     */
+
+    page = &pool->pages[((u_char *) p - pool->start) >> ngx_pagesize_shift];
+
+    switch (ngx_slab_page_type(page)) {
+
+    case NGX_SLAB_SMALL:
+    case NGX_SLAB_BIG:
+        shift = page->slab & NGX_SLAB_SHIFT_MASK;
+        break;
+
+    case NGX_SLAB_EXACT:
+        shift = ngx_slab_exact_shift;
+        break;
+
+    default: /* NGX_SLAB_PAGE */
+        return NGX_SLAB_NO_SLOT;
+    }
+
+    if ((uintptr_t) p & (((uintptr_t) 1 << shift) - 1)) {
+        return NGX_SLAB_NO_SLOT;
+    }
+
+    return shift - pool->min_shift;
+}
+
+
+static ngx_slab_cache_t *
+ngx_slab_cache(ngx_slab_pool_t *pool)
+{
+    ngx_uint_t         i, n, shift;
+    ngx_core_conf_t   *ccf;
+    ngx_slab_cache_t  *cache;
+
+    /*
+     * magazines are kept in worker processes only: the master process
+     * and the helpers may (re)initialize pools underneath them
+     */
+
+    if (ngx_process != NGX_PROCESS_WORKER || ngx_slab_caches_flushed) {
+        return NULL;
+    }
+
+    for (cache = ngx_slab_caches; cache; cache = cache->next) {
+        if (cache->pool == pool) {
+            return cache->nslots ? cache : NULL;
+        }
+    }
+
+    n = ngx_pagesize_shift - pool->min_shift;
+
+    /*
+     * a worker holds at most a page worth of chunks per slot, so the
+     * magazines are only enabled if all workers together cannot take
+     * more than a small part of the zone
+     */
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                           ngx_core_module);
+
+    if ((ngx_uint_t) (pool->last - pool->pages)
+        < NGX_SLAB_CACHE_RATIO * n * (ngx_uint_t) ccf->worker_processes)
+    {
+        n = 0;
+    }
+
+    cache = ngx_alloc(sizeof(ngx_slab_cache_t)
+                      + n * sizeof(ngx_slab_magazine_t), ngx_cycle->log);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->pool = pool;
+    cache->nslots = n;
+    cache->cached = 0;
+    cache->mags = (ngx_slab_magazine_t *) &cache[1];
+
+    for (i = 0; i < n; i++) {
+        shift = pool->min_shift + i;
+
+        cache->mags[i].nelts = 0;
+        cache->mags[i].size = ngx_min(NGX_SLAB_MAGAZINE_SIZE,
+                                      ngx_pagesize >> shift);
+        cache->mags[i].hits = 0;
+    }
+
+    cache->next = ngx_slab_caches;
+    ngx_slab_caches = cache;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
+                   "slab cache: %p slots: %ui", pool, n);
+
+    return n ? cache : NULL;
+}
+
+
+static void
+ngx_slab_cache_stats(ngx_slab_pool_t *pool, ngx_slab_cache_t *cache)
+{
+    ngx_uint_t  i;
+
+    /* magazine hits outside of the lock are accounted here */
+
+    for (i = 0; i < cache->nslots; i++) {
+        pool->stats[i].reqs += cache->mags[i].hits;
+        pool->stats[i].hits += cache->mags[i].hits;
+        cache->mags[i].hits = 0;
+    }
+}
+
+
+static void
+ngx_slab_cache_flush_locked(ngx_slab_pool_t *pool, ngx_slab_cache_t *cache)
+{
+    ngx_uint_t            i;
+    ngx_slab_magazine_t  *mag;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
+                   "slab cache flush: %p chunks: %ui", pool, cache->cached);
+
+    ngx_slab_cache_stats(pool, cache);
+
+    for (i = 0; i < cache->nslots; i++) {
+        mag = &cache->mags[i];
+
+        while (mag->nelts) {
+            ngx_slab_free_chunk(pool, mag->elts[--mag->nelts]);
+        }
+    }
+
+    cache->cached = 0;
+}
+
+
+void
+ngx_slab_flush_caches(void)
+{
+    ngx_slab_cache_t  *cache;
+
+    ngx_slab_caches_flushed = 1;
+
+    for (cache = ngx_slab_caches; cache; cache = cache->next) {
+
+        if (cache->nslots == 0) {
+            continue;
+        }
+
+        ngx_shmtx_lock(&cache->pool->mutex);
+
+        ngx_slab_cache_flush_locked(cache->pool, cache);
+
+        ngx_shmtx_unlock(&cache->pool->mutex);
+    }
+}
+
+
 static void
 ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level, char *text)
 {
@@ -28,6 +28,9 @@ typedef struct {
 
     ngx_uint_t        reqs;
     ngx_uint_t        fails;
+
+    ngx_uint_t        hits;
+    ngx_uint_t        misses;
 } ngx_slab_stat_t;
 
 
@@ -67,6 +70,7 @@ void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size);
 void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
 void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+void ngx_slab_flush_caches(void);
 
 
 #endif /* _NGX_SLAB_H_INCLUDED_ */
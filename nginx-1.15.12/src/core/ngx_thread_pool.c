@@ -38,6 +38,12 @@ struct ngx_thread_pool_s {
     ngx_uint_t                threads;
     ngx_int_t                 max_queue;
 
+    /* statistics, updated under the mutex */
+    ngx_uint_t                tasks;
+    ngx_int_t                 max_waiting;
+    ngx_msec_t                wait_time;
+    ngx_msec_t                max_wait;
+
     u_char                   *file;
     ngx_uint_t                line;
 };
@@ -99,8 +105,18 @@ ngx_module_t  ngx_thread_pool_module = {
 static ngx_str_t  ngx_thread_pool_default = ngx_string("default");
 
 static ngx_uint_t               ngx_thread_pool_task_id;
-static ngx_atomic_t             ngx_thread_pool_done_lock;
-static ngx_thread_pool_queue_t  ngx_thread_pool_done;
+
+/*
+ * completed tasks are pushed onto a lock-free LIFO list by the threads,
+ * the event loop takes the whole list at once and restores the order
+ */
+static ngx_atomic_t             ngx_thread_pool_done;
+
+/*
+ * set while a notification is delivered but not yet handled,
+ * it is reset if the notification fails so the next completion retries
+ */
+static ngx_atomic_t             ngx_thread_pool_notified;
 
 
 static ngx_int_t
@@ -252,6 +268,7 @@ ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
     task->event.active = 1;
 
     task->id = ngx_thread_pool_task_id++;
+    task->posted = ngx_current_msec;
     task->next = NULL;
 
     if (ngx_thread_cond_signal(&tp->cond, tp->log) != NGX_OK) {
@@ -264,6 +281,10 @@ ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
 
     tp->waiting++;
 
+    if (tp->waiting > tp->max_waiting) {
+        tp->max_waiting = tp->waiting;
+    }
+
     (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
 
     ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
@@ -281,6 +302,8 @@ ngx_thread_pool_cycle(void *data)
 
     int                 err;
     sigset_t            set;
+    ngx_msec_t          wait;
+    ngx_atomic_uint_t   done;
     ngx_thread_task_t  *task;
 
 #if 0
@@ -327,6 +350,17 @@ ngx_thread_pool_cycle(void *data)
             tp->queue.last = &tp->queue.first;
         }
 
+        /* ngx_current_msec is only updated by the event loop, it is coarse */
+
+        wait = ngx_current_msec - task->posted;
+
+        tp->tasks++;
+        tp->wait_time += wait;
+
+        if (wait > tp->max_wait) {
+            tp->max_wait = wait;
+        }
+
         if (ngx_thread_mutex_unlock(&tp->mtx, tp->log) != NGX_OK) {
             return NULL;
         }
@@ -345,18 +379,28 @@ ngx_thread_pool_cycle(void *data)
                        "complete task #%ui in thread pool \"%V\"",
                        task->id, &tp->name);
 
-        task->next = NULL;
-
-        ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
+        do {
+            done = ngx_thread_pool_done;
+            task->next = (ngx_thread_task_t *) done;
 
-        *ngx_thread_pool_done.last = task;
-        ngx_thread_pool_done.last = &task->next;
+        } while (!ngx_atomic_cmp_set(&ngx_thread_pool_done, done,
+                                     (ngx_atomic_uint_t) task));
 
-        ngx_memory_barrier();
+        /*
+         * the handler takes the whole list, so the notification is
+         * only needed when no delivered notification is pending:
+         * other completions are picked up by the pending handler
+         */
 
-        ngx_unlock(&ngx_thread_pool_done_lock);
+        if (ngx_atomic_cmp_set(&ngx_thread_pool_notified, 0, 1)
+            && ngx_notify(ngx_thread_pool_handler) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
+                          "thread pool \"%V\" notification failed, "
+                          "retrying on the next completion", &tp->name);
 
-        (void) ngx_notify(ngx_thread_pool_handler);
+            ngx_thread_pool_notified = 0;
+        }
     }
 }
 
@@ -365,19 +409,30 @@ static void
 ngx_thread_pool_handler(ngx_event_t *ev)
 {
     ngx_event_t        *event;
-    ngx_thread_task_t  *task;
+    ngx_atomic_uint_t   done;
+    ngx_thread_task_t  *task, *next;
 
     ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "thread pool handler");
 
-    ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
+    /* the completions pushed after this point are notified again */
 
-    task = ngx_thread_pool_done.first;
-    ngx_thread_pool_done.first = NULL;
-    ngx_thread_pool_done.last = &ngx_thread_pool_done.first;
+    ngx_thread_pool_notified = 0;
 
-    ngx_memory_barrier();
+    do {
+        done = ngx_thread_pool_done;
 
-    ngx_unlock(&ngx_thread_pool_done_lock);
+    } while (!ngx_atomic_cmp_set(&ngx_thread_pool_done, done, 0));
+
+    /* restore the order of completion */
+
+    task = NULL;
+
+    while (done) {
+        next = ((ngx_thread_task_t *) done)->next;
+        ((ngx_thread_task_t *) done)->next = task;
+        task = (ngx_thread_task_t *) done;
+        done = (ngx_atomic_uint_t) next;
+    }
 
     while (task) {
         ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
@@ -599,7 +654,8 @@ ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
         return NGX_OK;
     }
 
-    ngx_thread_pool_queue_init(&ngx_thread_pool_done);
+    ngx_thread_pool_done = 0;
+    ngx_thread_pool_notified = 0;
 
     tpp = tcf->pools.elts;
 
@@ -637,5 +693,12 @@ ngx_thread_pool_exit_worker(ngx_cycle_t *cycle)
 
     for (i = 0; i < tcf->pools.nelts; i++) {
         ngx_thread_pool_destroy(tpp[i]);
+
+        ngx_log_error(NGX_LOG_INFO, cycle->log, 0,
+                      "thread pool \"%V\": %ui tasks, max queue %i, "
+                      "avg wait %M ms, max wait %M ms",
+                      &tpp[i]->name, tpp[i]->tasks, tpp[i]->max_waiting,
+                      tpp[i]->tasks ? tpp[i]->wait_time / tpp[i]->tasks : 0,
+                      tpp[i]->max_wait);
     }
 }
@@ -0,0 +1,873 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * The io_uring module uses the ring as a readiness notification mechanism:
+ * every read or write event is a multishot IORING_OP_POLL_ADD request,
+ * so the module works with the existing nginx i/o layer the same way as
+ * the epoll module does.  The difference is that the interest changes
+ * are not passed to a kernel one by one as epoll_ctl() calls, but are
+ * queued in the submission ring and are submitted together with waiting
+ * for the next events by a single io_uring_enter() call.
+ *
+ * The file AIO reads are also passed through the same ring as
+ * IORING_OP_READ requests instead of the io_submit() and eventfd pair.
+ */
+
+
+#define NGX_URING_INSTANCE   1
+#define NGX_URING_AIO        2
+
+
+typedef struct {
+    ngx_uint_t  entries;
+} ngx_uring_conf_t;
+
+
+static ngx_int_t ngx_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_uring_setup(ngx_cycle_t *cycle, ngx_uint_t entries);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_uring_notify_init(ngx_log_t *log);
+static void ngx_uring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_uring_done(ngx_cycle_t *cycle);
+static ngx_int_t ngx_uring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_uring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_uring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_uring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+
+static struct io_uring_sqe *ngx_uring_get_sqe(ngx_log_t *log);
+static ngx_int_t ngx_uring_poll_add(ngx_event_t *ev, ngx_fd_t fd,
+    ngx_log_t *log);
+static ngx_int_t ngx_uring_submit(ngx_log_t *log);
+
+static void *ngx_uring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_uring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+
+static int                   ring = -1;
+
+static void                 *sq_ring;
+static size_t                sq_ring_size;
+static void                 *cq_ring;
+static size_t                cq_ring_size;
+static struct io_uring_sqe  *sqes;
+static size_t                sqes_size;
+
+static uint32_t             *sq_khead;
+static uint32_t             *sq_ktail;
+static uint32_t             *sq_array;
+static uint32_t              sq_mask;
+static uint32_t              sq_entries;
+static uint32_t              sq_tail;
+
+static uint32_t             *cq_khead;
+static uint32_t             *cq_ktail;
+static uint32_t              cq_mask;
+static struct io_uring_cqe  *cqes;
+
+#if (NGX_HAVE_EVENTFD)
+static int                   notify_fd = -1;
+static ngx_event_t           notify_event;
+static ngx_connection_t      notify_conn;
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+ngx_uint_t                   ngx_uring_aio;
+#endif
+
+static ngx_str_t      uring_name = ngx_string("uring");
+
+static ngx_command_t  ngx_uring_commands[] = {
+
+    { ngx_string("uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_uring_conf_t, entries),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_event_module_t  ngx_uring_module_ctx = {
+    &uring_name,
+    ngx_uring_create_conf,               /* create configuration */
+    ngx_uring_init_conf,                 /* init configuration */
+
+    {
+        ngx_uring_add_event,             /* add an event */
+        ngx_uring_del_event,             /* delete an event */
+        ngx_uring_add_event,             /* enable an event */
+        ngx_uring_del_event,             /* disable an event */
+        NULL,                            /* add an connection */
+        NULL,                            /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_uring_notify,                /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_uring_process_events,        /* process the events */
+        ngx_uring_init,                  /* init the events */
+        ngx_uring_done,                  /* done the events */
+    }
+};
+
+ngx_module_t  ngx_uring_module = {
+    NGX_MODULE_V1,
+    &ngx_uring_module_ctx,               /* module context */
+    ngx_uring_commands,                  /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup() and io_uring_enter() directly as syscalls
+ * instead of liburing usage to avoid an additional library dependency.
+ */
+
+static int
+io_uring_setup(u_int entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, u_int to_submit, u_int min_complete, u_int flags,
+    void *arg, size_t argsz)
+{
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+
+static ngx_int_t
+ngx_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_uring_conf_t  *urcf;
+
+    urcf = ngx_event_get_conf(cycle->conf_ctx, ngx_uring_module);
+
+    if (ring == -1) {
+        if (ngx_uring_setup(cycle, urcf->entries) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_uring_notify_init(cycle->log) != NGX_OK) {
+            ngx_uring_module_ctx.actions.notify = NULL;
+        }
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+        ngx_uring_aio = ngx_file_aio;
+#endif
+    }
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_uring_module_ctx.actions;
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT|NGX_USE_GREEDY_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_setup(ngx_cycle_t *cycle, ngx_uint_t entries)
+{
+    u_char                 *p;
+    struct io_uring_params  params;
+
+    ngx_memzero(&params, sizeof(struct io_uring_params));
+
+    ring = io_uring_setup(entries, &params);
+
+    if (ring == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "io_uring does not support IORING_FEAT_EXT_ARG");
+        goto failed;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_ring_size = params.cq_off.cqes
+                   + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size = ngx_max(sq_ring_size, cq_ring_size);
+        cq_ring_size = 0;
+    }
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+
+    if (sq_ring == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        sq_ring = NULL;
+        goto failed;
+    }
+
+    if (cq_ring_size) {
+        cq_ring = mmap(NULL, cq_ring_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+
+        if (cq_ring == MAP_FAILED) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "mmap(IORING_OFF_CQ_RING) failed");
+            cq_ring = NULL;
+            goto failed;
+        }
+
+    } else {
+        cq_ring = sq_ring;
+    }
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        sqes = NULL;
+        goto failed;
+    }
+
+    p = sq_ring;
+
+    sq_khead = (uint32_t *) (p + params.sq_off.head);
+    sq_ktail = (uint32_t *) (p + params.sq_off.tail);
+    sq_array = (uint32_t *) (p + params.sq_off.array);
+    sq_mask = *(uint32_t *) (p + params.sq_off.ring_mask);
+    sq_entries = *(uint32_t *) (p + params.sq_off.ring_entries);
+    sq_tail = *sq_ktail;
+
+    p = cq_ring;
+
+    cq_khead = (uint32_t *) (p + params.cq_off.head);
+    cq_ktail = (uint32_t *) (p + params.cq_off.tail);
+    cq_mask = *(uint32_t *) (p + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (p + params.cq_off.cqes);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%uD cq:%uD",
+                   ring, params.sq_entries, params.cq_entries);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_uring_done(cycle);
+
+    return NGX_ERROR;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_uring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_uring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.log = log;
+
+    if (ngx_uring_poll_add(&notify_event, notify_fd, log) != NGX_OK) {
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_uring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+static void
+ngx_uring_done(ngx_cycle_t *cycle)
+{
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1) {
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+    }
+
+#endif
+
+    if (sqes) {
+        if (munmap(sqes, sqes_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_SQES) failed");
+        }
+
+        sqes = NULL;
+    }
+
+    if (cq_ring && cq_ring != sq_ring) {
+        if (munmap(cq_ring, cq_ring_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_CQ_RING) failed");
+        }
+    }
+
+    cq_ring = NULL;
+
+    if (sq_ring) {
+        if (munmap(sq_ring, sq_ring_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_SQ_RING) failed");
+        }
+
+        sq_ring = NULL;
+    }
+
+    if (ring != -1 && close(ring) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring = -1;
+
+#if (NGX_HAVE_FILE_AIO)
+    ngx_uring_aio = 0;
+#endif
+}
+
+
+static ngx_int_t
+ngx_uring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    /*
+     * a multishot poll request notifies only the changes as EPOLLET does,
+     * the level events, e.g. of the listening sockets, are emulated
+     * by oneshot poll requests which are rearmed after a notification
+     */
+
+    ev->oneshot = (flags & NGX_CLEAR_EVENT) ? 0 : 1;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "uring add event: fd:%d w:%d oneshot:%d",
+                   c->fd, ev->write, ev->oneshot);
+
+    if (ngx_uring_poll_add(ev, c->fd, ev->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ev->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    struct io_uring_sqe  *sqe;
+#if (NGX_DEBUG)
+    ngx_connection_t     *c;
+#endif
+
+    /*
+     * the poll request holds a reference to the file, so unlike epoll
+     * it has to be removed explicitly even if the file descriptor
+     * is going to be closed, otherwise the socket would not be closed
+     */
+
+#if (NGX_DEBUG)
+    c = ev->data;
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "uring del event: fd:%d w:%d", c->fd, ev->write);
+#endif
+
+    sqe = ngx_uring_get_sqe(ev->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) ev | ev->instance;
+    sqe->user_data = 0;
+
+    ev->active = 0;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_uring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                             n;
+    uint32_t                        head, tail, revents, cflags;
+    int32_t                         res;
+    uint64_t                        data;
+    ngx_int_t                       instance, events;
+    ngx_uint_t                      level, submit;
+    ngx_err_t                       err;
+    ngx_event_t                    *ev;
+    ngx_queue_t                    *queue;
+    ngx_connection_t               *c;
+    struct io_uring_cqe            *cqe;
+    struct __kernel_timespec        ts;
+    struct io_uring_getevents_arg   arg;
+#if (NGX_HAVE_FILE_AIO)
+    ngx_event_aio_t                *aio;
+#endif
+
+    submit = sq_tail - *sq_khead;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "uring timer: %M, submit: %ui", timer, submit);
+
+    ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+
+    if (timer != NGX_TIMER_INFINITE) {
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (timer % 1000) * 1000000;
+        arg.ts = (uintptr_t) &ts;
+    }
+
+    n = io_uring_enter(ring, submit, 1,
+                       IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(struct io_uring_getevents_arg));
+
+    err = (n == -1) ? ngx_errno : 0;
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err && err != ETIME) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    events = 0;
+
+    head = *cq_khead;
+
+    for ( ;; ) {
+        tail = *cq_ktail;
+        ngx_memory_barrier();
+
+        if (head == tail) {
+            break;
+        }
+
+        cqe = &cqes[head & cq_mask];
+
+        data = cqe->user_data;
+        res = cqe->res;
+        cflags = cqe->flags;
+
+        ngx_memory_barrier();
+        *cq_khead = ++head;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "uring: data:%XL res:%D flags:%XD", data, res, cflags);
+
+        /*
+         * all completions are counted, the removal ones too: a wait
+         * can legitimately end with nothing but them
+         */
+
+        events++;
+
+        if (data == 0) {
+            /* poll removal completion */
+            continue;
+        }
+
+#if (NGX_HAVE_FILE_AIO)
+
+        if (data & NGX_URING_AIO) {
+            ev = (ngx_event_t *) (uintptr_t) (data & ~(uint64_t) NGX_URING_AIO);
+
+            ev->complete = 1;
+            ev->active = 0;
+            ev->ready = 1;
+
+            aio = ev->data;
+            aio->res = res;
+
+            ngx_post_event(ev, &ngx_posted_events);
+
+            continue;
+        }
+
+#endif
+
+        instance = data & NGX_URING_INSTANCE;
+        ev = (ngx_event_t *) (uintptr_t) (data & ~(uint64_t) NGX_URING_INSTANCE);
+
+#if (NGX_HAVE_EVENTFD)
+
+        if (ev == &notify_event) {
+
+            if (res < 0) {
+                ngx_log_error(NGX_LOG_ALERT, cycle->log, -res,
+                              "io_uring poll on eventfd %d failed", notify_fd);
+                continue;
+            }
+
+            if (!(cflags & IORING_CQE_F_MORE)
+                && ngx_uring_poll_add(ev, notify_fd, cycle->log) != NGX_OK)
+            {
+                continue;
+            }
+
+            ev->handler(ev);
+            continue;
+        }
+
+#endif
+
+        c = ev->data;
+
+        if (c->fd == -1 || ev->instance != instance || !ev->active) {
+
+            /*
+             * the stale event from a file descriptor
+             * that was just closed or deleted in this iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "uring: stale event %p", ev);
+            continue;
+        }
+
+        if (res == -ECANCELED) {
+            continue;
+        }
+
+        /* the oneshot or terminated multishot request has to be rearmed */
+
+        if (!(cflags & IORING_CQE_F_MORE)
+            && ngx_uring_poll_add(ev, c->fd, cycle->log) != NGX_OK)
+        {
+            ev->active = 0;
+        }
+
+        if (res < 0) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, -res,
+                          "io_uring poll on fd:%d failed", c->fd);
+
+            /* let the handler to get the error */
+
+            revents = POLLERR;
+
+        } else {
+            revents = res;
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "uring: fd:%d w:%d ev:%04XD", c->fd, ev->write, revents);
+
+        if (ev->write) {
+            ev->ready = 1;
+#if (NGX_THREADS)
+            ev->complete = 1;
+#endif
+
+            if (flags & NGX_POST_EVENTS) {
+                ngx_post_event(ev, &ngx_posted_events);
+
+            } else {
+                ev->handler(ev);
+            }
+
+            continue;
+        }
+
+        if (revents & POLLRDHUP) {
+            ev->pending_eof = 1;
+        }
+
+        ev->ready = 1;
+
+        if (flags & NGX_POST_EVENTS) {
+            queue = ev->accept ? &ngx_posted_accept_events
+                               : &ngx_posted_events;
+
+            ngx_post_event(ev, queue);
+
+        } else {
+            ev->handler(ev);
+        }
+    }
+
+    if (events == 0) {
+        if (timer != NGX_TIMER_INFINITE) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring_enter() returned no events without timeout");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+ngx_int_t
+ngx_uring_file_aio_read(ngx_event_aio_t *aio, u_char *buf, size_t size,
+    off_t offset)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_uring_get_sqe(aio->event.log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = aio->fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t) &aio->event | NGX_URING_AIO;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static struct io_uring_sqe *
+ngx_uring_get_sqe(ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    if (sq_tail - *sq_khead >= sq_entries) {
+
+        /* the submission ring is full, flush it without waiting */
+
+        if (ngx_uring_submit(log) != NGX_OK) {
+            return NULL;
+        }
+
+        if (sq_tail - *sq_khead >= sq_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "io_uring submission ring is full");
+            return NULL;
+        }
+    }
+
+    sqe = &sqes[sq_tail & sq_mask];
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    sq_array[sq_tail & sq_mask] = sq_tail & sq_mask;
+    sq_tail++;
+
+    ngx_memory_barrier();
+    *sq_ktail = sq_tail;
+
+    return sqe;
+}
+
+
+static ngx_int_t
+ngx_uring_poll_add(ngx_event_t *ev, ngx_fd_t fd, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = ev->oneshot ? 0 : IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uintptr_t) ev | ev->instance;
+
+    sqe->poll32_events = ev->write ? POLLOUT : POLLIN|POLLRDHUP;
+
+#if !(NGX_HAVE_LITTLE_ENDIAN)
+    sqe->poll32_events = (sqe->poll32_events << 16)
+                         | (sqe->poll32_events >> 16);
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_submit(ngx_log_t *log)
+{
+    int  n;
+
+    n = io_uring_enter(ring, sq_tail - *sq_khead, 0, 0, NULL, 0);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0, "uring submitted: %d", n);
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_uring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_uring_conf_t  *urcf;
+
+    urcf = ngx_palloc(cycle->pool, sizeof(ngx_uring_conf_t));
+    if (urcf == NULL) {
+        return NULL;
+    }
+
+    urcf->entries = NGX_CONF_UNSET;
+
+    return urcf;
+}
+
+
+static char *
+ngx_uring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_uring_conf_t *urcf = conf;
+
+    ngx_conf_init_uint_value(urcf->entries, 1024);
+
+    return NGX_CONF_OK;
+}
@@ -171,6 +171,16 @@ struct ngx_event_aio_s {
     ngx_event_t                event;
 };
 
+
+#if (NGX_HAVE_IO_URING)
+
+extern ngx_uint_t            ngx_uring_aio;
+
+ngx_int_t ngx_uring_file_aio_read(ngx_event_aio_t *aio, u_char *buf,
+    size_t size, off_t offset);
+
+#endif
+
 #endif
 
 
@@ -442,10 +452,13 @@ typedef struct {
     ngx_uint_t    use;
 
     ngx_flag_t    multi_accept;
+    ngx_uint_t    accept_batch;
     ngx_flag_t    accept_mutex;
 
     ngx_msec_t    accept_mutex_delay;
 
+    ngx_uint_t    timer_engine;
+
     u_char       *name;
 
 #if (NGX_DEBUG)
@@ -20,7 +20,7 @@ ngx_event_accept(ngx_event_t *ev)
     socklen_t          socklen;
     ngx_err_t          err;
     ngx_log_t         *log;
-    ngx_uint_t         level;
+    ngx_uint_t         level, accepted;
     ngx_socket_t       s;
     ngx_event_t       *rev, *wev;
     ngx_sockaddr_t     sa;
@@ -53,6 +53,8 @@ ngx_event_accept(ngx_event_t *ev)
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "accept on %V, ready: %d", &ls->addr_text, ev->available);
 
+    accepted = 0;
+
     do {
         socklen = sizeof(ngx_sockaddr_t);
 
@@ -321,6 +323,17 @@ ngx_event_accept(ngx_event_t *ev)
             ev->available--;
         }
 
+        /*
+         * listening sockets are level-triggered, so the connections left
+         * in the queue are reported again by the next iteration
+         */
+
+        if (ecf->accept_batch && ++accepted == ecf->accept_batch) {
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "accept batch %ui reached", accepted);
+            break;
+        }
+
     } while (ev->available);
 }
 
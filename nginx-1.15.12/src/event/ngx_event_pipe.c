@@ -905,6 +905,14 @@ done:
 
 free:
 
+    if (p->progress) {
+        p->progress->offset = p->temp_file->offset;
+
+        if (ngx_atomic_cmp_set(&p->progress->waiting, 1, 0)) {
+            ngx_wakeup_processes((ngx_cycle_t *) ngx_cycle);
+        }
+    }
+
     for (last_free = &p->free_raw_bufs;
          *last_free != NULL;
          last_free = &(*last_free)->next)
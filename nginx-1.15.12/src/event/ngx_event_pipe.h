@@ -22,6 +22,17 @@ typedef ngx_int_t (*ngx_event_pipe_output_filter_pt)(void *data,
                                                      ngx_chain_t *chain);
 
 
+/*
+ * the temp file length published in shared memory for readers in other
+ * processes, "waiting" is set by a reader to be woken up on the next write
+ */
+
+typedef struct {
+    ngx_atomic_t                 offset;
+    ngx_atomic_t                 waiting;
+} ngx_event_pipe_progress_t;
+
+
 struct ngx_event_pipe_s {
     ngx_connection_t  *upstream;
     ngx_connection_t  *downstream;
@@ -95,6 +106,8 @@ struct ngx_event_pipe_s {
 
     ngx_temp_file_t   *temp_file;
 
+    ngx_event_pipe_progress_t        *progress;
+
     /* STUB */ int     num;
 };
 
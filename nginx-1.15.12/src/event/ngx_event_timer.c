@@ -10,9 +10,65 @@
 #include <ngx_event.h>
 
 
+/*
+ * The hierarchical timer wheel: the first level has 256 slots of
+ * 1 millisecond, the next four levels have 64 slots each, and every slot
+ * of a level covers the whole previous level.  The timer is placed to
+ * a slot by its absolute expiration time, and the slots of the upper
+ * levels are cascaded to the lower levels when the wheel time reaches
+ * their start, so the timer addition and deletion are O(1).
+ *
+ * The wheel uses the event timer rbtree node as a list node: the "left"
+ * and "right" fields are the previous and next nodes, the "parent" field
+ * is the slot list head.
+ */
+
+#define NGX_TIMER_WHEEL_LEVEL0_BITS  8
+#define NGX_TIMER_WHEEL_LEVEL_BITS   6
+#define NGX_TIMER_WHEEL_LEVELS       5
+
+#define NGX_TIMER_WHEEL_LEVEL0_SIZE  (1 << NGX_TIMER_WHEEL_LEVEL0_BITS)
+#define NGX_TIMER_WHEEL_LEVEL_SIZE   (1 << NGX_TIMER_WHEEL_LEVEL_BITS)
+
+#define NGX_TIMER_WHEEL_SLOTS                                                 \
+    (NGX_TIMER_WHEEL_LEVEL0_SIZE                                              \
+     + (NGX_TIMER_WHEEL_LEVELS - 1) * NGX_TIMER_WHEEL_LEVEL_SIZE)
+
+#define ngx_timer_wheel_shift(level)                                          \
+    (NGX_TIMER_WHEEL_LEVEL0_BITS + ((level) - 1) * NGX_TIMER_WHEEL_LEVEL_BITS)
+
+#define ngx_timer_wheel_first(level)                                          \
+    (NGX_TIMER_WHEEL_LEVEL0_SIZE + ((level) - 1) * NGX_TIMER_WHEEL_LEVEL_SIZE)
+
+
+typedef struct {
+    ngx_msec_t         current;
+    ngx_uint_t         count;
+    ngx_rbtree_node_t  expired;
+    ngx_rbtree_node_t  slots[NGX_TIMER_WHEEL_SLOTS];
+    uint64_t           bitmap[NGX_TIMER_WHEEL_SLOTS / 64];
+} ngx_event_timer_wheel_t;
+
+
+static void ngx_event_timer_wheel_link(ngx_rbtree_node_t *head,
+    ngx_rbtree_node_t *node);
+static void ngx_event_timer_wheel_cascade(ngx_msec_t tick);
+static ngx_int_t ngx_event_timer_wheel_next(ngx_msec_t from,
+    ngx_msec_t *tick);
+static ngx_int_t ngx_event_timer_wheel_search(ngx_uint_t first, ngx_uint_t n,
+    ngx_uint_t start);
+static ngx_msec_t ngx_event_timer_wheel_find(void);
+static void ngx_event_timer_wheel_expire(void);
+static void ngx_event_timer_wheel_run(ngx_rbtree_node_t *head);
+static ngx_int_t ngx_event_timer_wheel_no_timers_left(void);
+
+
 ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
+ngx_uint_t                ngx_use_timer_wheel;
+static ngx_event_timer_wheel_t  *ngx_event_timer_wheel;
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -22,9 +78,33 @@ static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 ngx_int_t
 ngx_event_timer_init(ngx_log_t *log)
 {
+    ngx_uint_t                i;
+    ngx_event_timer_wheel_t  *w;
+
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
+    if (!ngx_use_timer_wheel || ngx_event_timer_wheel) {
+        return NGX_OK;
+    }
+
+    w = ngx_calloc(sizeof(ngx_event_timer_wheel_t), log);
+    if (w == NULL) {
+        return NGX_ERROR;
+    }
+
+    w->current = ngx_current_msec;
+
+    w->expired.left = &w->expired;
+    w->expired.right = &w->expired;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_SLOTS; i++) {
+        w->slots[i].left = &w->slots[i];
+        w->slots[i].right = &w->slots[i];
+    }
+
+    ngx_event_timer_wheel = w;
+
     return NGX_OK;
 }
 
@@ -35,6 +115,10 @@ ngx_event_find_timer(void)
     ngx_msec_int_t      timer;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_use_timer_wheel) {
+        return ngx_event_timer_wheel_find();
+    }
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
         return NGX_TIMER_INFINITE;
     }
@@ -56,6 +140,11 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_use_timer_wheel) {
+        ngx_event_timer_wheel_expire();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -102,6 +191,10 @@ ngx_event_no_timers_left(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_use_timer_wheel) {
+        return ngx_event_timer_wheel_no_timers_left();
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
     root = ngx_event_timer_rbtree.root;
 
@@ -124,3 +217,345 @@ ngx_event_no_timers_left(void)
 
     return NGX_OK;
 }
+
+
+void
+ngx_event_timer_wheel_insert(ngx_rbtree_node_t *node)
+{
+    ngx_uint_t                level, slot;
+    ngx_msec_t                key;
+    ngx_msec_int_t            diff;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_event_timer_wheel;
+
+    w->count++;
+
+    key = node->key;
+    diff = (ngx_msec_int_t) (key - w->current);
+
+    if (diff < 0) {
+        ngx_event_timer_wheel_link(&w->expired, node);
+        return;
+    }
+
+    if (diff < NGX_TIMER_WHEEL_LEVEL0_SIZE) {
+        slot = key & (NGX_TIMER_WHEEL_LEVEL0_SIZE - 1);
+        goto found;
+    }
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS - 1; level++) {
+        if ((ngx_msec_t) diff
+            < ((ngx_msec_t) 1 << ngx_timer_wheel_shift(level + 1)))
+        {
+            break;
+        }
+    }
+
+#if (NGX_PTR_SIZE == 8)
+
+    if ((ngx_msec_t) diff > 0xffffffff) {
+        /* the timer is rescheduled when the last level slot is cascaded */
+        key = w->current + 0xffffffff;
+    }
+
+#endif
+
+    slot = ngx_timer_wheel_first(level)
+           + ((key >> ngx_timer_wheel_shift(level))
+              & (NGX_TIMER_WHEEL_LEVEL_SIZE - 1));
+
+found:
+
+    w->bitmap[slot / 64] |= (uint64_t) 1 << (slot % 64);
+
+    ngx_event_timer_wheel_link(&w->slots[slot], node);
+}
+
+
+void
+ngx_event_timer_wheel_delete(ngx_rbtree_node_t *node)
+{
+    ngx_uint_t                slot;
+    ngx_rbtree_node_t        *head;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_event_timer_wheel;
+
+    w->count--;
+
+    node->left->right = node->right;
+    node->right->left = node->left;
+
+    head = node->parent;
+
+    if (head->right == head && head != &w->expired) {
+        slot = head - w->slots;
+        w->bitmap[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_link(ngx_rbtree_node_t *head, ngx_rbtree_node_t *node)
+{
+    node->parent = head;
+    node->left = head->left;
+    node->right = head;
+    head->left->right = node;
+    head->left = node;
+}
+
+
+static void
+ngx_event_timer_wheel_cascade(ngx_msec_t tick)
+{
+    ngx_uint_t                level, index, slot;
+    ngx_rbtree_node_t        *head, *node;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_event_timer_wheel;
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        index = (tick >> ngx_timer_wheel_shift(level))
+                & (NGX_TIMER_WHEEL_LEVEL_SIZE - 1);
+
+        slot = ngx_timer_wheel_first(level) + index;
+        head = &w->slots[slot];
+
+        while (head->right != head) {
+            node = head->right;
+
+            ngx_event_timer_wheel_delete(node);
+            ngx_event_timer_wheel_insert(node);
+        }
+
+        /* the next level is cascaded only at its slot boundary */
+
+        if (index != 0) {
+            break;
+        }
+    }
+}
+
+
+/*
+ * finds the nearest tick starting from the "from" one, at which the wheel
+ * has to either expire the first level slot or cascade an upper level slot
+ */
+
+static ngx_int_t
+ngx_event_timer_wheel_next(ngx_msec_t from, ngx_msec_t *tick)
+{
+    ngx_int_t   k;
+    ngx_uint_t  level, shift, found;
+    ngx_msec_t  t, start;
+
+    found = 0;
+
+    k = ngx_event_timer_wheel_search(0, NGX_TIMER_WHEEL_LEVEL0_SIZE,
+                                     from & (NGX_TIMER_WHEEL_LEVEL0_SIZE - 1));
+    if (k != NGX_DECLINED) {
+        *tick = from + k;
+        found = 1;
+    }
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+        shift = ngx_timer_wheel_shift(level);
+
+        /* the first slot boundary of the level not earlier than "from" */
+
+        start = (from + ((ngx_msec_t) 1 << shift) - 1) >> shift;
+
+        k = ngx_event_timer_wheel_search(ngx_timer_wheel_first(level),
+                                         NGX_TIMER_WHEEL_LEVEL_SIZE,
+                                         start
+                                         & (NGX_TIMER_WHEEL_LEVEL_SIZE - 1));
+        if (k == NGX_DECLINED) {
+            continue;
+        }
+
+        t = (start + k) << shift;
+
+        if (!found || (ngx_msec_int_t) (t - *tick) < 0) {
+            *tick = t;
+            found = 1;
+        }
+    }
+
+    return found ? NGX_OK : NGX_DECLINED;
+}
+
+
+/*
+ * returns the offset of the first non-empty slot among the n slots
+ * starting with the "first" one, the search begins from the "start" slot
+ * and wraps around
+ */
+
+static ngx_int_t
+ngx_event_timer_wheel_search(ngx_uint_t first, ngx_uint_t n,
+    ngx_uint_t start)
+{
+    uint64_t                  word;
+    ngx_uint_t                k, i;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_event_timer_wheel;
+
+    for (k = 0; k < n; /* void */) {
+        i = first + ((start + k) & (n - 1));
+
+        word = w->bitmap[i / 64] >> (i % 64);
+
+        if (word == 0) {
+            k += 64 - (i % 64);
+            continue;
+        }
+
+        while (!(word & 1)) {
+            word >>= 1;
+            k++;
+        }
+
+        return k;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_msec_t
+ngx_event_timer_wheel_find(void)
+{
+    ngx_msec_t                tick;
+    ngx_msec_int_t            timer;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_event_timer_wheel;
+
+    if (w->count == 0) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    if (w->expired.right != &w->expired) {
+        return 0;
+    }
+
+    if (ngx_event_timer_wheel_next(w->current, &tick) != NGX_OK) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    timer = (ngx_msec_int_t) (tick - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static void
+ngx_event_timer_wheel_expire(void)
+{
+    ngx_msec_t                tick, next;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_event_timer_wheel;
+
+    for ( ;; ) {
+
+        ngx_event_timer_wheel_run(&w->expired);
+
+        if ((ngx_msec_int_t) (w->current - ngx_current_msec) > 0) {
+            return;
+        }
+
+        tick = w->current;
+
+        if (w->count == 0) {
+            w->current = ngx_current_msec + 1;
+            return;
+        }
+
+        if ((tick & (NGX_TIMER_WHEEL_LEVEL0_SIZE - 1)) == 0) {
+            ngx_event_timer_wheel_cascade(tick);
+        }
+
+        ngx_event_timer_wheel_run(
+                     &w->slots[tick & (NGX_TIMER_WHEEL_LEVEL0_SIZE - 1)]);
+
+        /* skip the empty slots up to the current time */
+
+        if (ngx_event_timer_wheel_next(tick + 1, &next) != NGX_OK
+            || (ngx_msec_int_t) (next - ngx_current_msec) > 0)
+        {
+            next = ngx_current_msec + 1;
+        }
+
+        w->current = next;
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_run(ngx_rbtree_node_t *head)
+{
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node;
+
+    while (head->right != head) {
+        node = head->right;
+
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "event timer del: %d: %M",
+                       ngx_event_ident(ev->data), ev->timer.key);
+
+        ngx_event_timer_wheel_delete(node);
+
+#if (NGX_DEBUG)
+        ev->timer.left = NULL;
+        ev->timer.right = NULL;
+        ev->timer.parent = NULL;
+#endif
+
+        ev->timer_set = 0;
+
+        ev->timedout = 1;
+
+        ev->handler(ev);
+    }
+}
+
+
+static ngx_int_t
+ngx_event_timer_wheel_no_timers_left(void)
+{
+    ngx_uint_t                i;
+    ngx_event_t              *ev;
+    ngx_rbtree_node_t        *head, *node;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_event_timer_wheel;
+
+    if (w->count == 0) {
+        return NGX_OK;
+    }
+
+    for (i = 0; i <= NGX_TIMER_WHEEL_SLOTS; i++) {
+
+        head = (i == NGX_TIMER_WHEEL_SLOTS) ? &w->expired : &w->slots[i];
+
+        for (node = head->right; node != head; node = node->right) {
+            ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+            if (!ev->cancelable) {
+                return NGX_AGAIN;
+            }
+        }
+    }
+
+    /* only cancelable timers left */
+
+    return NGX_OK;
+}
@@ -11,6 +11,24 @@
 
 #include <zlib.h>
 
+#if (NGX_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#if (NGX_ZSTD)
+#include <zstd.h>
+#endif
+
+
+#define NGX_HTTP_GZIP_ENCODING_GZIP  0
+#define NGX_HTTP_GZIP_ENCODING_BR    1
+#define NGX_HTTP_GZIP_ENCODING_ZSTD  2
+
+
+#define NGX_HTTP_GZIP_CACHE_MISS     1
+#define NGX_HTTP_GZIP_CACHE_BYPASS   2
+#define NGX_HTTP_GZIP_CACHE_HIT      3
+
 
 typedef struct {
     ngx_flag_t           enable;
@@ -26,10 +44,47 @@ typedef struct {
     size_t               memlevel;
     ssize_t              min_length;
 
+#if (NGX_BROTLI)
+    ngx_int_t            brotli_level;
+#endif
+#if (NGX_ZSTD)
+    ngx_int_t            zstd_level;
+#endif
+
+    ngx_shm_zone_t      *cache;
+    size_t               cache_max_length;
+
+    ngx_array_t         *encodings;
     ngx_array_t         *types_keys;
 } ngx_http_gzip_conf_t;
 
 
+typedef struct {
+    ngx_rbtree_node_t    node;
+    ngx_queue_t          queue;
+    ngx_uint_t           count;
+    size_t               zin;
+    size_t               len;
+    size_t               key_len;
+
+    /* the key followed by the encoded response */
+    u_char               data[1];
+} ngx_http_gzip_cache_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t         rbtree;
+    ngx_rbtree_node_t    sentinel;
+    ngx_queue_t          queue;
+} ngx_http_gzip_cache_sh_t;
+
+
+typedef struct {
+    ngx_http_gzip_cache_sh_t    *sh;
+    ngx_slab_pool_t             *shpool;
+} ngx_http_gzip_cache_t;
+
+
 typedef struct {
     ngx_chain_t         *in;
     ngx_chain_t         *free;
@@ -51,6 +106,8 @@ typedef struct {
     int                  wbits;
     int                  memlevel;
 
+    ngx_uint_t           encoding;
+
     unsigned             flush:4;
     unsigned             redo:1;
     unsigned             done:1;
@@ -58,12 +115,33 @@ typedef struct {
     unsigned             gzheader:1;
     unsigned             buffering:1;
     unsigned             intel:1;
+    unsigned             started:1;
+    unsigned             cache_status:2;
+    unsigned             cache_sent:1;
 
     size_t               zin;
     size_t               zout;
 
+    /* the original response length, it is cleared by the header filter */
+    off_t                length;
+
     uint32_t             crc32;
+
+    /* the stream buffers and counters are used by all encoders */
     z_stream             zstream;
+
+#if (NGX_BROTLI)
+    BrotliEncoderState  *brotli;
+#endif
+#if (NGX_ZSTD)
+    ZSTD_CCtx           *zstd;
+#endif
+
+    ngx_http_gzip_cache_t       *cache;
+    ngx_http_gzip_cache_node_t  *cache_node;
+    ngx_buf_t                   *cache_buf;
+    ngx_str_t                    cache_key;
+
     ngx_http_request_t  *request;
 } ngx_http_gzip_ctx_t;
 
@@ -85,6 +163,8 @@ struct gztrailer {
 #endif
 
 
+static ngx_int_t ngx_http_gzip_filter_encoding(ngx_http_request_t *r,
+    ngx_http_gzip_conf_t *conf);
 static void ngx_http_gzip_filter_memory(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
 static ngx_int_t ngx_http_gzip_filter_buffer(ngx_http_gzip_ctx_t *ctx,
@@ -102,6 +182,44 @@ static ngx_int_t ngx_http_gzip_filter_deflate(ngx_http_request_t *r,
 static ngx_int_t ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
 
+#if (NGX_BROTLI || NGX_ZSTD)
+static ngx_int_t ngx_http_gzip_filter_encode_end(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+static void ngx_http_gzip_filter_cleanup(void *data);
+#endif
+
+#if (NGX_BROTLI)
+static ngx_int_t ngx_http_gzip_filter_brotli_start(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+static ngx_int_t ngx_http_gzip_filter_brotli(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+#endif
+
+#if (NGX_ZSTD)
+static ngx_int_t ngx_http_gzip_filter_zstd_start(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+static ngx_int_t ngx_http_gzip_filter_zstd(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+#endif
+
+static ngx_int_t ngx_http_gzip_cache_lookup(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx, ngx_http_gzip_conf_t *conf);
+static ngx_uint_t ngx_http_gzip_cache_private(ngx_http_request_t *r);
+static ngx_http_gzip_cache_node_t *ngx_http_gzip_cache_find(
+    ngx_http_gzip_cache_t *cache, ngx_str_t *key, uint32_t hash);
+static ngx_int_t ngx_http_gzip_cache_send(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_gzip_cache_copy(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+static void ngx_http_gzip_cache_store(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+static ngx_int_t ngx_http_gzip_cache_expire(ngx_http_gzip_cache_t *cache);
+static void ngx_http_gzip_cache_cleanup(void *data);
+static void ngx_http_gzip_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_gzip_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
 static void *ngx_http_gzip_filter_alloc(void *opaque, u_int items,
     u_int size);
 static void ngx_http_gzip_filter_free(void *opaque, void *address);
@@ -111,6 +229,8 @@ static void ngx_http_gzip_filter_free_copy_buf(ngx_http_request_t *r,
 static ngx_int_t ngx_http_gzip_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_gzip_ratio_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_gzip_cache_status_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 
 static ngx_int_t ngx_http_gzip_filter_init(ngx_conf_t *cf);
 static void *ngx_http_gzip_create_conf(ngx_conf_t *cf);
@@ -118,12 +238,30 @@ static char *ngx_http_gzip_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
 static char *ngx_http_gzip_window(ngx_conf_t *cf, void *post, void *data);
 static char *ngx_http_gzip_hash(ngx_conf_t *cf, void *post, void *data);
+static char *ngx_http_gzip_encodings(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_gzip_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_gzip_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 static ngx_conf_num_bounds_t  ngx_http_gzip_comp_level_bounds = {
     ngx_conf_check_num_bounds, 1, 9
 };
 
+#if (NGX_BROTLI)
+static ngx_conf_num_bounds_t  ngx_http_gzip_brotli_level_bounds = {
+    ngx_conf_check_num_bounds, BROTLI_MIN_QUALITY, BROTLI_MAX_QUALITY
+};
+#endif
+
+#if (NGX_ZSTD)
+static ngx_conf_num_bounds_t  ngx_http_gzip_zstd_level_bounds = {
+    ngx_conf_check_num_bounds, 1, 19
+};
+#endif
+
 static ngx_conf_post_handler_pt  ngx_http_gzip_window_p = ngx_http_gzip_window;
 static ngx_conf_post_handler_pt  ngx_http_gzip_hash_p = ngx_http_gzip_hash;
 
@@ -194,6 +332,56 @@ static ngx_command_t  ngx_http_gzip_filter_commands[] = {
       offsetof(ngx_http_gzip_conf_t, min_length),
       NULL },
 
+    { ngx_string("gzip_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_gzip_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("gzip_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_gzip_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("gzip_cache_max_length"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_gzip_conf_t, cache_max_length),
+      NULL },
+
+    { ngx_string("gzip_encodings"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_gzip_encodings,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+#if (NGX_BROTLI)
+
+    { ngx_string("gzip_brotli_level"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_gzip_conf_t, brotli_level),
+      &ngx_http_gzip_brotli_level_bounds },
+
+#endif
+
+#if (NGX_ZSTD)
+
+    { ngx_string("gzip_zstd_level"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_gzip_conf_t, zstd_level),
+      &ngx_http_gzip_zstd_level_bounds },
+
+#endif
+
       ngx_null_command
 };
 
@@ -230,6 +418,20 @@ ngx_module_t  ngx_http_gzip_filter_module = {
 
 
 static ngx_str_t  ngx_http_gzip_ratio = ngx_string("gzip_ratio");
+static ngx_str_t  ngx_http_gzip_cache_status = ngx_string("gzip_cache_status");
+
+static ngx_str_t  ngx_http_gzip_cache_status_names[] = {
+    ngx_null_string,
+    ngx_string("MISS"),
+    ngx_string("BYPASS"),
+    ngx_string("HIT")
+};
+
+static ngx_str_t  ngx_http_gzip_encoding_names[] = {
+    ngx_string("gzip"),
+    ngx_string("br"),
+    ngx_string("zstd")
+};
 
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
@@ -240,6 +442,7 @@ static ngx_uint_t  ngx_http_gzip_assume_intel;
 static ngx_int_t
 ngx_http_gzip_header_filter(ngx_http_request_t *r)
 {
+    ngx_int_t              encoding;
     ngx_table_elt_t       *h;
     ngx_http_gzip_ctx_t   *ctx;
     ngx_http_gzip_conf_t  *conf;
@@ -274,12 +477,9 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
     }
 #endif
 
-    if (!r->gzip_tested) {
-        if (ngx_http_gzip_ok(r) != NGX_OK) {
-            return ngx_http_next_header_filter(r);
-        }
+    encoding = ngx_http_gzip_filter_encoding(r, conf);
 
-    } else if (!r->gzip_ok) {
+    if (encoding == NGX_DECLINED) {
         return ngx_http_next_header_filter(r);
     }
 
@@ -291,9 +491,22 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
     ngx_http_set_ctx(r, ctx, ngx_http_gzip_filter_module);
 
     ctx->request = r;
-    ctx->buffering = (conf->postpone_gzipping != 0);
+    ctx->encoding = encoding;
+    ctx->length = r->headers_out.content_length_n;
+
+    if (conf->cache) {
+        if (ngx_http_gzip_cache_lookup(r, ctx, conf) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ctx->cache_node == NULL) {
+        ctx->buffering = (conf->postpone_gzipping != 0);
 
-    ngx_http_gzip_filter_memory(r, ctx);
+        if (encoding == NGX_HTTP_GZIP_ENCODING_GZIP) {
+            ngx_http_gzip_filter_memory(r, ctx);
+        }
+    }
 
     h = ngx_list_push(&r->headers_out.headers);
     if (h == NULL) {
@@ -302,12 +515,18 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
 
     h->hash = 1;
     ngx_str_set(&h->key, "Content-Encoding");
-    ngx_str_set(&h->value, "gzip");
+    h->value = ngx_http_gzip_encoding_names[encoding];
     r->headers_out.content_encoding = h;
 
-    r->main_filter_need_in_memory = 1;
-
     ngx_http_clear_content_length(r);
+
+    if (ctx->cache_node) {
+        r->headers_out.content_length_n = ctx->cache_node->len;
+
+    } else {
+        r->main_filter_need_in_memory = 1;
+    }
+
     ngx_http_clear_accept_ranges(r);
     ngx_http_weak_etag(r);
 
@@ -332,6 +551,10 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http gzip filter");
 
+    if (ctx->cache_node) {
+        return ngx_http_gzip_cache_send(r, ctx, in);
+    }
+
     if (ctx->buffering) {
 
         /*
@@ -362,7 +585,7 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         }
     }
 
-    if (ctx->preallocated == NULL) {
+    if (!ctx->started) {
         if (ngx_http_gzip_filter_deflate_start(r, ctx) != NGX_OK) {
             goto failed;
         }
@@ -446,12 +669,18 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             return ctx->busy ? NGX_AGAIN : NGX_OK;
         }
 
-        if (!ctx->gzheader) {
+        if (!ctx->gzheader && ctx->encoding == NGX_HTTP_GZIP_ENCODING_GZIP) {
             if (ngx_http_gzip_filter_gzheader(r, ctx) != NGX_OK) {
                 goto failed;
             }
         }
 
+        if (ctx->cache_status == NGX_HTTP_GZIP_CACHE_MISS) {
+            if (ngx_http_gzip_cache_copy(r, ctx) != NGX_OK) {
+                goto failed;
+            }
+        }
+
         rc = ngx_http_next_body_filter(r, ctx->out);
 
         if (rc == NGX_ERROR) {
@@ -468,6 +697,11 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         flush = 0;
 
         if (ctx->done) {
+
+            if (ctx->cache_status == NGX_HTTP_GZIP_CACHE_MISS) {
+                ngx_http_gzip_cache_store(r, ctx);
+            }
+
             return rc;
         }
     }
@@ -484,12 +718,73 @@ failed:
         ngx_pfree(r->pool, ctx->preallocated);
     }
 
+#if (NGX_BROTLI || NGX_ZSTD)
+    ngx_http_gzip_filter_cleanup(ctx);
+#endif
+
     ngx_http_gzip_filter_free_copy_buf(r, ctx);
 
     return NGX_ERROR;
 }
 
 
+/*
+ * the first of the gzip_encodings the client accepts is used,
+ * so the server preference wins over the client's quantities
+ */
+
+static ngx_int_t
+ngx_http_gzip_filter_encoding(ngx_http_request_t *r,
+    ngx_http_gzip_conf_t *conf)
+{
+    ngx_uint_t   i, *encoding;
+
+    if (conf->encodings == NULL) {
+        goto gzip;
+    }
+
+    encoding = conf->encodings->elts;
+
+    for (i = 0; i < conf->encodings->nelts; i++) {
+
+        if (encoding[i] == NGX_HTTP_GZIP_ENCODING_GZIP) {
+            if (!r->gzip_tested) {
+                if (ngx_http_gzip_ok(r) == NGX_OK) {
+                    return NGX_HTTP_GZIP_ENCODING_GZIP;
+                }
+
+            } else if (r->gzip_ok) {
+                return NGX_HTTP_GZIP_ENCODING_GZIP;
+            }
+
+            continue;
+        }
+
+        if (ngx_http_gzip_encoding_ok(r,
+                                      &ngx_http_gzip_encoding_names[encoding[i]])
+            == NGX_OK)
+        {
+            return encoding[i];
+        }
+    }
+
+    return NGX_DECLINED;
+
+gzip:
+
+    if (!r->gzip_tested) {
+        if (ngx_http_gzip_ok(r) != NGX_OK) {
+            return NGX_DECLINED;
+        }
+
+    } else if (!r->gzip_ok) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_HTTP_GZIP_ENCODING_GZIP;
+}
+
+
 static void
 ngx_http_gzip_filter_memory(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 {
@@ -629,6 +924,26 @@ ngx_http_gzip_filter_deflate_start(ngx_http_request_t *r,
     int                    rc;
     ngx_http_gzip_conf_t  *conf;
 
+    ctx->started = 1;
+    ctx->last_out = &ctx->out;
+    ctx->flush = Z_NO_FLUSH;
+
+    switch (ctx->encoding) {
+
+#if (NGX_BROTLI)
+    case NGX_HTTP_GZIP_ENCODING_BR:
+        return ngx_http_gzip_filter_brotli_start(r, ctx);
+#endif
+
+#if (NGX_ZSTD)
+    case NGX_HTTP_GZIP_ENCODING_ZSTD:
+        return ngx_http_gzip_filter_zstd_start(r, ctx);
+#endif
+
+    default: /* NGX_HTTP_GZIP_ENCODING_GZIP */
+        break;
+    }
+
     conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
 
     ctx->preallocated = ngx_palloc(r->pool, ctx->allocated);
@@ -651,9 +966,7 @@ ngx_http_gzip_filter_deflate_start(ngx_http_request_t *r,
         return NGX_ERROR;
     }
 
-    ctx->last_out = &ctx->out;
     ctx->crc32 = crc32(0L, Z_NULL, 0);
-    ctx->flush = Z_NO_FLUSH;
 
     return NGX_OK;
 }
@@ -747,8 +1060,10 @@ ngx_http_gzip_filter_add_data(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 
     if (ctx->zstream.avail_in) {
 
-        ctx->crc32 = crc32(ctx->crc32, ctx->zstream.next_in,
-                           ctx->zstream.avail_in);
+        if (ctx->encoding == NGX_HTTP_GZIP_ENCODING_GZIP) {
+            ctx->crc32 = crc32(ctx->crc32, ctx->zstream.next_in,
+                               ctx->zstream.avail_in);
+        }
 
     } else if (ctx->flush == Z_NO_FLUSH) {
         return NGX_AGAIN;
@@ -815,11 +1130,32 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
                  ctx->zstream.avail_in, ctx->zstream.avail_out,
                  ctx->flush, ctx->redo);
 
-    rc = deflate(&ctx->zstream, ctx->flush);
+    switch (ctx->encoding) {
 
-    if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                      "deflate() failed: %d, %d", ctx->flush, rc);
+#if (NGX_BROTLI)
+    case NGX_HTTP_GZIP_ENCODING_BR:
+        rc = ngx_http_gzip_filter_brotli(r, ctx);
+        break;
+#endif
+
+#if (NGX_ZSTD)
+    case NGX_HTTP_GZIP_ENCODING_ZSTD:
+        rc = ngx_http_gzip_filter_zstd(r, ctx);
+        break;
+#endif
+
+    default: /* NGX_HTTP_GZIP_ENCODING_GZIP */
+
+        rc = deflate(&ctx->zstream, ctx->flush);
+
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "deflate() failed: %d, %d", ctx->flush, rc);
+            return NGX_ERROR;
+        }
+    }
+
+    if (rc == NGX_ERROR) {
         return NGX_ERROR;
     }
 
@@ -900,6 +1236,12 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 
     if (rc == Z_STREAM_END) {
 
+#if (NGX_BROTLI || NGX_ZSTD)
+        if (ctx->encoding != NGX_HTTP_GZIP_ENCODING_GZIP) {
+            return ngx_http_gzip_filter_encode_end(r, ctx);
+        }
+#endif
+
         if (ngx_http_gzip_filter_deflate_end(r, ctx) != NGX_OK) {
             return NGX_ERROR;
         }
@@ -1016,92 +1358,1002 @@ ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
 }
 
 
-static void *
-ngx_http_gzip_filter_alloc(void *opaque, u_int items, u_int size)
-{
-    ngx_http_gzip_ctx_t *ctx = opaque;
-
-    void        *p;
-    ngx_uint_t   alloc;
+#if (NGX_BROTLI || NGX_ZSTD)
 
-    alloc = items * size;
+static ngx_int_t
+ngx_http_gzip_filter_encode_end(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx)
+{
+    ngx_chain_t  *cl;
 
-    if (items == 1 && alloc % 512 != 0 && alloc < 8192) {
+    ctx->zin = ctx->zstream.total_in;
+    ctx->zout = ctx->zstream.total_out;
 
-        /*
-         * The zlib deflate_state allocation, it takes about 6K,
-         * we allocate 8K.  Other allocations are divisible by 512.
-         */
+    ngx_http_gzip_filter_cleanup(ctx);
 
-        alloc = 8192;
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
     }
 
-    if (alloc <= ctx->allocated) {
-        p = ctx->free_mem;
-        ctx->free_mem += alloc;
-        ctx->allocated -= alloc;
-
-        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
-                       "gzip alloc: n:%ud s:%ud a:%ui p:%p",
-                       items, size, alloc, p);
+    ctx->out_buf->last_buf = 1;
 
-        return p;
-    }
+    cl->buf = ctx->out_buf;
+    cl->next = NULL;
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
 
-    if (ctx->intel) {
-        ngx_log_error(NGX_LOG_ALERT, ctx->request->connection->log, 0,
-                      "gzip filter failed to use preallocated memory: "
-                      "%ud of %ui", items * size, ctx->allocated);
+    ctx->zstream.avail_in = 0;
+    ctx->zstream.avail_out = 0;
 
-    } else {
-        ngx_http_gzip_assume_intel = 1;
-    }
+    ctx->done = 1;
 
-    p = ngx_palloc(ctx->request->pool, items * size);
+    r->connection->buffered &= ~NGX_HTTP_GZIP_BUFFERED;
 
-    return p;
+    return NGX_OK;
 }
 
 
 static void
-ngx_http_gzip_filter_free(void *opaque, void *address)
+ngx_http_gzip_filter_cleanup(void *data)
 {
-#if 0
-    ngx_http_gzip_ctx_t *ctx = opaque;
+    ngx_http_gzip_ctx_t  *ctx = data;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
-                   "gzip free: %p", address);
+#if (NGX_BROTLI)
+    if (ctx->brotli) {
+        BrotliEncoderDestroyInstance(ctx->brotli);
+        ctx->brotli = NULL;
+    }
 #endif
-}
-
-
-static void
-ngx_http_gzip_filter_free_copy_buf(ngx_http_request_t *r,
-    ngx_http_gzip_ctx_t *ctx)
-{
-    ngx_chain_t  *cl;
 
-    for (cl = ctx->copied; cl; cl = cl->next) {
-        ngx_pfree(r->pool, cl->buf->start);
+#if (NGX_ZSTD)
+    if (ctx->zstd) {
+        ZSTD_freeCCtx(ctx->zstd);
+        ctx->zstd = NULL;
     }
-
-    ctx->copied = NULL;
+#endif
 }
 
+#endif
+
+
+#if (NGX_BROTLI)
 
 static ngx_int_t
-ngx_http_gzip_add_variables(ngx_conf_t *cf)
+ngx_http_gzip_filter_brotli_start(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx)
 {
-    ngx_http_variable_t  *var;
+    off_t                  len;
+    ngx_uint_t             wbits;
+    ngx_pool_cleanup_t    *cln;
+    ngx_http_gzip_conf_t  *conf;
 
-    var = ngx_http_add_variable(cf, &ngx_http_gzip_ratio, NGX_HTTP_VAR_NOHASH);
-    if (var == NULL) {
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
         return NGX_ERROR;
     }
 
-    var->get_handler = ngx_http_gzip_ratio_variable;
+    /*
+     * the encoder state is allocated with malloc() as the encoder
+     * sizes its ring buffer and hash tables only on the first data
+     */
 
-    return NGX_OK;
+    ctx->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (ctx->brotli == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "BrotliEncoderCreateInstance() failed");
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_gzip_filter_cleanup;
+    cln->data = ctx;
+
+    BrotliEncoderSetParameter(ctx->brotli, BROTLI_PARAM_QUALITY,
+                              (uint32_t) conf->brotli_level);
+
+    len = ctx->length;
+
+    if (len > 0) {
+
+        /* a window larger than the response only wastes memory */
+
+        wbits = BROTLI_DEFAULT_WINDOW;
+
+        while (wbits > BROTLI_MIN_WINDOW_BITS && len <= (1 << (wbits - 1))) {
+            wbits--;
+        }
+
+        BrotliEncoderSetParameter(ctx->brotli, BROTLI_PARAM_LGWIN, wbits);
+
+        if (len <= NGX_MAX_UINT32_VALUE) {
+            BrotliEncoderSetParameter(ctx->brotli, BROTLI_PARAM_SIZE_HINT,
+                                      (uint32_t) len);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_gzip_filter_brotli(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
+{
+    size_t                   avail_in, avail_out;
+    uint8_t                 *next_out;
+    const uint8_t           *next_in;
+    BrotliEncoderOperation   op;
+
+    switch (ctx->flush) {
+
+    case Z_FINISH:
+        op = BROTLI_OPERATION_FINISH;
+        break;
+
+    case Z_SYNC_FLUSH:
+        op = BROTLI_OPERATION_FLUSH;
+        break;
+
+    default:
+        op = BROTLI_OPERATION_PROCESS;
+    }
+
+    next_in = ctx->zstream.next_in;
+    avail_in = ctx->zstream.avail_in;
+    next_out = ctx->zstream.next_out;
+    avail_out = ctx->zstream.avail_out;
+
+    for ( ;; ) {
+
+        if (!BrotliEncoderCompressStream(ctx->brotli, op, &avail_in, &next_in,
+                                         &avail_out, &next_out, NULL))
+        {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "BrotliEncoderCompressStream() failed: %d", op);
+            return NGX_ERROR;
+        }
+
+        if (op == BROTLI_OPERATION_FINISH
+            && BrotliEncoderIsFinished(ctx->brotli))
+        {
+            break;
+        }
+
+        if (avail_out == 0) {
+            break;
+        }
+
+        if (op != BROTLI_OPERATION_FINISH
+            && avail_in == 0
+            && !BrotliEncoderHasMoreOutput(ctx->brotli))
+        {
+            break;
+        }
+    }
+
+    ctx->zstream.total_in += ctx->zstream.avail_in - avail_in;
+    ctx->zstream.total_out += ctx->zstream.avail_out - avail_out;
+
+    ctx->zstream.next_in = (u_char *) next_in;
+    ctx->zstream.avail_in = avail_in;
+    ctx->zstream.next_out = next_out;
+    ctx->zstream.avail_out = avail_out;
+
+    if (op == BROTLI_OPERATION_FINISH && BrotliEncoderIsFinished(ctx->brotli)) {
+        return Z_STREAM_END;
+    }
+
+    return Z_OK;
+}
+
+#endif
+
+
+#if (NGX_ZSTD)
+
+static ngx_int_t
+ngx_http_gzip_filter_zstd_start(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx)
+{
+    size_t                 rc;
+    unsigned long long     len;
+    ngx_pool_cleanup_t    *cln;
+    ngx_http_gzip_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->zstd = ZSTD_createCCtx();
+    if (ctx->zstd == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "ZSTD_createCCtx() failed");
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_gzip_filter_cleanup;
+    cln->data = ctx;
+
+    rc = ZSTD_CCtx_setParameter(ctx->zstd, ZSTD_c_compressionLevel,
+                                (int) conf->zstd_level);
+
+    if (!ZSTD_isError(rc) && ctx->length > 0) {
+
+        /*
+         * the pledged size lets the encoder scale its window and
+         * tables down to the response, and is stored in the frame
+         */
+
+        len = ctx->length;
+        rc = ZSTD_CCtx_setPledgedSrcSize(ctx->zstd, len);
+    }
+
+    if (ZSTD_isError(rc)) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "ZSTD_CCtx_setParameter() failed: %s",
+                      ZSTD_getErrorName(rc));
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_gzip_filter_zstd(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
+{
+    size_t             rc;
+    ZSTD_inBuffer      in;
+    ZSTD_outBuffer     out;
+    ZSTD_EndDirective  op;
+
+    switch (ctx->flush) {
+
+    case Z_FINISH:
+        op = ZSTD_e_end;
+        break;
+
+    case Z_SYNC_FLUSH:
+        op = ZSTD_e_flush;
+        break;
+
+    default:
+        op = ZSTD_e_continue;
+    }
+
+    in.src = ctx->zstream.next_in;
+    in.size = ctx->zstream.avail_in;
+    in.pos = 0;
+
+    out.dst = ctx->zstream.next_out;
+    out.size = ctx->zstream.avail_out;
+    out.pos = 0;
+
+    for ( ;; ) {
+
+        rc = ZSTD_compressStream2(ctx->zstd, &out, &in, op);
+
+        if (ZSTD_isError(rc)) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "ZSTD_compressStream2() failed: %s",
+                          ZSTD_getErrorName(rc));
+            return NGX_ERROR;
+        }
+
+        /*
+         * a completed frame must not be ended again,
+         * or an empty frame would follow it
+         */
+
+        if (op != ZSTD_e_continue && rc == 0) {
+            break;
+        }
+
+        if (out.pos == out.size) {
+            break;
+        }
+
+        if (op == ZSTD_e_continue && in.pos == in.size) {
+            break;
+        }
+    }
+
+    ctx->zstream.total_in += in.pos;
+    ctx->zstream.total_out += out.pos;
+
+    ctx->zstream.next_in += in.pos;
+    ctx->zstream.avail_in -= in.pos;
+    ctx->zstream.next_out += out.pos;
+    ctx->zstream.avail_out -= out.pos;
+
+    if (op == ZSTD_e_end && rc == 0) {
+        return Z_STREAM_END;
+    }
+
+    return Z_OK;
+}
+
+#endif
+
+
+/*
+ * the encoded responses are cached by their entity tags: a strong tag
+ * identifies the representation of the resource, so the same tag for
+ * the same URI implies byte-identical input and the encoder may be
+ * skipped altogether
+ */
+
+static ngx_int_t
+ngx_http_gzip_cache_lookup(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx,
+    ngx_http_gzip_conf_t *conf)
+{
+    u_char                      *p;
+    size_t                       len;
+    uint32_t                     hash;
+    ngx_int_t                    level[3];
+    ngx_str_t                   *name;
+    ngx_table_elt_t             *etag;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_gzip_cache_t       *cache;
+    ngx_http_core_srv_conf_t    *cscf;
+    ngx_http_gzip_cache_node_t  *node;
+
+    ctx->cache_status = NGX_HTTP_GZIP_CACHE_BYPASS;
+
+    etag = r->headers_out.etag;
+
+    if (r != r->main
+        || r->headers_out.status != NGX_HTTP_OK
+        || etag == NULL
+        || etag->value.len < 2
+        || etag->value.data[0] != '"'
+        || ngx_http_gzip_cache_private(r))
+    {
+        return NGX_DECLINED;
+    }
+
+    level[1] = 0;
+    level[2] = 0;
+
+    switch (ctx->encoding) {
+
+#if (NGX_BROTLI)
+    case NGX_HTTP_GZIP_ENCODING_BR:
+        level[0] = conf->brotli_level;
+        break;
+#endif
+
+#if (NGX_ZSTD)
+    case NGX_HTTP_GZIP_ENCODING_ZSTD:
+        level[0] = conf->zstd_level;
+        break;
+#endif
+
+    default: /* NGX_HTTP_GZIP_ENCODING_GZIP */
+        level[0] = conf->level;
+        level[1] = conf->wbits;
+        level[2] = conf->memlevel;
+    }
+
+    cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+    name = &ngx_http_gzip_encoding_names[ctx->encoding];
+
+    len = name->len + 3 * (1 + NGX_INT_T_LEN)
+          + 1 + cscf->server_name.len
+          + 1 + r->headers_in.server.len
+          + 1 + r->uri.len + 1 + r->args.len
+          + 1 + etag->value.len;
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->cache_key.data = p;
+
+    p = ngx_sprintf(p, "%V:%i:%i:%i\n%V\n%V\n%V?%V\n%V",
+                    name, level[0], level[1], level[2],
+                    &cscf->server_name, &r->headers_in.server,
+                    &r->uri, &r->args, &etag->value);
+
+    ctx->cache_key.len = p - ctx->cache_key.data;
+
+    ctx->cache = conf->cache->data;
+    ctx->cache_status = NGX_HTTP_GZIP_CACHE_MISS;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache = ctx->cache;
+    hash = ngx_crc32_short(ctx->cache_key.data, ctx->cache_key.len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_gzip_cache_find(cache, &ctx->cache_key, hash);
+
+    if (node) {
+        node->count++;
+
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http gzip cache \"%V\": %p", &ctx->cache_key, node);
+
+    if (node == NULL) {
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_http_gzip_cache_cleanup;
+    cln->data = ctx;
+
+    ctx->cache_node = node;
+    ctx->cache_status = NGX_HTTP_GZIP_CACHE_HIT;
+
+    ctx->zin = node->zin;
+    ctx->zout = node->len;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_gzip_cache_private(ngx_http_request_t *r)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h, **ccp;
+
+    ccp = r->headers_out.cache_control.elts;
+
+    for (i = 0; i < r->headers_out.cache_control.nelts; i++) {
+
+        if (ccp[i]->hash == 0) {
+            continue;
+        }
+
+        if (ngx_strlcasestrn(ccp[i]->value.data,
+                             ccp[i]->value.data + ccp[i]->value.len,
+                             (u_char *) "private", 7 - 1)
+            != NULL
+            || ngx_strlcasestrn(ccp[i]->value.data,
+                                ccp[i]->value.data + ccp[i]->value.len,
+                                (u_char *) "no-store", 8 - 1)
+               != NULL)
+        {
+            return 1;
+        }
+    }
+
+    part = &r->headers_out.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].hash != 0
+            && h[i].key.len == sizeof("Set-Cookie") - 1
+            && ngx_strncasecmp(h[i].key.data, (u_char *) "Set-Cookie",
+                               sizeof("Set-Cookie") - 1)
+               == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_http_gzip_cache_node_t *
+ngx_http_gzip_cache_find(ngx_http_gzip_cache_t *cache, ngx_str_t *key,
+    uint32_t hash)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_gzip_cache_node_t  *cn;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        cn = (ngx_http_gzip_cache_node_t *) node;
+
+        rc = ngx_memn2cmp(key->data, cn->data, key->len, cn->key_len);
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_gzip_cache_send(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx,
+    ngx_chain_t *in)
+{
+    ngx_buf_t                   *b;
+    ngx_uint_t                   last;
+    ngx_chain_t                 *cl, *out, **ll;
+    ngx_http_gzip_cache_node_t  *node;
+
+    /* the original response is not needed, it is consumed as is */
+
+    last = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (b->last_buf || b->last_in_chain) {
+            last = 1;
+        }
+
+        b->pos = b->last;
+
+        if (b->in_file) {
+            b->file_pos = b->file_last;
+        }
+    }
+
+    out = NULL;
+    ll = &out;
+    b = NULL;
+
+    if (!ctx->cache_sent) {
+        node = ctx->cache_node;
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->memory = 1;
+        b->pos = node->data + node->key_len;
+        b->last = b->pos + node->len;
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = b;
+        *ll = cl;
+        ll = &cl->next;
+
+        ctx->cache_buf = b;
+        ctx->cache_sent = 1;
+    }
+
+    if (last) {
+
+        if (b == NULL) {
+            b = ngx_calloc_buf(r->pool);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl = ngx_alloc_chain_link(r->pool);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->buf = b;
+            *ll = cl;
+            ll = &cl->next;
+        }
+
+        b->last_buf = 1;
+
+        ctx->done = 1;
+    }
+
+    *ll = NULL;
+
+    if (out == NULL && ngx_buf_size(ctx->cache_buf) == 0) {
+        return NGX_OK;
+    }
+
+    return ngx_http_next_body_filter(r, out);
+}
+
+
+static ngx_int_t
+ngx_http_gzip_cache_copy(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
+{
+    size_t                 len, size;
+    ngx_buf_t             *b, *nb;
+    ngx_chain_t           *cl;
+    ngx_http_gzip_conf_t  *conf;
+
+    len = 0;
+
+    for (cl = ctx->out; cl; cl = cl->next) {
+        len += cl->buf->last - cl->buf->pos;
+    }
+
+    b = ctx->cache_buf;
+
+    if (b == NULL || (size_t) (b->end - b->last) < len) {
+
+        conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+        size = b ? b->last - b->pos : 0;
+
+        if (size + len > conf->cache_max_length) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http gzip cache bypass, %uz bytes", size + len);
+
+            if (b) {
+                ngx_pfree(r->pool, b->start);
+                ctx->cache_buf = NULL;
+            }
+
+            ctx->cache_status = NGX_HTTP_GZIP_CACHE_BYPASS;
+
+            return NGX_OK;
+        }
+
+        size = ngx_max(size + len, (b ? 2 * (size_t) (b->end - b->start)
+                                      : 16384));
+        size = ngx_min(size, conf->cache_max_length);
+
+        nb = ngx_create_temp_buf(r->pool, size);
+        if (nb == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (b) {
+            nb->last = ngx_cpymem(nb->last, b->pos, b->last - b->pos);
+            ngx_pfree(r->pool, b->start);
+        }
+
+        b = nb;
+        ctx->cache_buf = b;
+    }
+
+    for (cl = ctx->out; cl; cl = cl->next) {
+        b->last = ngx_cpymem(b->last, cl->buf->pos,
+                             cl->buf->last - cl->buf->pos);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_gzip_cache_store(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
+{
+    size_t                       len;
+    uint32_t                     hash;
+    ngx_buf_t                   *b;
+    ngx_http_gzip_cache_t       *cache;
+    ngx_http_gzip_cache_node_t  *node;
+
+    b = ctx->cache_buf;
+
+    if (b == NULL) {
+        return;
+    }
+
+    cache = ctx->cache;
+    hash = ngx_crc32_short(ctx->cache_key.data, ctx->cache_key.len);
+    len = b->last - b->pos;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (ngx_http_gzip_cache_find(cache, &ctx->cache_key, hash) != NULL) {
+        goto done;
+    }
+
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(cache->shpool,
+                                     offsetof(ngx_http_gzip_cache_node_t, data)
+                                     + ctx->cache_key.len + len);
+        if (node) {
+            break;
+        }
+
+        if (ngx_http_gzip_cache_expire(cache) != NGX_OK) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "could not allocate node%s",
+                          cache->shpool->log_ctx);
+            goto done;
+        }
+    }
+
+    node->node.key = hash;
+    node->count = 0;
+    node->zin = ctx->zin;
+    node->len = len;
+    node->key_len = ctx->cache_key.len;
+
+    ngx_memcpy(ngx_cpymem(node->data, ctx->cache_key.data, node->key_len),
+               b->pos, len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_pfree(r->pool, b->start);
+    ctx->cache_buf = NULL;
+}
+
+
+static ngx_int_t
+ngx_http_gzip_cache_expire(ngx_http_gzip_cache_t *cache)
+{
+    ngx_queue_t                 *q;
+    ngx_http_gzip_cache_node_t  *node;
+
+    /*
+     * the least recently used node not being sent; the count is only
+     * dropped by the request pool cleanup, so a node pinned by a worker
+     * which exited abnormally is never evicted and stays in the zone
+     * until it is recreated: the encoded data are sent directly from
+     * the zone, so a pinned node cannot be safely freed after a timeout
+     */
+
+    for (q = ngx_queue_last(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue);
+         q = ngx_queue_prev(q))
+    {
+        node = ngx_queue_data(q, ngx_http_gzip_cache_node_t, queue);
+
+        if (node->count) {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &node->node);
+        ngx_slab_free_locked(cache->shpool, node);
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_gzip_cache_cleanup(void *data)
+{
+    ngx_http_gzip_ctx_t  *ctx = data;
+
+    ngx_shmtx_lock(&ctx->cache->shpool->mutex);
+
+    ctx->cache_node->count--;
+
+    ngx_shmtx_unlock(&ctx->cache->shpool->mutex);
+}
+
+
+static void
+ngx_http_gzip_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_gzip_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_gzip_cache_node_t *) node;
+            cnt = (ngx_http_gzip_cache_node_t *) temp;
+
+            p = (ngx_memn2cmp(cn->data, cnt->data, cn->key_len, cnt->key_len)
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_gzip_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_gzip_cache_t  *ocache = data;
+
+    size_t                  len;
+    ngx_http_gzip_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_gzip_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_gzip_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in gzip cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in gzip cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_gzip_filter_alloc(void *opaque, u_int items, u_int size)
+{
+    ngx_http_gzip_ctx_t *ctx = opaque;
+
+    void        *p;
+    ngx_uint_t   alloc;
+
+    alloc = items * size;
+
+    if (items == 1 && alloc % 512 != 0 && alloc < 8192) {
+
+        /*
+         * The zlib deflate_state allocation, it takes about 6K,
+         * we allocate 8K.  Other allocations are divisible by 512.
+         */
+
+        alloc = 8192;
+    }
+
+    if (alloc <= ctx->allocated) {
+        p = ctx->free_mem;
+        ctx->free_mem += alloc;
+        ctx->allocated -= alloc;
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                       "gzip alloc: n:%ud s:%ud a:%ui p:%p",
+                       items, size, alloc, p);
+
+        return p;
+    }
+
+    if (ctx->intel) {
+        ngx_log_error(NGX_LOG_ALERT, ctx->request->connection->log, 0,
+                      "gzip filter failed to use preallocated memory: "
+                      "%ud of %ui", items * size, ctx->allocated);
+
+    } else {
+        ngx_http_gzip_assume_intel = 1;
+    }
+
+    p = ngx_palloc(ctx->request->pool, items * size);
+
+    return p;
+}
+
+
+static void
+ngx_http_gzip_filter_free(void *opaque, void *address)
+{
+#if 0
+    ngx_http_gzip_ctx_t *ctx = opaque;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                   "gzip free: %p", address);
+#endif
+}
+
+
+static void
+ngx_http_gzip_filter_free_copy_buf(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx)
+{
+    ngx_chain_t  *cl;
+
+    for (cl = ctx->copied; cl; cl = cl->next) {
+        ngx_pfree(r->pool, cl->buf->start);
+    }
+
+    ctx->copied = NULL;
+}
+
+
+static ngx_int_t
+ngx_http_gzip_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var;
+
+    var = ngx_http_add_variable(cf, &ngx_http_gzip_ratio, NGX_HTTP_VAR_NOHASH);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->get_handler = ngx_http_gzip_ratio_variable;
+
+    var = ngx_http_add_variable(cf, &ngx_http_gzip_cache_status,
+                                NGX_HTTP_VAR_NOHASH);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->get_handler = ngx_http_gzip_cache_status_variable;
+
+    return NGX_OK;
 }
 
 
@@ -1149,6 +2401,29 @@ ngx_http_gzip_ratio_variable(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_gzip_cache_status_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_gzip_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_gzip_filter_module);
+
+    if (ctx == NULL || ctx->cache_status == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ngx_http_gzip_cache_status_names[ctx->cache_status].len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ngx_http_gzip_cache_status_names[ctx->cache_status].data;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_gzip_create_conf(ngx_conf_t *cf)
 {
@@ -1176,6 +2451,18 @@ ngx_http_gzip_create_conf(ngx_conf_t *cf)
     conf->memlevel = NGX_CONF_UNSET_SIZE;
     conf->min_length = NGX_CONF_UNSET;
 
+#if (NGX_BROTLI)
+    conf->brotli_level = NGX_CONF_UNSET;
+#endif
+#if (NGX_ZSTD)
+    conf->zstd_level = NGX_CONF_UNSET;
+#endif
+
+    conf->cache = NGX_CONF_UNSET_PTR;
+    conf->cache_max_length = NGX_CONF_UNSET_SIZE;
+
+    conf->encodings = NGX_CONF_UNSET_PTR;
+
     return conf;
 }
 
@@ -1200,6 +2487,19 @@ ngx_http_gzip_merge_conf(ngx_conf_t *cf, void *parent, void *child)
                               MAX_MEM_LEVEL - 1);
     ngx_conf_merge_value(conf->min_length, prev->min_length, 20);
 
+#if (NGX_BROTLI)
+    ngx_conf_merge_value(conf->brotli_level, prev->brotli_level, 4);
+#endif
+#if (NGX_ZSTD)
+    ngx_conf_merge_value(conf->zstd_level, prev->zstd_level, 3);
+#endif
+
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+    ngx_conf_merge_size_value(conf->cache_max_length, prev->cache_max_length,
+                              1024 * 1024);
+
+    ngx_conf_merge_ptr_value(conf->encodings, prev->encodings, NULL);
+
     if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
                              &prev->types_keys, &prev->types,
                              ngx_http_html_default_types)
@@ -1271,3 +2571,177 @@ ngx_http_gzip_hash(ngx_conf_t *cf, void *post, void *data)
 
     return "must be 512, 1k, 2k, 4k, 8k, 16k, 32k, 64k, or 128k";
 }
+
+
+static char *
+ngx_http_gzip_encodings(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_gzip_conf_t *gcf = conf;
+
+    ngx_str_t   *value;
+    ngx_uint_t   i, n, *encoding;
+
+    if (gcf->encodings != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    gcf->encodings = ngx_array_create(cf->pool, cf->args->nelts - 1,
+                                      sizeof(ngx_uint_t));
+    if (gcf->encodings == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        for (n = 0; n < sizeof(ngx_http_gzip_encoding_names)
+                        / sizeof(ngx_str_t); n++)
+        {
+            if (value[i].len == ngx_http_gzip_encoding_names[n].len
+                && ngx_strcasecmp(value[i].data,
+                                  ngx_http_gzip_encoding_names[n].data)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        switch (n) {
+
+        case NGX_HTTP_GZIP_ENCODING_GZIP:
+            break;
+
+        case NGX_HTTP_GZIP_ENCODING_BR:
+#if !(NGX_BROTLI)
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "the \"br\" encoding requires "
+                               "--with-http_gzip_brotli option");
+            return NGX_CONF_ERROR;
+#else
+            break;
+#endif
+
+        case NGX_HTTP_GZIP_ENCODING_ZSTD:
+#if !(NGX_ZSTD)
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "the \"zstd\" encoding requires "
+                               "--with-http_gzip_zstd option");
+            return NGX_CONF_ERROR;
+#else
+            break;
+#endif
+
+        default:
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid encoding \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        encoding = ngx_array_push(gcf->encodings);
+        if (encoding == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *encoding = n;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_gzip_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                 *p;
+    ssize_t                 size;
+    ngx_str_t              *value, name, s;
+    ngx_shm_zone_t         *shm_zone;
+    ngx_http_gzip_cache_t  *cache;
+
+    value = cf->args->elts;
+
+    p = (u_char *) ngx_strchr(value[1].data, ':');
+
+    if (p == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data;
+    name.len = p - name.data;
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_gzip_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_gzip_filter_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_gzip_cache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_gzip_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_gzip_conf_t *gcf = conf;
+
+    ngx_str_t  *value;
+
+    if (gcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        gcf->cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    gcf->cache = ngx_shared_memory_add(cf, &value[1], 0,
+                                       &ngx_http_gzip_filter_module);
+    if (gcf->cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
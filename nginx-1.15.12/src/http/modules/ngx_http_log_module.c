@@ -35,6 +35,8 @@ typedef struct {
     ngx_str_t                   name;
     ngx_array_t                *flushes;
     ngx_array_t                *ops;        /* array of ngx_http_log_op_t */
+    ngx_str_t                   schema;     /* binary encoding only */
+    uint32_t                    id;
 } ngx_http_log_fmt_t;
 
 
@@ -44,6 +46,45 @@ typedef struct {
 } ngx_http_log_main_conf_t;
 
 
+#if (NGX_THREADS)
+
+/*
+ * The asynchronous log is a ring of the buffer size.  The records are
+ * appended at "head" by the worker, the range between "sent" and "head"
+ * is handed to a thread, and "tail" is moved after the thread completes.
+ * All offsets are only changed in the worker event loop, the thread only
+ * reads the range posted to it, so no locking is needed.
+ */
+
+typedef struct {
+    ngx_fd_t                    fd;
+    u_char                     *buf[2];
+    size_t                      len[2];
+    ngx_int_t                   gzip;
+    ssize_t                     n;
+    size_t                      size;
+    ngx_err_t                   err;
+} ngx_http_log_async_ctx_t;
+
+
+typedef struct {
+    ngx_thread_pool_t          *thread_pool;
+    ngx_thread_task_t          *task;
+
+    uint64_t                    head;
+    uint64_t                    sent;
+    uint64_t                    tail;
+
+    ngx_uint_t                  dropped;
+    time_t                      drop_log_time;
+    time_t                      error_log_time;
+
+    unsigned                    busy:1;
+} ngx_http_log_async_t;
+
+#endif
+
+
 typedef struct {
     u_char                     *start;
     u_char                     *pos;
@@ -52,6 +93,10 @@ typedef struct {
     ngx_event_t                *event;
     ngx_msec_t                  flush;
     ngx_int_t                   gzip;
+
+#if (NGX_THREADS)
+    ngx_http_log_async_t       *async;
+#endif
 } ngx_http_log_buf_t;
 
 
@@ -69,6 +114,7 @@ typedef struct {
     ngx_syslog_peer_t          *syslog_peer;
     ngx_http_log_fmt_t         *format;
     ngx_http_complex_value_t   *filter;
+    ngx_uint_t                  generation; /* of the file with schema */
 } ngx_http_log_t;
 
 
@@ -95,6 +141,32 @@ typedef struct {
 #define NGX_HTTP_LOG_ESCAPE_NONE     2
 
 
+/*
+ * The binary encoding is a sequence of records, each is a type byte,
+ * a varint length of the rest and a 32-bit format id:
+ *
+ *   'S' schema: escape-independent description of the format, that is,
+ *       the format name and the list of fields, each is a kind byte
+ *       followed by a varint length and the literal text or variable name;
+ *   'R' log record: the field values in the schema order, literals
+ *       are not repeated.
+ *
+ * Built-in variables are stored in fixed-width little-endian fields,
+ * other variables are stored as a varint of the length plus one, zero
+ * means the variable is not found.  A worker writes the schema before
+ * its first record to a file and after each reopen of the file.
+ */
+
+#define NGX_HTTP_LOG_BIN_SCHEMA      'S'
+#define NGX_HTTP_LOG_BIN_RECORD      'R'
+
+#define NGX_HTTP_LOG_BIN_LITERAL     0x00
+/* 0x01 - 0x1f are the ngx_http_log_binary_vars[] indices plus one */
+#define NGX_HTTP_LOG_BIN_VARIABLE    0x20   /* + NGX_HTTP_LOG_ESCAPE_* */
+
+#define NGX_HTTP_LOG_VARINT_LEN      10
+
+
 static void ngx_http_log_write(ngx_http_request_t *r, ngx_http_log_t *log,
     u_char *buf, size_t len);
 static ssize_t ngx_http_log_script_write(ngx_http_request_t *r,
@@ -111,6 +183,20 @@ static void ngx_http_log_gzip_free(void *opaque, void *address);
 static void ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log);
 static void ngx_http_log_flush_handler(ngx_event_t *ev);
 
+#if (NGX_THREADS)
+static void ngx_http_log_async_write(ngx_open_file_t *file, u_char *buf,
+    size_t len, ngx_log_t *log);
+static void ngx_http_log_async_schedule(ngx_open_file_t *file,
+    ngx_log_t *log);
+static void ngx_http_log_async_post(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_async_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_log_async_write_ctx(ngx_http_log_async_ctx_t *ctx,
+    ngx_log_t *log);
+static void ngx_http_log_async_event_handler(ngx_event_t *ev);
+static void ngx_http_log_async_timer_handler(ngx_event_t *ev);
+static void ngx_http_log_async_flush(ngx_open_file_t *file, ngx_log_t *log);
+#endif
+
 static u_char *ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static u_char *ngx_http_log_time(ngx_http_request_t *r, u_char *buf,
@@ -130,6 +216,32 @@ static u_char *ngx_http_log_body_bytes_sent(ngx_http_request_t *r,
 static u_char *ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 
+static u_char *ngx_http_log_binary_pipe(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_time(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_msec(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_request_time(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_status(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_bytes_sent(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_body_bytes_sent(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_request_length(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static size_t ngx_http_log_binary_variable_getlen(ngx_http_request_t *r,
+    uintptr_t data);
+static u_char *ngx_http_log_binary_variable(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_header(ngx_http_log_t *log, u_char *buf,
+    size_t len);
+static size_t ngx_http_log_varint_len(uint64_t n);
+static u_char *ngx_http_log_varint(u_char *buf, uint64_t n);
+static u_char *ngx_http_log_uint(u_char *buf, uint64_t n, size_t len);
+
 static ngx_int_t ngx_http_log_variable_compile(ngx_conf_t *cf,
     ngx_http_log_op_t *op, ngx_str_t *value, ngx_uint_t escape);
 static size_t ngx_http_log_variable_getlen(ngx_http_request_t *r,
@@ -156,7 +268,10 @@ static char *ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
 static char *ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_log_compile_format(ngx_conf_t *cf,
-    ngx_array_t *flushes, ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s);
+    ngx_array_t *flushes, ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s,
+    ngx_uint_t *binary);
+static char *ngx_http_log_compile_binary(ngx_conf_t *cf,
+    ngx_http_log_fmt_t *fmt);
 static char *ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_log_init(ngx_conf_t *cf);
@@ -250,6 +365,25 @@ static ngx_http_log_var_t  ngx_http_log_vars[] = {
 };
 
 
+/* the same order as in ngx_http_log_vars[] */
+
+static ngx_http_log_var_t  ngx_http_log_binary_vars[] = {
+    { ngx_string("pipe"), 1, ngx_http_log_binary_pipe },
+    { ngx_string("time_local"), 8 + 2, ngx_http_log_binary_time },
+    { ngx_string("time_iso8601"), 8 + 2, ngx_http_log_binary_time },
+    { ngx_string("msec"), 8, ngx_http_log_binary_msec },
+    { ngx_string("request_time"), 8, ngx_http_log_binary_request_time },
+    { ngx_string("status"), 2, ngx_http_log_binary_status },
+    { ngx_string("bytes_sent"), 8, ngx_http_log_binary_bytes_sent },
+    { ngx_string("body_bytes_sent"), 8,
+                          ngx_http_log_binary_body_bytes_sent },
+    { ngx_string("request_length"), 8,
+                          ngx_http_log_binary_request_length },
+
+    { ngx_null_string, 0, NULL }
+};
+
+
 static ngx_int_t
 ngx_http_log_handler(ngx_http_request_t *r)
 {
@@ -299,6 +433,7 @@ ngx_http_log_handler(ngx_http_request_t *r)
         ngx_http_script_flush_no_cacheable_variables(r, log[l].format->flushes);
 
         len = 0;
+        size = 0;
         op = log[l].format->ops->elts;
         for (i = 0; i < log[l].format->ops->nelts; i++) {
             if (op[i].len == 0) {
@@ -319,10 +454,26 @@ ngx_http_log_handler(ngx_http_request_t *r)
             goto alloc_line;
         }
 
-        len += NGX_LINEFEED_SIZE;
+        if (log[l].format->schema.len) {
+            size = 4 + len;
+            len = 1 + ngx_http_log_varint_len(size) + size;
+
+            if (log[l].generation != log[l].file->generation) {
+                len += log[l].format->schema.len;
+            }
+
+        } else {
+            len += NGX_LINEFEED_SIZE;
+        }
 
         buffer = log[l].file ? log[l].file->data : NULL;
 
+#if (NGX_THREADS)
+        if (buffer && buffer->async) {
+            goto alloc_line;
+        }
+#endif
+
         if (buffer) {
 
             if (len > (size_t) (buffer->last - buffer->pos)) {
@@ -341,11 +492,17 @@ ngx_http_log_handler(ngx_http_request_t *r)
                     ngx_add_timer(buffer->event, buffer->flush);
                 }
 
+                if (log[l].format->schema.len) {
+                    p = ngx_http_log_binary_header(&log[l], p, size);
+                }
+
                 for (i = 0; i < log[l].format->ops->nelts; i++) {
                     p = op[i].run(r, p, &op[i]);
                 }
 
-                ngx_linefeed(p);
+                if (log[l].format->schema.len == 0) {
+                    ngx_linefeed(p);
+                }
 
                 buffer->pos = p;
 
@@ -368,6 +525,9 @@ ngx_http_log_handler(ngx_http_request_t *r)
 
         if (log[l].syslog_peer) {
             p = ngx_syslog_add_header(log[l].syslog_peer, line);
+
+        } else if (log[l].format->schema.len) {
+            p = ngx_http_log_binary_header(&log[l], p, size);
         }
 
         for (i = 0; i < log[l].format->ops->nelts; i++) {
@@ -393,7 +553,9 @@ ngx_http_log_handler(ngx_http_request_t *r)
             continue;
         }
 
-        ngx_linefeed(p);
+        if (log[l].format->schema.len == 0) {
+            ngx_linefeed(p);
+        }
 
         ngx_http_log_write(r, &log[l], line, p - line);
     }
@@ -410,13 +572,22 @@ ngx_http_log_write(ngx_http_request_t *r, ngx_http_log_t *log, u_char *buf,
     time_t               now;
     ssize_t              n;
     ngx_err_t            err;
-#if (NGX_ZLIB)
+#if (NGX_ZLIB || NGX_THREADS)
     ngx_http_log_buf_t  *buffer;
 #endif
 
     if (log->script == NULL) {
         name = log->file->name.data;
 
+#if (NGX_THREADS)
+        buffer = log->file->data;
+
+        if (buffer && buffer->async) {
+            ngx_http_log_async_write(log->file, buf, len, r->connection->log);
+            return;
+        }
+#endif
+
 #if (NGX_ZLIB)
         buffer = log->file->data;
 
@@ -724,6 +895,13 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 
     buffer = file->data;
 
+#if (NGX_THREADS)
+    if (buffer->async) {
+        ngx_http_log_async_flush(file, log);
+        return;
+    }
+#endif
+
     len = buffer->pos - buffer->start;
 
     if (len == 0) {
@@ -769,6 +947,333 @@ ngx_http_log_flush_handler(ngx_event_t *ev)
 }
 
 
+#if (NGX_THREADS)
+
+static void
+ngx_http_log_async_write(ngx_open_file_t *file, u_char *buf, size_t len,
+    ngx_log_t *log)
+{
+    size_t                 size, pos, n;
+    ngx_http_log_buf_t    *buffer;
+    ngx_http_log_async_t  *async;
+
+    buffer = file->data;
+    async = buffer->async;
+
+    size = buffer->last - buffer->start;
+
+    if (len > size - (size_t) (async->head - async->tail)) {
+
+        /* the thread does not keep up with the log, drop the record */
+
+        async->dropped++;
+
+        ngx_http_log_async_post(file, log);
+        return;
+    }
+
+    pos = (size_t) (async->head % size);
+    n = ngx_min(len, size - pos);
+
+    ngx_memcpy(buffer->start + pos, buf, n);
+
+    if (n < len) {
+        ngx_memcpy(buffer->start, buf + n, len - n);
+    }
+
+    async->head += len;
+
+    ngx_http_log_async_schedule(file, log);
+}
+
+
+static void
+ngx_http_log_async_schedule(ngx_open_file_t *file, ngx_log_t *log)
+{
+    size_t                 size;
+    ngx_http_log_buf_t    *buffer;
+    ngx_http_log_async_t  *async;
+
+    buffer = file->data;
+    async = buffer->async;
+
+    if (async->head == async->sent) {
+        return;
+    }
+
+    size = buffer->last - buffer->start;
+
+    /* with "flush=" the records are batched until the ring is half full */
+
+    if (buffer->event && async->head - async->sent < size / 2) {
+
+        if (!buffer->event->timer_set) {
+            ngx_add_timer(buffer->event, buffer->flush);
+        }
+
+        return;
+    }
+
+    ngx_http_log_async_post(file, log);
+}
+
+
+static void
+ngx_http_log_async_post(ngx_open_file_t *file, ngx_log_t *log)
+{
+    size_t                     size, pos, len;
+    ngx_fd_t                   fd;
+    ngx_thread_task_t         *task;
+    ngx_http_log_buf_t        *buffer;
+    ngx_http_log_async_t      *async;
+    ngx_http_log_async_ctx_t  *ctx;
+
+    buffer = file->data;
+    async = buffer->async;
+
+    if (async->busy || async->head == async->sent) {
+        return;
+    }
+
+    /*
+     * the thread writes to a duplicate of the descriptor,
+     * so the file may be reopened while the write is in progress
+     */
+
+    fd = dup(file->fd);
+
+    if (fd == NGX_INVALID_FILE) {
+        if (ngx_time() - async->error_log_time > 59) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "dup() \"%s\" failed", file->name.data);
+
+            async->error_log_time = ngx_time();
+        }
+
+        return;
+    }
+
+    task = async->task;
+    ctx = task->ctx;
+
+    size = buffer->last - buffer->start;
+    pos = (size_t) (async->sent % size);
+    len = (size_t) (async->head - async->sent);
+
+    ctx->fd = fd;
+    ctx->buf[0] = buffer->start + pos;
+    ctx->len[0] = ngx_min(len, size - pos);
+    ctx->buf[1] = buffer->start;
+    ctx->len[1] = len - ctx->len[0];
+    ctx->gzip = buffer->gzip;
+    ctx->n = 0;
+    ctx->size = 0;
+    ctx->err = 0;
+
+    task->handler = ngx_http_log_async_thread_handler;
+    task->event.data = file;
+    task->event.handler = ngx_http_log_async_event_handler;
+
+    if (ngx_thread_task_post(async->thread_pool, task) != NGX_OK) {
+        (void) ngx_close_file(fd);
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http log async post: %uz of \"%s\"",
+                   len, file->name.data);
+
+    async->busy = 1;
+    async->sent = async->head;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+}
+
+
+static void
+ngx_http_log_async_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_log_async_ctx_t *ctx = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "http log async thread");
+
+    ngx_http_log_async_write_ctx(ctx, log);
+
+    (void) ngx_close_file(ctx->fd);
+}
+
+
+static void
+ngx_http_log_async_write_ctx(ngx_http_log_async_ctx_t *ctx, ngx_log_t *log)
+{
+    ssize_t     n;
+    ngx_uint_t  i;
+
+    for (i = 0; i < 2; i++) {
+
+        if (ctx->len[i] == 0) {
+            continue;
+        }
+
+#if (NGX_ZLIB)
+        if (ctx->gzip) {
+            n = ngx_http_log_gzip(ctx->fd, ctx->buf[i], ctx->len[i], ctx->gzip,
+                                  log);
+        } else {
+            n = ngx_write_fd(ctx->fd, ctx->buf[i], ctx->len[i]);
+        }
+#else
+        n = ngx_write_fd(ctx->fd, ctx->buf[i], ctx->len[i]);
+#endif
+
+        if (n != (ssize_t) ctx->len[i]) {
+            ctx->err = (n == -1) ? ngx_errno : 0;
+            ctx->n = n;
+            ctx->size = ctx->len[i];
+            return;
+        }
+    }
+}
+
+
+static void
+ngx_http_log_async_event_handler(ngx_event_t *ev)
+{
+    time_t                     now;
+    ngx_open_file_t           *file;
+    ngx_http_log_buf_t        *buffer;
+    ngx_http_log_async_t      *async;
+    ngx_http_log_async_ctx_t  *ctx;
+
+    file = ev->data;
+    buffer = file->data;
+    async = buffer->async;
+    ctx = async->task->ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http log async done: \"%s\"", file->name.data);
+
+    /* everything up to "sent" is written, see ngx_http_log_async_flush() */
+
+    async->busy = 0;
+    async->tail = async->sent;
+
+    now = ngx_time();
+
+    if (ctx->size && now - async->error_log_time > 59) {
+
+        if (ctx->n == -1) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, ctx->err,
+                          ngx_write_fd_n " to \"%s\" failed",
+                          file->name.data);
+
+        } else {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                          ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                          file->name.data, ctx->n, ctx->size);
+        }
+
+        async->error_log_time = now;
+    }
+
+    if (async->dropped && now - async->drop_log_time > 59) {
+        ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                      "%ui records of access log \"%s\" dropped",
+                      async->dropped, file->name.data);
+
+        async->dropped = 0;
+        async->drop_log_time = now;
+    }
+
+    ngx_http_log_async_schedule(file, ev->log);
+}
+
+
+static void
+ngx_http_log_async_timer_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "http log async flush handler");
+
+    ngx_http_log_async_post(ev->data, ev->log);
+}
+
+
+static void
+ngx_http_log_async_flush(ngx_open_file_t *file, ngx_log_t *log)
+{
+    size_t                     size, pos, len, n;
+    ngx_http_log_buf_t        *buffer;
+    ngx_http_log_async_t      *async;
+    ngx_http_log_async_ctx_t   ctx;
+
+    buffer = file->data;
+    async = buffer->async;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+
+    if (async->dropped) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "%ui records of access log \"%s\" dropped",
+                      async->dropped, file->name.data);
+
+        async->dropped = 0;
+    }
+
+    if (async->head == async->sent) {
+        return;
+    }
+
+    /*
+     * on reopen and on exit the records not yet posted to the thread
+     * are written synchronously; the range written by the thread that may
+     * still be in progress is accounted in ngx_http_log_async_event_handler()
+     */
+
+    size = buffer->last - buffer->start;
+    pos = (size_t) (async->sent % size);
+    len = (size_t) (async->head - async->sent);
+    n = ngx_min(len, size - pos);
+
+    ctx.fd = file->fd;
+    ctx.buf[0] = buffer->start + pos;
+    ctx.len[0] = n;
+    ctx.buf[1] = buffer->start;
+    ctx.len[1] = len - n;
+    ctx.gzip = buffer->gzip;
+    ctx.n = 0;
+    ctx.size = 0;
+    ctx.err = 0;
+
+    ngx_http_log_async_write_ctx(&ctx, log);
+
+    if (ctx.size) {
+        if (ctx.n == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ctx.err,
+                          ngx_write_fd_n " to \"%s\" failed",
+                          file->name.data);
+
+        } else {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                          file->name.data, ctx.n, ctx.size);
+        }
+    }
+
+    async->sent = async->head;
+
+    if (!async->busy) {
+        async->tail = async->head;
+    }
+}
+
+#endif
+
+
 static u_char *
 ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
@@ -789,53 +1294,169 @@ ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
 
 
 static u_char *
-ngx_http_log_copy_long(ngx_http_request_t *r, u_char *buf,
+ngx_http_log_copy_long(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+}
+
+
+static u_char *
+ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    if (r->pipeline) {
+        *buf = 'p';
+    } else {
+        *buf = '.';
+    }
+
+    return buf + 1;
+}
+
+
+static u_char *
+ngx_http_log_time(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cached_http_log_time.data,
+                      ngx_cached_http_log_time.len);
+}
+
+static u_char *
+ngx_http_log_iso8601(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cached_http_log_iso8601.data,
+                      ngx_cached_http_log_iso8601.len);
+}
+
+static u_char *
+ngx_http_log_msec(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    return ngx_sprintf(buf, "%T.%03M", tp->sec, tp->msec);
+}
+
+
+static u_char *
+ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    ngx_time_t      *tp;
+    ngx_msec_int_t   ms;
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
+
+    return ngx_sprintf(buf, "%T.%03M", (time_t) ms / 1000, ms % 1000);
+}
+
+
+static u_char *
+ngx_http_log_status(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    ngx_uint_t  status;
+
+    if (r->err_status) {
+        status = r->err_status;
+
+    } else if (r->headers_out.status) {
+        status = r->headers_out.status;
+
+    } else if (r->http_version == NGX_HTTP_VERSION_9) {
+        status = 9;
+
+    } else {
+        status = 0;
+    }
+
+    return ngx_sprintf(buf, "%03ui", status);
+}
+
+
+static u_char *
+ngx_http_log_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%O", r->connection->sent);
+}
+
+
+/*
+ * although there is a real $body_bytes_sent variable,
+ * this log operation code function is more optimized for logging
+ */
+
+static u_char *
+ngx_http_log_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    off_t  length;
+
+    length = r->connection->sent - r->header_size;
+
+    if (length > 0) {
+        return ngx_sprintf(buf, "%O", length);
+    }
+
+    *buf = '0';
+
+    return buf + 1;
+}
+
+
+static u_char *
+ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
 {
-    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+    return ngx_sprintf(buf, "%O", r->request_length);
 }
 
 
 static u_char *
-ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+ngx_http_log_binary_pipe(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
 {
-    if (r->pipeline) {
-        *buf = 'p';
-    } else {
-        *buf = '.';
-    }
+    *buf = r->pipeline ? 'p' : '.';
 
     return buf + 1;
 }
 
 
 static u_char *
-ngx_http_log_time(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+ngx_http_log_binary_time(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
 {
-    return ngx_cpymem(buf, ngx_cached_http_log_time.data,
-                      ngx_cached_http_log_time.len);
-}
+    ngx_time_t  *tp;
 
-static u_char *
-ngx_http_log_iso8601(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
-{
-    return ngx_cpymem(buf, ngx_cached_http_log_iso8601.data,
-                      ngx_cached_http_log_iso8601.len);
+    tp = ngx_timeofday();
+
+    /* seconds since the Epoch and the offset from UTC in minutes */
+
+    buf = ngx_http_log_uint(buf, (uint64_t) tp->sec, 8);
+
+    return ngx_http_log_uint(buf, (uint64_t) tp->gmtoff, 2);
 }
 
+
 static u_char *
-ngx_http_log_msec(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+ngx_http_log_binary_msec(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
 {
     ngx_time_t  *tp;
 
     tp = ngx_timeofday();
 
-    return ngx_sprintf(buf, "%T.%03M", tp->sec, tp->msec);
+    return ngx_http_log_uint(buf, (uint64_t) tp->sec * 1000 + tp->msec, 8);
 }
 
 
 static u_char *
-ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
+ngx_http_log_binary_request_time(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
 {
     ngx_time_t      *tp;
@@ -847,12 +1468,13 @@ ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
              ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
     ms = ngx_max(ms, 0);
 
-    return ngx_sprintf(buf, "%T.%03M", (time_t) ms / 1000, ms % 1000);
+    return ngx_http_log_uint(buf, (uint64_t) ms, 8);
 }
 
 
 static u_char *
-ngx_http_log_status(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+ngx_http_log_binary_status(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
 {
     ngx_uint_t  status;
 
@@ -869,46 +1491,127 @@ ngx_http_log_status(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
         status = 0;
     }
 
-    return ngx_sprintf(buf, "%03ui", status);
+    return ngx_http_log_uint(buf, status, 2);
 }
 
 
 static u_char *
-ngx_http_log_bytes_sent(ngx_http_request_t *r, u_char *buf,
+ngx_http_log_binary_bytes_sent(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
 {
-    return ngx_sprintf(buf, "%O", r->connection->sent);
+    return ngx_http_log_uint(buf, (uint64_t) r->connection->sent, 8);
 }
 
 
-/*
- * although there is a real $body_bytes_sent variable,
- * this log operation code function is more optimized for logging
- */
-
 static u_char *
-ngx_http_log_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+ngx_http_log_binary_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
 {
     off_t  length;
 
     length = r->connection->sent - r->header_size;
 
-    if (length > 0) {
-        return ngx_sprintf(buf, "%O", length);
-    }
+    return ngx_http_log_uint(buf, (uint64_t) ngx_max(length, 0), 8);
+}
 
-    *buf = '0';
 
-    return buf + 1;
+static u_char *
+ngx_http_log_binary_request_length(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_http_log_uint(buf, (uint64_t) r->request_length, 8);
+}
+
+
+static size_t
+ngx_http_log_binary_variable_getlen(ngx_http_request_t *r, uintptr_t data)
+{
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, data);
+
+    if (value == NULL || value->not_found) {
+        return 1;
+    }
+
+    return ngx_http_log_varint_len(value->len + 1) + value->len;
 }
 
 
 static u_char *
-ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
+ngx_http_log_binary_variable(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
 {
-    return ngx_sprintf(buf, "%O", r->request_length);
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, op->data);
+
+    if (value == NULL || value->not_found) {
+        *buf = 0;
+        return buf + 1;
+    }
+
+    buf = ngx_http_log_varint(buf, value->len + 1);
+
+    return ngx_cpymem(buf, value->data, value->len);
+}
+
+
+static u_char *
+ngx_http_log_binary_header(ngx_http_log_t *log, u_char *buf, size_t len)
+{
+    if (log->generation != log->file->generation) {
+        buf = ngx_cpymem(buf, log->format->schema.data,
+                         log->format->schema.len);
+        log->generation = log->file->generation;
+    }
+
+    *buf++ = NGX_HTTP_LOG_BIN_RECORD;
+    buf = ngx_http_log_varint(buf, len);
+
+    return ngx_http_log_uint(buf, log->format->id, 4);
+}
+
+
+static size_t
+ngx_http_log_varint_len(uint64_t n)
+{
+    size_t  len;
+
+    len = 1;
+
+    while (n >= 0x80) {
+        n >>= 7;
+        len++;
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_http_log_varint(u_char *buf, uint64_t n)
+{
+    while (n >= 0x80) {
+        *buf++ = (u_char) (n | 0x80);
+        n >>= 7;
+    }
+
+    *buf++ = (u_char) n;
+
+    return buf;
+}
+
+
+static u_char *
+ngx_http_log_uint(u_char *buf, uint64_t n, size_t len)
+{
+    while (len--) {
+        *buf++ = (u_char) (n & 0xff);
+        n >>= 8;
+    }
+
+    return buf;
 }
 
 
@@ -1239,7 +1942,7 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_log_loc_conf_t *llcf = conf;
 
-    ssize_t                            size;
+    ssize_t                            size, async;
     ngx_int_t                          gzip;
     ngx_uint_t                         i, n;
     ngx_msec_t                         flush;
@@ -1361,7 +2064,28 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+    if (log->format->schema.len) {
+
+        if (log->syslog_peer) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "binary log format \"%V\" cannot be used "
+                               "for logging to syslog", &name);
+            return NGX_CONF_ERROR;
+        }
+
+        if (log->script) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "binary logs cannot have variables in name");
+            return NGX_CONF_ERROR;
+        }
+
+        /* force the schema before the first record */
+
+        log->generation = (ngx_uint_t) -1;
+    }
+
     size = 0;
+    async = 0;
     flush = 0;
     gzip = 0;
 
@@ -1382,6 +2106,27 @@ process_formats:
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "async=", 6) == 0) {
+#if (NGX_THREADS)
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            async = ngx_parse_size(&s);
+
+            if (async == NGX_ERROR || async == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid async buffer size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"async\" is unsupported on this platform");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
         if (ngx_strncmp(value[i].data, "flush=", 6) == 0) {
             s.len = value[i].len - 6;
             s.data = value[i].data + 6;
@@ -1401,10 +2146,6 @@ process_formats:
             && (value[i].len == 4 || value[i].data[4] == '='))
         {
 #if (NGX_ZLIB)
-            if (size == 0) {
-                size = 64 * 1024;
-            }
-
             if (value[i].len == 4) {
                 gzip = Z_BEST_SPEED;
                 continue;
@@ -1458,6 +2199,21 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+    if (async) {
+        if (size) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"buffer\" and \"async\" cannot be used "
+                               "together for access_log \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        size = async;
+    }
+
+    if (gzip && size == 0) {
+        size = 64 * 1024;
+    }
+
     if (flush && size == 0) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "no buffer is defined for access_log \"%V\"",
@@ -1484,7 +2240,11 @@ process_formats:
 
             if (buffer->last - buffer->start != size
                 || buffer->flush != flush
-                || buffer->gzip != gzip)
+                || buffer->gzip != gzip
+#if (NGX_THREADS)
+                || (buffer->async != NULL) != (async != 0)
+#endif
+               )
             {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                    "access_log \"%V\" already defined "
@@ -1525,6 +2285,35 @@ process_formats:
 
         buffer->gzip = gzip;
 
+#if (NGX_THREADS)
+
+        if (async) {
+            buffer->async = ngx_pcalloc(cf->pool,
+                                        sizeof(ngx_http_log_async_t));
+            if (buffer->async == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            buffer->async->thread_pool = ngx_thread_pool_add(cf, NULL);
+            if (buffer->async->thread_pool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            buffer->async->task = ngx_thread_task_alloc(cf->pool,
+                                           sizeof(ngx_http_log_async_ctx_t));
+            if (buffer->async->task == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            buffer->async->task->event.log = &cf->cycle->new_log;
+
+            if (buffer->event) {
+                buffer->event->handler = ngx_http_log_async_timer_handler;
+            }
+        }
+
+#endif
+
         log->file->flush = ngx_http_log_flush;
         log->file->data = buffer;
     }
@@ -1538,8 +2327,9 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_log_main_conf_t *lmcf = conf;
 
+    char                *rv;
     ngx_str_t           *value;
-    ngx_uint_t           i;
+    ngx_uint_t           i, binary;
     ngx_http_log_fmt_t  *fmt;
 
     value = cf->args->elts;
@@ -1573,13 +2363,22 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    return ngx_http_log_compile_format(cf, fmt->flushes, fmt->ops, cf->args, 2);
+    binary = 0;
+
+    rv = ngx_http_log_compile_format(cf, fmt->flushes, fmt->ops, cf->args, 2,
+                                     &binary);
+
+    if (rv != NGX_CONF_OK || !binary) {
+        return rv;
+    }
+
+    return ngx_http_log_compile_binary(cf, fmt);
 }
 
 
 static char *
 ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
-    ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s)
+    ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s, ngx_uint_t *binary)
 {
     u_char              *data, *p, ch;
     size_t               i, len;
@@ -1592,22 +2391,47 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
     escape = NGX_HTTP_LOG_ESCAPE_DEFAULT;
     value = args->elts;
 
-    if (s < args->nelts && ngx_strncmp(value[s].data, "escape=", 7) == 0) {
-        data = value[s].data + 7;
+    for ( /* void */ ; s < args->nelts; s++) {
 
-        if (ngx_strcmp(data, "json") == 0) {
-            escape = NGX_HTTP_LOG_ESCAPE_JSON;
+        if (ngx_strncmp(value[s].data, "escape=", 7) == 0) {
+            data = value[s].data + 7;
 
-        } else if (ngx_strcmp(data, "none") == 0) {
-            escape = NGX_HTTP_LOG_ESCAPE_NONE;
+            if (ngx_strcmp(data, "json") == 0) {
+                escape = NGX_HTTP_LOG_ESCAPE_JSON;
 
-        } else if (ngx_strcmp(data, "default") != 0) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "unknown log format escaping \"%s\"", data);
-            return NGX_CONF_ERROR;
+            } else if (ngx_strcmp(data, "none") == 0) {
+                escape = NGX_HTTP_LOG_ESCAPE_NONE;
+
+            } else if (ngx_strcmp(data, "default") != 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "unknown log format escaping \"%s\"",
+                                   data);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (binary && ngx_strncmp(value[s].data, "encoding=", 9) == 0) {
+            data = value[s].data + 9;
+
+            if (ngx_strcmp(data, "binary") == 0) {
+                *binary = 1;
+
+            } else if (ngx_strcmp(data, "text") == 0) {
+                *binary = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "unknown log format encoding \"%s\"",
+                                   data);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
         }
 
-        s++;
+        break;
     }
 
     for ( /* void */ ; s < args->nelts; s++) {
@@ -1756,6 +2580,142 @@ invalid:
 }
 
 
+static char *
+ngx_http_log_compile_binary(ngx_conf_t *cf, ngx_http_log_fmt_t *fmt)
+{
+    u_char                     *buf, *payload, *p, *data;
+    size_t                      len, size;
+    uint32_t                    id;
+    ngx_uint_t                  i, kind;
+    ngx_str_t                   text;
+    ngx_array_t                *ops;
+    ngx_http_log_op_t          *op, *bop;
+    ngx_http_log_var_t         *v;
+    ngx_http_variable_t        *var;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    var = cmcf->variables.elts;
+
+    op = fmt->ops->elts;
+
+    ops = ngx_array_create(cf->pool, fmt->ops->nelts + 1,
+                           sizeof(ngx_http_log_op_t));
+    if (ops == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    size = 1 + NGX_HTTP_LOG_VARINT_LEN + 4
+           + NGX_HTTP_LOG_VARINT_LEN + fmt->name.len
+           + NGX_HTTP_LOG_VARINT_LEN;
+
+    for (i = 0; i < fmt->ops->nelts; i++) {
+        size += 1 + NGX_HTTP_LOG_VARINT_LEN + op[i].len;
+
+        if (op[i].getlen) {
+            size += var[op[i].data].name.len;
+        }
+    }
+
+    buf = ngx_pnalloc(cf->pool, size);
+    if (buf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    payload = buf + 1 + NGX_HTTP_LOG_VARINT_LEN + 4;
+
+    p = ngx_http_log_varint(payload, fmt->name.len);
+    p = ngx_cpymem(p, fmt->name.data, fmt->name.len);
+    p = ngx_http_log_varint(p, fmt->ops->nelts);
+
+    for (i = 0; i < fmt->ops->nelts; i++) {
+
+        if (op[i].run == ngx_http_log_copy_short
+            || op[i].run == ngx_http_log_copy_long)
+        {
+            *p++ = NGX_HTTP_LOG_BIN_LITERAL;
+            p = ngx_http_log_varint(p, op[i].len);
+
+            if (op[i].run == ngx_http_log_copy_short) {
+                p = ngx_http_log_uint(p, op[i].data, op[i].len);
+
+            } else {
+                p = ngx_cpymem(p, (u_char *) op[i].data, op[i].len);
+            }
+
+            continue;
+        }
+
+        bop = ngx_array_push(ops);
+        if (bop == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (op[i].getlen) {
+
+            if (op[i].run == ngx_http_log_json_variable) {
+                kind = NGX_HTTP_LOG_BIN_VARIABLE + NGX_HTTP_LOG_ESCAPE_JSON;
+
+            } else if (op[i].run == ngx_http_log_unescaped_variable) {
+                kind = NGX_HTTP_LOG_BIN_VARIABLE + NGX_HTTP_LOG_ESCAPE_NONE;
+
+            } else {
+                kind = NGX_HTTP_LOG_BIN_VARIABLE + NGX_HTTP_LOG_ESCAPE_DEFAULT;
+            }
+
+            text = var[op[i].data].name;
+
+            *p++ = (u_char) kind;
+            p = ngx_http_log_varint(p, text.len);
+            p = ngx_cpymem(p, text.data, text.len);
+
+            bop->len = 0;
+            bop->getlen = ngx_http_log_binary_variable_getlen;
+            bop->run = ngx_http_log_binary_variable;
+            bop->data = op[i].data;
+
+            continue;
+        }
+
+        for (v = ngx_http_log_vars; v->name.len; v++) {
+            if (v->run == op[i].run) {
+                break;
+            }
+        }
+
+        kind = v - ngx_http_log_vars;
+
+        *p++ = (u_char) (kind + 1);
+
+        bop->len = ngx_http_log_binary_vars[kind].len;
+        bop->getlen = NULL;
+        bop->run = ngx_http_log_binary_vars[kind].run;
+        bop->data = 0;
+    }
+
+    /* the format id is a checksum of the schema */
+
+    len = p - payload;
+    id = ngx_crc32_long(payload, len);
+
+    len += 4;
+
+    data = payload - 4 - ngx_http_log_varint_len(len) - 1;
+
+    p = data;
+    *p++ = NGX_HTTP_LOG_BIN_SCHEMA;
+    p = ngx_http_log_varint(p, len);
+    p = ngx_http_log_uint(p, id, 4);
+
+    fmt->schema.data = data;
+    fmt->schema.len = payload - data + len - 4;
+    fmt->id = id;
+    fmt->ops = ops;
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -1889,7 +2849,7 @@ ngx_http_log_init(ngx_conf_t *cf)
         *value = ngx_http_combined_fmt;
         fmt = lmcf->formats.elts;
 
-        if (ngx_http_log_compile_format(cf, NULL, fmt->ops, &a, 0)
+        if (ngx_http_log_compile_format(cf, NULL, fmt->ops, &a, 0, NULL)
             != NGX_CONF_OK)
         {
             return NGX_ERROR;
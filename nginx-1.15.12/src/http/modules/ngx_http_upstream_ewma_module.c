@@ -0,0 +1,482 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_msec_t                          decay;
+    ngx_http_upstream_rr_peer_t       **peers;
+} ngx_http_upstream_ewma_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t    rrp;
+
+    ngx_http_upstream_ewma_srv_conf_t  *conf;
+    ngx_http_upstream_t                *upstream;
+    u_char                              tries;
+} ngx_http_upstream_ewma_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_ewma(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_update_ewma(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us);
+
+static ngx_int_t ngx_http_upstream_init_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_free_ewma_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_msec_t ngx_http_upstream_ewma_decayed(ngx_msec_t decay,
+    ngx_http_upstream_rr_peer_t *peer, ngx_msec_t now);
+static void *ngx_http_upstream_ewma_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_ewma_commands[] = {
+
+    { ngx_string("ewma"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_upstream_ewma,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_ewma_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_ewma_create_conf,    /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_ewma_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_ewma_module_ctx,    /* module context */
+    ngx_http_upstream_ewma_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_ewma(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "init ewma");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_ewma_peer;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (us->shm_zone) {
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_http_upstream_update_ewma(cf->pool, us);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_update_ewma(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    size_t                              size;
+    ngx_uint_t                          i;
+    ngx_http_upstream_rr_peer_t        *peer, **list;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_ewma_srv_conf_t  *ecf;
+
+    ecf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_ewma_module);
+
+    peers = us->peer.data;
+
+    size = peers->number * sizeof(ngx_http_upstream_rr_peer_t *);
+
+    list = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
+    if (list == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        list[i] = peer;
+    }
+
+    ecf->peers = list;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_ewma_srv_conf_t   *ecf;
+    ngx_http_upstream_ewma_peer_data_t  *ep;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init ewma peer");
+
+    ecf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_ewma_module);
+
+    ep = ngx_palloc(r->pool, sizeof(ngx_http_upstream_ewma_peer_data_t));
+    if (ep == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &ep->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_ewma_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_ewma_peer;
+
+    ep->conf = ecf;
+    ep->upstream = r->upstream;
+    ep->tries = 0;
+
+    ngx_http_upstream_rr_peers_rlock(ep->rrp.peers);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (ep->rrp.peers->shpool && ecf->peers == NULL) {
+        if (ngx_http_upstream_update_ewma(NULL, us) != NGX_OK) {
+            ngx_http_upstream_rr_peers_unlock(ep->rrp.peers);
+            return NGX_ERROR;
+        }
+    }
+#endif
+
+    ngx_http_upstream_rr_peers_unlock(ep->rrp.peers);
+
+    return NGX_OK;
+}
+
+
+/*
+ * two random peers are compared by their decayed response time
+ * multiplied by the number of requests in flight and divided by weight,
+ * and the cheaper one is used ("power of two choices")
+ */
+
+static ngx_int_t
+ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_ewma_peer_data_t  *ep = data;
+
+    time_t                             now;
+    uint64_t                           cost, prev_cost;
+    uintptr_t                          m;
+    ngx_msec_t                         msec;
+    ngx_uint_t                         i, n, p;
+    ngx_http_upstream_rr_peer_t       *peer, *prev;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get ewma peer, try: %ui", pc->tries);
+
+    rrp = &ep->rrp;
+    peers = rrp->peers;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    if (ep->tries > 20 || peers->single) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+    msec = ngx_current_msec;
+
+    prev = NULL;
+
+#if (NGX_SUPPRESS_WARN)
+    p = 0;
+    prev_cost = 0;
+#endif
+
+    for ( ;; ) {
+
+        i = ngx_random() % peers->number;
+
+        peer = ep->conf->peers[i];
+
+        if (peer == prev) {
+            goto next;
+        }
+
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            goto next;
+        }
+
+        if (peer->down) {
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            goto next;
+        }
+
+        cost = ngx_http_upstream_ewma_decayed(ep->conf->decay, peer, msec);
+        cost = (cost + 1) * (peer->conns + 1);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get ewma peer: %V cost:%uL weight:%i",
+                       &peer->name, cost, peer->weight);
+
+        if (prev) {
+            if (cost * prev->weight > prev_cost * peer->weight) {
+                peer = prev;
+                n = p / (8 * sizeof(uintptr_t));
+                m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+            }
+
+            break;
+        }
+
+        prev = peer;
+        prev_cost = cost;
+        p = i;
+
+    next:
+
+        if (++ep->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(peers);
+            return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+        }
+    }
+
+    rrp->current = peer;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    rrp->tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_free_ewma_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_ewma_peer_data_t  *ep = data;
+
+    ngx_msec_t                    now, rtt, avg;
+    ngx_http_upstream_t          *u;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    peer = ep->rrp.current;
+    u = ep->upstream;
+
+    if (peer == NULL || u->state == NULL) {
+        goto done;
+    }
+
+    /*
+     * the time to the response header is used, as the time to the end
+     * of the response depends on its length; a failed attempt counts
+     * with all the time it took
+     */
+
+    now = ngx_current_msec;
+
+    if (!(state & NGX_PEER_FAILED)
+        && u->state->header_time != (ngx_msec_t) -1)
+    {
+        rtt = u->state->header_time;
+
+    } else {
+        rtt = now - u->start_time;
+    }
+
+    ngx_http_upstream_rr_peers_rlock(ep->rrp.peers);
+    ngx_http_upstream_rr_peer_lock(ep->rrp.peers, peer);
+
+    avg = ngx_http_upstream_ewma_decayed(ep->conf->decay, peer, now);
+
+    /*
+     * peak ewma: a slower response replaces the average at once,
+     * faster ones move it with the weight of the time passed
+     */
+
+    if (rtt >= avg) {
+        peer->ewma = rtt;
+
+    } else {
+        peer->ewma = avg - (ngx_msec_t) ((uint64_t) (avg - rtt)
+                                         * (now - peer->ewma_updated)
+                                         / (ep->conf->decay
+                                            + now - peer->ewma_updated));
+    }
+
+    peer->ewma_updated = now;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free ewma peer: %V rtt:%M ewma:%M",
+                   &peer->name, rtt, peer->ewma);
+
+    ngx_http_upstream_rr_peer_unlock(ep->rrp.peers, peer);
+    ngx_http_upstream_rr_peers_unlock(ep->rrp.peers);
+
+done:
+
+    ngx_http_upstream_free_round_robin_peer(pc, &ep->rrp, state);
+}
+
+
+/*
+ * the average decays towards zero while a peer is not used,
+ * so a peer which was slow once is eventually tried again;
+ * decay / (decay + t) stands for exp(-t / decay)
+ */
+
+static ngx_msec_t
+ngx_http_upstream_ewma_decayed(ngx_msec_t decay,
+    ngx_http_upstream_rr_peer_t *peer, ngx_msec_t now)
+{
+    ngx_msec_t  elapsed;
+
+    elapsed = now - peer->ewma_updated;
+
+    if (elapsed == 0 || peer->ewma == 0) {
+        return peer->ewma;
+    }
+
+    return (ngx_msec_t) ((uint64_t) peer->ewma * decay / (decay + elapsed));
+}
+
+
+static void *
+ngx_http_upstream_ewma_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_ewma_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_ewma_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->peers = NULL;
+     */
+
+    conf->decay = 10000;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_ewma_srv_conf_t  *ecf = conf;
+
+    ngx_str_t                     *value, s;
+    ngx_msec_t                     decay;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_ewma;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN;
+
+    if (cf->args->nelts == 1) {
+        return NGX_CONF_OK;
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "decay=", 6) == 0) {
+
+        s.len = value[1].len - 6;
+        s.data = value[1].data + 6;
+
+        decay = ngx_parse_time(&s, 0);
+
+        if (decay == (ngx_msec_t) NGX_ERROR || decay == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid decay \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        ecf->decay = decay;
+
+        return NGX_CONF_OK;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
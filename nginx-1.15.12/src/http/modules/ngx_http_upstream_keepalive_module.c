@@ -10,14 +10,28 @@
 #include <ngx_http.h>
 
 
+typedef struct {
+    ngx_atomic_t                       requests;
+    ngx_atomic_t                       reused;
+    ngx_atomic_t                       passed;
+
+    /* slot + 1 of the worker which lacked a connection last */
+    ngx_atomic_t                       wanted;
+} ngx_http_upstream_keepalive_shctx_t;
+
+
 typedef struct {
     ngx_uint_t                         max_cached;
     ngx_uint_t                         requests;
     ngx_msec_t                         timeout;
+    ngx_flag_t                         share;
 
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
 
+    ngx_uint_t                         index;
+    ngx_http_upstream_keepalive_shctx_t  *sh;
+
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
 
@@ -64,6 +78,9 @@ static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_keepalive_pass(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_adopt(ngx_socket_t s, ngx_uint_t tag);
 
 #if (NGX_HTTP_SSL)
 static ngx_int_t ngx_http_upstream_keepalive_set_session(
@@ -72,9 +89,16 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static ngx_int_t ngx_http_upstream_keepalive_counter(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+
+static ngx_int_t ngx_http_upstream_keepalive_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_keepalive_init_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
 
 
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
@@ -100,12 +124,19 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
       NULL },
 
+    { ngx_string("keepalive_share"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, share),
+      NULL },
+
       ngx_null_command
 };
 
 
 static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_keepalive_add_variables, /* preconfiguration */
     NULL,                                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
@@ -126,7 +157,7 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -135,12 +166,41 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
 };
 
 
+static ngx_str_t  ngx_http_upstream_keepalive_zone_name =
+    ngx_string("upstream_keepalive");
+
+
+static ngx_http_variable_t  ngx_http_upstream_keepalive_vars[] = {
+
+    { ngx_string("upstream_keepalive_requests"), NULL,
+      ngx_http_upstream_keepalive_counter,
+      offsetof(ngx_http_upstream_keepalive_shctx_t, requests),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_keepalive_reused"), NULL,
+      ngx_http_upstream_keepalive_counter,
+      offsetof(ngx_http_upstream_keepalive_shctx_t, reused),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_keepalive_passed"), NULL,
+      ngx_http_upstream_keepalive_counter,
+      offsetof(ngx_http_upstream_keepalive_shctx_t, passed),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+      ngx_http_null_variable
+};
+
+
 static ngx_int_t
 ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
     ngx_uint_t                               i;
-    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+    ngx_array_t                             *confs;
+    ngx_shm_zone_t                          *shm_zone;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf, **kcfp;
     ngx_http_upstream_keepalive_cache_t     *cached;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
@@ -151,6 +211,61 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     ngx_conf_init_msec_value(kcf->timeout, 60000);
     ngx_conf_init_uint_value(kcf->requests, 100);
+    ngx_conf_init_value(kcf->share, 0);
+
+    /*
+     * the index identifies the upstream in the sockets passed
+     * between worker processes, all of them use the same configuration
+     */
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i] == us) {
+            kcf->index = i;
+            break;
+        }
+    }
+
+    /*
+     * counters of all upstreams sharing connections are kept
+     * in a single zone, other upstreams do not touch shared memory
+     */
+
+    if (kcf->share) {
+        shm_zone = ngx_shared_memory_add(cf,
+                                         &ngx_http_upstream_keepalive_zone_name,
+                                         0, &ngx_http_upstream_keepalive_module);
+        if (shm_zone == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (shm_zone->data == NULL) {
+            confs = ngx_array_create(cf->pool, 4,
+                           sizeof(ngx_http_upstream_keepalive_srv_conf_t *));
+            if (confs == NULL) {
+                return NGX_ERROR;
+            }
+
+            shm_zone->init = ngx_http_upstream_keepalive_init_zone;
+            shm_zone->data = confs;
+            shm_zone->noreuse = 1;
+            shm_zone->shm.size = 8 * ngx_pagesize;
+        }
+
+        confs = shm_zone->data;
+
+        kcfp = ngx_array_push(confs);
+        if (kcfp == NULL) {
+            return NGX_ERROR;
+        }
+
+        *kcfp = kcf;
+
+        shm_zone->shm.size += 2 * sizeof(ngx_http_upstream_keepalive_shctx_t);
+    }
 
     if (kcf->original_init_upstream(cf, us) != NGX_OK) {
         return NGX_ERROR;
@@ -229,9 +344,10 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_int_t          rc;
-    ngx_queue_t       *q, *cache;
-    ngx_connection_t  *c;
+    ngx_int_t                             rc;
+    ngx_queue_t                          *q, *cache;
+    ngx_connection_t                     *c;
+    ngx_http_upstream_keepalive_shctx_t  *sh;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer");
@@ -244,6 +360,12 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         return rc;
     }
 
+    sh = kp->conf->sh;
+
+    if (sh) {
+        (void) ngx_atomic_fetch_add(&sh->requests, 1);
+    }
+
     /* search cache for suitable connection */
 
     cache = &kp->conf->cache;
@@ -266,10 +388,20 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         }
     }
 
+    /* let other workers know they may pass us an idle connection */
+
+    if (sh) {
+        sh->wanted = ngx_process_slot + 1;
+    }
+
     return NGX_OK;
 
 found:
 
+    if (sh) {
+        (void) ngx_atomic_fetch_add(&sh->reused, 1);
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer: using connection %p", c);
 
@@ -351,7 +483,11 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
 
-        ngx_http_upstream_keepalive_close(item->connection);
+        if (ngx_http_upstream_keepalive_pass(kp->conf, item->connection)
+            != NGX_OK)
+        {
+            ngx_http_upstream_keepalive_close(item->connection);
+        }
 
     } else {
         q = ngx_queue_head(&kp->conf->free);
@@ -390,6 +526,27 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
 
+    /*
+     * another worker had to open a connection, so pass it
+     * the least recently used one unless it is the only one we have
+     */
+
+    q = ngx_queue_last(&kp->conf->cache);
+
+    if (kp->conf->share
+        && kp->conf->sh->wanted
+        && q != ngx_queue_head(&kp->conf->cache))
+    {
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        if (ngx_http_upstream_keepalive_pass(kp->conf, item->connection)
+            == NGX_OK)
+        {
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&kp->conf->free, q);
+        }
+    }
+
 invalid:
 
     kp->original_free_peer(pc, kp->data, state);
@@ -470,6 +627,210 @@ ngx_http_upstream_keepalive_close(ngx_connection_t *c)
 }
 
 
+static ngx_int_t
+ngx_http_upstream_keepalive_pass(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_connection_t *c)
+{
+    ngx_atomic_uint_t  slot;
+
+    if (!kcf->share || ngx_terminate || ngx_exiting) {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    /* the TLS state cannot be passed along with the socket */
+
+    if (c->ssl) {
+        return NGX_DECLINED;
+    }
+
+#endif
+
+    slot = kcf->sh->wanted;
+
+    if (slot == 0
+        || slot == (ngx_atomic_uint_t) ngx_process_slot + 1
+        || !ngx_atomic_cmp_set(&kcf->sh->wanted, slot, 0))
+    {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_pass_socket((ngx_cycle_t *) ngx_cycle, slot - 1, c->fd,
+                        kcf->index)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "keepalive connection %p passed to s:%uA", c, slot - 1);
+
+    (void) ngx_atomic_fetch_add(&kcf->sh->passed, 1);
+
+    /*
+     * the socket stays open in the other process, so the events
+     * are removed explicitly rather than by the close()
+     */
+
+    if (ngx_del_conn) {
+        ngx_del_conn(c, 0);
+
+    } else {
+        if (c->read->active || c->read->disabled) {
+            ngx_del_event(c->read, NGX_READ_EVENT, 0);
+        }
+
+        if (c->write->active || c->write->disabled) {
+            ngx_del_event(c->write, NGX_WRITE_EVENT, 0);
+        }
+    }
+
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_adopt(ngx_socket_t s, ngx_uint_t tag)
+{
+    ngx_log_t                               *log;
+    ngx_queue_t                             *q;
+    ngx_event_t                             *rev, *wev;
+    ngx_connection_t                        *c;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    log = ngx_cycle->log;
+
+    umcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_upstream_module);
+
+    if (umcf == NULL || tag >= umcf->upstreams.nelts) {
+        goto close;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    if (uscfp[tag]->srv_conf == NULL) {
+        goto close;
+    }
+
+    kcf = ngx_http_conf_upstream_srv_conf(uscfp[tag],
+                                          ngx_http_upstream_keepalive_module);
+
+    if (!kcf->share
+        || ngx_terminate
+        || ngx_exiting
+        || ngx_queue_empty(&kcf->free))
+    {
+        goto close;
+    }
+
+    q = ngx_queue_head(&kcf->free);
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    item->socklen = sizeof(ngx_sockaddr_t);
+
+    if (getpeername(s, &item->sockaddr.sockaddr, &item->socklen) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "getpeername() failed");
+        goto close;
+    }
+
+    c = ngx_get_connection(s, log);
+
+    if (c == NULL) {
+        goto close;
+    }
+
+    c->pool = ngx_create_pool(128, log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return;
+    }
+
+    c->type = SOCK_STREAM;
+
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+
+    c->sendfile = 1;
+
+    if (item->sockaddr.sockaddr.sa_family == AF_UNIX) {
+        c->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+        c->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+    }
+
+    c->log_error = NGX_ERROR_ERR;
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    rev = c->read;
+    wev = c->write;
+
+    rev->log = log;
+    wev->log = log;
+
+    if (ngx_add_conn) {
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            goto failed;
+        }
+
+    } else {
+        if (ngx_add_event(rev, NGX_READ_EVENT,
+                          (ngx_event_flags & NGX_USE_CLEAR_EVENT)
+                          ? NGX_CLEAR_EVENT : NGX_LEVEL_EVENT)
+            != NGX_OK)
+        {
+            goto failed;
+        }
+    }
+
+    wev->ready = 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "keepalive connection %p adopted, fd:%d", c, s);
+
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&kcf->cache, q);
+
+    item->connection = c;
+
+    ngx_add_timer(rev, kcf->timeout);
+
+    wev->handler = ngx_http_upstream_keepalive_dummy_handler;
+    rev->handler = ngx_http_upstream_keepalive_close_handler;
+
+    c->data = item;
+    c->idle = 1;
+
+    return;
+
+failed:
+
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+
+    return;
+
+close:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "keepalive socket %d not adopted", s);
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+}
+
+
 #if (NGX_HTTP_SSL)
 
 static ngx_int_t
@@ -493,6 +854,94 @@ ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
 #endif
 
 
+static ngx_int_t
+ngx_http_upstream_keepalive_counter(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                                  *p;
+    ngx_http_upstream_srv_conf_t            *uscf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    if (r->upstream == NULL
+        || r->upstream->upstream == NULL
+        || r->upstream->upstream->srv_conf == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    uscf = r->upstream->upstream;
+
+    kcf = ngx_http_conf_upstream_srv_conf(uscf,
+                                          ngx_http_upstream_keepalive_module);
+
+    if (kcf->sh == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%uA", *(ngx_atomic_t *) ((char *) kcf->sh + data))
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_upstream_keepalive_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_uint_t                               i;
+    ngx_array_t                             *confs;
+    ngx_slab_pool_t                         *shpool;
+    ngx_http_upstream_keepalive_srv_conf_t **kcfp;
+
+    /* the zone is not reused, counters start from zero on reload */
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    confs = shm_zone->data;
+    kcfp = confs->elts;
+
+    for (i = 0; i < confs->nelts; i++) {
+        kcfp[i]->sh = ngx_slab_calloc(shpool,
+                              sizeof(ngx_http_upstream_keepalive_shctx_t));
+        if (kcfp[i]->sh == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 {
@@ -510,10 +959,13 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      *     conf->max_cached = 0;
+     *     conf->index = 0;
+     *     conf->sh = NULL;
      */
 
     conf->timeout = NGX_CONF_UNSET_MSEC;
     conf->requests = NGX_CONF_UNSET_UINT;
+    conf->share = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -559,3 +1011,12 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_pass_socket_handler = ngx_http_upstream_keepalive_adopt;
+
+    return NGX_OK;
+}
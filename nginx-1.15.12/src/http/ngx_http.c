@@ -1777,6 +1777,7 @@ ngx_http_add_listening(ngx_conf_t *cf, ngx_http_conf_addr_t *addr)
 
 #if (NGX_HAVE_REUSEPORT)
     ls->reuseport = addr->opt.reuseport;
+    ls->reuseport_steer = addr->opt.reuseport_steer;
 #endif
 
     return ls;
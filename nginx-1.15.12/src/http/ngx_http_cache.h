@@ -29,6 +29,10 @@
 
 #define NGX_HTTP_CACHE_VERSION       5
 
+#define NGX_HTTP_CACHE_LRU           0
+#define NGX_HTTP_CACHE_SLRU          1
+#define NGX_HTTP_CACHE_GDSF          2
+
 
 typedef struct {
     ngx_uint_t                       status;
@@ -36,6 +40,21 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+/* a response being written to a temp file, see *_cache_lock_stream */
+
+typedef struct {
+    ngx_event_pipe_progress_t        progress;
+    size_t                           body_start;
+    ngx_uint_t                       count;
+
+    unsigned                         done:1;
+    unsigned                         error:1;
+
+    size_t                           len;
+    u_char                           name[1];
+} ngx_http_file_cache_fill_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,7 +70,9 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         hot:1;
+    unsigned                         waiting:1;
+                                     /* 8 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -59,6 +80,7 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_fill_t      *fill;
 } ngx_http_file_cache_node_t;
 
 
@@ -105,9 +127,17 @@ struct ngx_http_cache_s {
     ngx_msec_t                       wait_time;
 
     ngx_event_t                      wait_event;
+    ngx_queue_t                      wait_queue;
+
+    ngx_http_file_cache_fill_t      *fill;
+    off_t                            sent;
+    ngx_chain_t                     *free;
+    ngx_chain_t                     *busy;
 
     unsigned                         lock:1;
     unsigned                         waiting:1;
+    unsigned                         lock_stream:1;
+    unsigned                         stream:1;
 
     unsigned                         updated:1;
     unsigned                         updating:1;
@@ -120,6 +150,7 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+    unsigned                         memory:1;
 };
 
 
@@ -146,14 +177,37 @@ typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_queue_t                      queue;
-    ngx_atomic_t                     cold;
-    ngx_atomic_t                     loading;
+    ngx_queue_t                      hot;
     off_t                            size;
+    off_t                            hit_bytes;
+    off_t                            miss_bytes;
     ngx_uint_t                       count;
+    ngx_uint_t                       hot_count;
+    ngx_shmtx_t                     *mutex;
+    ngx_shmtx_sh_t                   lock;
+    ngx_shmtx_t                      shmtx;
+} ngx_http_file_cache_shard_t;
+
+
+typedef struct {
+    ngx_atomic_t                     cold;
+    ngx_atomic_t                     loading;
     ngx_uint_t                       watermark;
+    ngx_atomic_t                     hits;
+    ngx_atomic_t                     misses;
+    ngx_uint_t                       eviction;
+    ngx_uint_t                       shards;
+    ngx_http_file_cache_shard_t      shard[1];
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+} ngx_http_file_cache_memory_sh_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
@@ -177,8 +231,24 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       manager_sleep;
     ngx_msec_t                       manager_threshold;
 
+    time_t                           snapshot;
+    time_t                           snapshot_next;
+    time_t                           snapshot_time;
+    u_char                          *snapshot_dirs;
+    ngx_str_t                        snapshot_name;
+    ngx_str_t                        snapshot_temp;
+
     ngx_shm_zone_t                  *shm_zone;
 
+    ngx_uint_t                       shards;
+    ngx_uint_t                       eviction;
+
+    ngx_http_file_cache_memory_sh_t *memory_sh;
+    ngx_slab_pool_t                 *memory_shpool;
+    ngx_shm_zone_t                  *memory_zone;
+    size_t                           memory_object_size;
+    ngx_uint_t                       memory_min_uses;
+
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
 };
@@ -189,11 +259,15 @@ ngx_int_t ngx_http_file_cache_create(ngx_http_request_t *r);
 void ngx_http_file_cache_create_key(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
+ngx_int_t ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_event_pipe_t *p);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
+void ngx_http_file_cache_bytes(ngx_http_file_cache_t *cache, off_t *hit,
+    off_t *miss);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
+void ngx_http_file_cache_init_process(ngx_cycle_t *cycle);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
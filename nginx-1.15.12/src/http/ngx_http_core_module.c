@@ -72,7 +72,8 @@ static char *ngx_http_core_internal(ngx_conf_t *cf, ngx_command_t *cmd,
 static char *ngx_http_core_resolver(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 #if (NGX_HTTP_GZIP)
-static ngx_int_t ngx_http_gzip_accept_encoding(ngx_str_t *ae);
+static ngx_int_t ngx_http_gzip_accept_encoding(ngx_str_t *ae,
+    ngx_str_t *encoding);
 static ngx_uint_t ngx_http_gzip_quantity(u_char *p, u_char *last);
 static char *ngx_http_gzip_disable(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -670,7 +671,7 @@ static ngx_command_t  ngx_http_core_commands[] = {
       NULL },
 
     { ngx_string("open_file_cache"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
       ngx_http_core_open_file_cache,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_core_loc_conf_t, open_file_cache),
@@ -1934,6 +1935,29 @@ ngx_http_auth_basic_user(ngx_http_request_t *r)
 
 ngx_int_t
 ngx_http_gzip_ok(ngx_http_request_t *r)
+{
+    static ngx_str_t  gzip = ngx_string("gzip");
+
+    r->gzip_tested = 1;
+
+    if (ngx_http_gzip_encoding_ok(r, &gzip) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    r->gzip_ok = 1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * tests if the response may be compressed with the encoding,
+ * the gzip_http_version, gzip_proxied, and gzip_disable
+ * directives apply to all encodings
+ */
+
+ngx_int_t
+ngx_http_gzip_encoding_ok(ngx_http_request_t *r, ngx_str_t *encoding)
 {
     time_t                     date, expires;
     ngx_uint_t                 p;
@@ -1941,8 +1965,6 @@ ngx_http_gzip_ok(ngx_http_request_t *r)
     ngx_table_elt_t           *e, *d, *ae;
     ngx_http_core_loc_conf_t  *clcf;
 
-    r->gzip_tested = 1;
-
     if (r != r->main) {
         return NGX_DECLINED;
     }
@@ -1952,7 +1974,7 @@ ngx_http_gzip_ok(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
-    if (ae->value.len < sizeof("gzip") - 1) {
+    if (ae->value.len < encoding->len) {
         return NGX_DECLINED;
     }
 
@@ -1965,8 +1987,10 @@ ngx_http_gzip_ok(ngx_http_request_t *r)
      *   Opera:   "gzip, deflate"
      */
 
-    if (ngx_memcmp(ae->value.data, "gzip,", 5) != 0
-        && ngx_http_gzip_accept_encoding(&ae->value) != NGX_OK)
+    if ((ae->value.len == encoding->len
+         || ngx_memcmp(ae->value.data, encoding->data, encoding->len) != 0
+         || ae->value.data[encoding->len] != ',')
+        && ngx_http_gzip_accept_encoding(&ae->value, encoding) != NGX_OK)
     {
         return NGX_DECLINED;
     }
@@ -2087,8 +2111,6 @@ ok:
 
 #endif
 
-    r->gzip_ok = 1;
-
     return NGX_OK;
 }
 
@@ -2098,10 +2120,12 @@ ok:
  *     "gzip; q=0.001" ... "gzip; q=1.000"
  * gzip is disabled for the following quantities:
  *     "gzip; q=0" ... "gzip; q=0.000", and for any invalid cases
+ *
+ * the same applies to other encodings
  */
 
 static ngx_int_t
-ngx_http_gzip_accept_encoding(ngx_str_t *ae)
+ngx_http_gzip_accept_encoding(ngx_str_t *ae, ngx_str_t *encoding)
 {
     u_char  *p, *start, *last;
 
@@ -2109,7 +2133,7 @@ ngx_http_gzip_accept_encoding(ngx_str_t *ae)
     last = start + ae->len;
 
     for ( ;; ) {
-        p = ngx_strcasestrn(start, "gzip", 4 - 1);
+        p = ngx_strcasestrn(start, (char *) encoding->data, encoding->len - 1);
         if (p == NULL) {
             return NGX_DECLINED;
         }
@@ -2118,10 +2142,10 @@ ngx_http_gzip_accept_encoding(ngx_str_t *ae)
             break;
         }
 
-        start = p + 4;
+        start = p + encoding->len;
     }
 
-    p += 4;
+    p += encoding->len;
 
     while (p < last) {
         switch (*p++) {
@@ -3965,6 +3989,32 @@ ngx_http_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 #endif
         }
 
+        if (ngx_strncmp(value[n].data, "reuseport=", 10) == 0) {
+#if (NGX_HAVE_REUSEPORT_CBPF)
+            if (ngx_strcmp(&value[n].data[10], "cpu") == 0) {
+                lsopt.reuseport_steer = NGX_REUSEPORT_STEER_CPU;
+
+            } else if (ngx_strcmp(&value[n].data[10], "queue") == 0) {
+                lsopt.reuseport_steer = NGX_REUSEPORT_STEER_QUEUE;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid reuseport \"%V\"", &value[n]);
+                return NGX_CONF_ERROR;
+            }
+
+            lsopt.reuseport = 1;
+            lsopt.set = 1;
+            lsopt.bind = 1;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "reuseport steering is not supported "
+                               "on this platform");
+            return NGX_CONF_ERROR;
+#endif
+            continue;
+        }
+
         if (ngx_strcmp(value[n].data, "reuseport") == 0) {
 #if (NGX_HAVE_REUSEPORT)
             lsopt.reuseport = 1;
@@ -4708,8 +4758,10 @@ ngx_http_core_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_core_loc_conf_t *clcf = conf;
 
+    u_char      *p;
     time_t       inactive;
-    ngx_str_t   *value, s;
+    ssize_t      size;
+    ngx_str_t   *value, s, name;
     ngx_int_t    max;
     ngx_uint_t   i;
 
@@ -4722,6 +4774,9 @@ ngx_http_core_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max = 0;
     inactive = 60;
 
+    ngx_str_null(&name);
+    size = 0;
+
     for (i = 1; i < cf->args->nelts; i++) {
 
         if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
@@ -4747,6 +4802,37 @@ ngx_http_core_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                name.len = value[i].len - 5;
+                continue;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                goto failed;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "off") == 0) {
 
             clcf->open_file_cache = NULL;
@@ -4773,11 +4859,22 @@ ngx_http_core_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     clcf->open_file_cache = ngx_open_file_cache_init(cf->pool, max, inactive);
-    if (clcf->open_file_cache) {
+    if (clcf->open_file_cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
         return NGX_CONF_OK;
     }
 
-    return NGX_CONF_ERROR;
+    if (ngx_open_file_cache_add_zone(cf, clcf->open_file_cache, &name, size,
+                                     &ngx_http_core_module)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
 }
 
 
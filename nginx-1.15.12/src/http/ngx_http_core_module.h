@@ -80,6 +80,7 @@ typedef struct {
 #endif
     unsigned                   deferred_accept:1;
     unsigned                   reuseport:1;
+    unsigned                   reuseport_steer:2;
     unsigned                   so_keepalive:2;
     unsigned                   proxy_protocol:1;
 
@@ -494,6 +495,8 @@ u_char *ngx_http_map_uri_to_path(ngx_http_request_t *r, ngx_str_t *name,
 ngx_int_t ngx_http_auth_basic_user(ngx_http_request_t *r);
 #if (NGX_HTTP_GZIP)
 ngx_int_t ngx_http_gzip_ok(ngx_http_request_t *r);
+ngx_int_t ngx_http_gzip_encoding_ok(ngx_http_request_t *r,
+    ngx_str_t *encoding);
 #endif
 
 
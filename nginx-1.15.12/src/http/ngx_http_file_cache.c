@@ -11,11 +11,97 @@
 #include <ngx_md5.h>
 
 
+#define NGX_HTTP_FILE_CACHE_MAX_SHARDS        64
+#define NGX_HTTP_FILE_CACHE_MAX_USES          1023
+#define NGX_HTTP_FILE_CACHE_GDSF_SAMPLES      8
+
+
+/*
+ * The keys zone snapshot is a header followed by the nodes in the key order,
+ * it is written by the cache manager and used by the cache loader to avoid
+ * reading the directories which were not changed since the snapshot.
+ * The snapshot is kept in a subdirectory, so replacing it does not change
+ * the modification time of the cache directory itself.
+ */
+
+#define NGX_HTTP_FILE_CACHE_SNAPSHOT_VERSION  1
+#define NGX_HTTP_FILE_CACHE_SNAPSHOT_BATCH    1024
+
+
+typedef struct {
+    u_char                           magic[8];
+    ngx_uint_t                       version;
+    size_t                           node_size;
+    size_t                           bsize;
+    size_t                           level[NGX_MAX_PATH_LEVEL];
+    time_t                           time;
+    ngx_uint_t                       count;
+} ngx_http_file_cache_snapshot_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    off_t                            fs_size;
+    size_t                           body_start;
+} ngx_http_file_cache_snapshot_node_t;
+
+
+/*
+ * The memory zone keeps complete copies of small frequently used cache
+ * files, as they are stored on disk, so hits are served without file
+ * operations.  An object is admitted after it was requested the given
+ * number of times, and replaces the least recently used objects only if
+ * it is used more often than they are.
+ */
+
+#define NGX_HTTP_FILE_CACHE_MEMORY_TRIES      8
+
+
+/*
+ * With *_cache_lock_stream, requests which would wait for the cache lock
+ * read the temp file of the response being cached instead, following its
+ * length as published by the event pipe of the writer.  The wait timer
+ * only guards against lost wakeups.
+ */
+
+#define NGX_HTTP_FILE_CACHE_STREAM_WAIT       1000
+
+
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_queue_t                      queue;
+
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN
+                                         - sizeof(ngx_rbtree_key_t)];
+
+    ngx_uint_t                       uses;
+    ngx_file_uniq_t                  uniq;
+    size_t                           len;
+    u_char                           data[1];
+} ngx_http_file_cache_memory_node_t;
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_wakeup_handler(ngx_event_t *ev);
 static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_uint_t ngx_http_file_cache_fill_ready(ngx_http_cache_t *c);
+static void ngx_http_file_cache_fill_end(ngx_http_cache_t *c,
+    ngx_uint_t error);
+static void ngx_http_file_cache_fill_cleanup(void *data);
+static ngx_int_t ngx_http_file_cache_stream_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_stream_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_stream_start(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_stream_send(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_stream_writer(ngx_http_request_t *r);
+static void ngx_http_file_cache_stream_wait_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
@@ -32,8 +118,25 @@ static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
+static ngx_http_file_cache_shard_t *ngx_http_file_cache_shard(
+    ngx_http_file_cache_t *cache, u_char *key);
+static ngx_http_file_cache_shard_t *ngx_http_file_cache_node_shard(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_node_t *fcn);
+static ngx_http_file_cache_node_t *ngx_http_file_cache_alloc_node(
+    ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_free_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_total(ngx_http_file_cache_t *cache,
+    off_t *size, ngx_uint_t *count);
+static void ngx_http_file_cache_link(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_unlink(ngx_http_file_cache_shard_t *shard,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_queue_t *ngx_http_file_cache_lru(ngx_http_file_cache_shard_t *shard);
+static ngx_queue_t *ngx_http_file_cache_victim(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard);
 static ngx_http_file_cache_node_t *
-    ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
+    ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard, u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
@@ -46,9 +149,14 @@ static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_forced_expire_shard(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_shard_t *shard,
+    u_char *name);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -63,6 +171,35 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_memory_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_file_cache_memory_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_memory_add(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_memory_delete(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_http_file_cache_memory_node_t *ngx_http_file_cache_memory_lookup(
+    ngx_http_file_cache_t *cache, u_char *key);
+static void ngx_http_file_cache_memory_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_memory_node_t *mn);
+static void ngx_http_file_cache_memory_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_file_cache_snapshot(ngx_http_file_cache_t *cache);
+static ngx_rbtree_node_t *ngx_http_file_cache_snapshot_next(
+    ngx_http_file_cache_shard_t *shard, u_char *key);
+static ngx_int_t ngx_http_file_cache_load_snapshot(
+    ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_add_snapshot(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_snapshot_node_t *sn, ngx_uint_t n, ngx_uint_t *loaded);
+static ngx_int_t ngx_http_file_cache_snapshot_directory(ngx_tree_ctx_t *ctx,
+    ngx_str_t *path);
+static ngx_int_t ngx_http_file_cache_changed_directory(ngx_tree_ctx_t *ctx,
+    ngx_str_t *path);
+static ngx_uint_t ngx_http_file_cache_key_dir(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_int_t ngx_http_file_cache_path_dir(ngx_http_file_cache_t *cache,
+    ngx_str_t *path);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -78,15 +215,24 @@ ngx_str_t  ngx_http_cache_status[] = {
 
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
+static u_char  ngx_http_file_cache_snapshot_magic[] = "NGXSNAP";
+
+
+/* requests of this process waiting for a cache lock to be released */
+
+static ngx_queue_t  ngx_http_file_cache_waiting;
+static ngx_event_t  ngx_http_file_cache_wakeup;
+
 
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    size_t                        len;
+    ngx_uint_t                    n;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     cache = shm_zone->data;
 
@@ -110,6 +256,20 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if (cache->shards != ocache->shards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different shards",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        if (cache->eviction != ocache->eviction) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different eviction",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
@@ -134,23 +294,55 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_file_cache_sh_t));
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_file_cache_sh_t)
+                               + (cache->shards - 1)
+                                 * sizeof(ngx_http_file_cache_shard_t));
     if (cache->sh == NULL) {
         return NGX_ERROR;
     }
 
     cache->shpool->data = cache->sh;
 
-    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
-                    ngx_http_file_cache_rbtree_insert_value);
-
-    ngx_queue_init(&cache->sh->queue);
-
     cache->sh->cold = 1;
     cache->sh->loading = 0;
-    cache->sh->size = 0;
-    cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
+    cache->sh->hits = 0;
+    cache->sh->misses = 0;
+    cache->sh->eviction = cache->eviction;
+    cache->sh->shards = cache->shards;
+
+    /*
+     * a single shard is protected by the zone mutex and allocates nodes
+     * with it locked, several shards have their own mutexes
+     */
+
+    for (n = 0; n < cache->shards; n++) {
+        shard = &cache->sh->shard[n];
+
+        ngx_rbtree_init(&shard->rbtree, &shard->sentinel,
+                        ngx_http_file_cache_rbtree_insert_value);
+
+        ngx_queue_init(&shard->queue);
+        ngx_queue_init(&shard->hot);
+
+        shard->size = 0;
+        shard->hit_bytes = 0;
+        shard->miss_bytes = 0;
+        shard->count = 0;
+        shard->hot_count = 0;
+
+        if (cache->shards == 1) {
+            shard->mutex = &cache->shpool->mutex;
+            continue;
+        }
+
+        if (ngx_shmtx_create(&shard->shmtx, &shard->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        shard->mutex = &shard->shmtx;
+    }
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
@@ -172,6 +364,60 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_memory_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_file_cache_t  *ocache = data;
+
+    size_t                  len;
+    ngx_http_file_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->memory_sh = ocache->memory_sh;
+        cache->memory_shpool = ocache->memory_shpool;
+
+        return NGX_OK;
+    }
+
+    cache->memory_shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->memory_sh = cache->memory_shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->memory_sh = ngx_slab_alloc(cache->memory_shpool,
+                                      sizeof(ngx_http_file_cache_memory_sh_t));
+    if (cache->memory_sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->memory_shpool->data = cache->memory_sh;
+
+    ngx_rbtree_init(&cache->memory_sh->rbtree, &cache->memory_sh->sentinel,
+                    ngx_http_file_cache_memory_insert_value);
+
+    ngx_queue_init(&cache->memory_sh->queue);
+
+    len = sizeof(" in cache memory zone \"\"") + shm_zone->shm.name.len;
+
+    cache->memory_shpool->log_ctx = ngx_slab_alloc(cache->memory_shpool, len);
+    if (cache->memory_shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->memory_shpool->log_ctx, " in cache memory zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->memory_shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_http_file_cache_new(ngx_http_request_t *r)
 {
@@ -279,6 +525,11 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     }
 
     if (c->reading) {
+
+        if (c->stream) {
+            return ngx_http_file_cache_stream_read(r, c);
+        }
+
         return ngx_http_file_cache_read(r, c);
     }
 
@@ -343,6 +594,18 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->exists && cache->memory_zone) {
+        rc = ngx_http_file_cache_memory_open(r, c);
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        if (rc == NGX_ERROR) {
+            return rc;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -402,8 +665,10 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msec_t                 now, timer;
-    ngx_http_file_cache_t     *cache;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->lock) {
         return NGX_DECLINED;
@@ -413,7 +678,9 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_node_shard(cache, c->node);
+
+    ngx_shmtx_lock(shard->mutex);
 
     timer = c->node->lock_time - now;
 
@@ -422,18 +689,30 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->node->lock_time = now + c->lock_age;
         c->updating = 1;
         c->lock_time = c->node->lock_time;
+
+    } else if (ngx_http_file_cache_fill_ready(c)) {
+        fill = c->node->fill;
+        (void) ngx_atomic_fetch_add(&fill->count, 1);
+        c->fill = fill;
+
+    } else if (c->lock_timeout) {
+        c->node->waiting = 1;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(shard->mutex);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache lock u:%d wt:%M",
-                   c->updating, c->wait_time);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache lock u:%d wt:%M s:%d",
+                   c->updating, c->wait_time, c->fill ? 1 : 0);
 
     if (c->updating) {
         return NGX_DECLINED;
     }
 
+    if (c->fill) {
+        return ngx_http_file_cache_stream_open(r, c);
+    }
+
     if (c->lock_timeout == 0) {
         return NGX_HTTP_CACHE_SCARCE;
     }
@@ -448,7 +727,14 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->wait_event.log = r->connection->log;
     }
 
-    timer = c->wait_time - now;
+    /*
+     * the lock holder wakes us up as soon as it releases the lock,
+     * the timer still polls the lock as before in case a wakeup is lost
+     */
+
+    ngx_queue_insert_tail(&ngx_http_file_cache_waiting, &c->wait_queue);
+
+    timer = ngx_min(timer, c->wait_time - now);
 
     ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
 
@@ -467,6 +753,10 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
     r = ev->data;
     c = r->connection;
 
+    if (!r->cache->waiting) {
+        return;
+    }
+
     ngx_http_set_log_request(c->log, r);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -481,9 +771,10 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
 static void
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                    wait;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     now = ngx_current_msec;
 
@@ -497,31 +788,66 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_node_shard(cache, c->node);
+
     wait = 0;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(shard->mutex);
 
     timer = c->node->lock_time - now;
 
-    if (c->node->updating && (ngx_msec_int_t) timer > 0) {
+    if (c->node->updating && (ngx_msec_int_t) timer > 0
+        && !ngx_http_file_cache_fill_ready(c))
+    {
+        c->node->waiting = 1;
         wait = 1;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(shard->mutex);
 
     if (wait) {
+        timer = ngx_min(timer, c->wait_time - now);
         ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
         return;
     }
 
 wakeup:
 
+    ngx_queue_remove(&c->wait_queue);
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    if (c->wait_event.posted) {
+        ngx_delete_posted_event(&c->wait_event);
+    }
+
     c->waiting = 0;
     r->main->blocked--;
     r->write_event_handler(r);
 }
 
 
+static void
+ngx_http_file_cache_wakeup_handler(ngx_event_t *ev)
+{
+    ngx_queue_t       *q;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "http file cache wakeup");
+
+    for (q = ngx_queue_head(&ngx_http_file_cache_waiting);
+         q != ngx_queue_sentinel(&ngx_http_file_cache_waiting);
+         q = ngx_queue_next(q))
+    {
+        c = ngx_queue_data(q, ngx_http_cache_t, wait_queue);
+
+        ngx_post_event(&c->wait_event, &ngx_posted_events);
+    }
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
@@ -532,12 +858,18 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_int_t                      rc;
     ngx_uint_t                     i;
     ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_shard_t   *shard;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->memory) {
+        n = c->length;
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -595,6 +927,11 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "http file cache vary mismatch");
+
+            if (c->stream) {
+                return NGX_DECLINED;
+            }
+
             return ngx_http_file_cache_reopen(r, c);
         }
     }
@@ -613,11 +950,22 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     r->cached = 1;
 
+    if (c->stream) {
+        return NGX_OK;
+    }
+
     cache = c->file_cache;
 
-    if (cache->sh->cold) {
+    shard = ngx_http_file_cache_node_shard(cache, c->node);
+
+    /*
+     * the nodes added by the cache loader have no file uniq,
+     * it is set on the first read to make the memory tier usable
+     */
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    if (cache->sh->cold || c->node->uniq == 0) {
+
+        ngx_shmtx_lock(shard->mutex);
 
         if (!c->node->exists) {
             c->node->uses = 1;
@@ -626,10 +974,13 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->uniq = c->uniq;
             c->node->fs_size = c->fs_size;
 
-            cache->sh->size += c->fs_size;
+            shard->size += c->fs_size;
+
+        } else if (c->node->uniq == 0) {
+            c->node->uniq = c->uniq;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(shard->mutex);
     }
 
     now = ngx_time();
@@ -638,7 +989,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->stale_updating = c->valid_sec + c->updating_sec >= now;
         c->stale_error = c->valid_sec + c->error_sec >= now;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(shard->mutex);
 
         if (c->node->updating) {
             rc = NGX_HTTP_CACHE_UPDATING;
@@ -650,7 +1001,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             rc = NGX_HTTP_CACHE_STALE;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(shard->mutex);
 
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http file cache expired: %i %T %T",
@@ -659,6 +1010,10 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return rc;
     }
 
+    if (cache->memory_zone && !c->memory) {
+        ngx_http_file_cache_memory_add(r, c);
+    }
+
     return NGX_OK;
 }
 
@@ -819,22 +1174,28 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                     rc;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(shard->mutex);
 
     fcn = c->node;
 
     if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+        fcn = ngx_http_file_cache_lookup(shard, c->key);
     }
 
     if (fcn) {
-        ngx_queue_remove(&fcn->queue);
+        ngx_http_file_cache_unlink(shard, fcn);
 
         if (c->node == NULL) {
-            fcn->uses++;
+            if (fcn->uses < NGX_HTTP_FILE_CACHE_MAX_USES) {
+                fcn->uses++;
+            }
+
             fcn->count++;
         }
 
@@ -866,19 +1227,17 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         goto done;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
+    fcn = ngx_http_file_cache_alloc_node(cache);
     if (fcn == NULL) {
         ngx_http_file_cache_set_watermark(cache);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(shard->mutex);
 
         (void) ngx_http_file_cache_forced_expire(cache);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(shard->mutex);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
+        fcn = ngx_http_file_cache_alloc_node(cache);
         if (fcn == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", cache->shpool->log_ctx);
@@ -887,14 +1246,14 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         }
     }
 
-    cache->sh->count++;
+    shard->count++;
 
     ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
     ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
                NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_rbtree_insert(&shard->rbtree, &fcn->node);
 
     fcn->uses = 1;
     fcn->count = 1;
@@ -915,7 +1274,7 @@ done:
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_http_file_cache_link(cache, shard, fcn);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -923,7 +1282,7 @@ done:
 
 failed:
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(shard->mutex);
 
     return rc;
 }
@@ -964,105 +1323,358 @@ ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 }
 
 
-static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+static ngx_http_file_cache_shard_t *
+ngx_http_file_cache_shard(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_rbtree_key_t  node_key;
+
+    if (cache->sh->shards == 1) {
+        return &cache->sh->shard[0];
+    }
 
     ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    return &cache->sh->shard[node_key % cache->sh->shards];
+}
 
-    while (node != sentinel) {
 
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
-        }
+static ngx_http_file_cache_shard_t *
+ngx_http_file_cache_node_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    return &cache->sh->shard[fcn->node.key % cache->sh->shards];
+}
 
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
-        }
 
-        /* node_key == node->key */
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_alloc_node(ngx_http_file_cache_t *cache)
+{
+    /* a single shard is protected by the zone mutex itself */
 
-        fcn = (ngx_http_file_cache_node_t *) node;
+    if (cache->sh->shards == 1) {
+        return ngx_slab_calloc_locked(cache->shpool,
+                                      sizeof(ngx_http_file_cache_node_t));
+    }
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    return ngx_slab_calloc(cache->shpool, sizeof(ngx_http_file_cache_node_t));
+}
 
-        if (rc == 0) {
-            return fcn;
-        }
 
-        node = (rc < 0) ? node->left : node->right;
+static void
+ngx_http_file_cache_free_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    if (cache->sh->shards == 1) {
+        ngx_slab_free_locked(cache->shpool, fcn);
+        return;
     }
 
-    /* not found */
-
-    return NULL;
+    ngx_slab_free(cache->shpool, fcn);
 }
 
 
 static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+ngx_http_file_cache_total(ngx_http_file_cache_t *cache, off_t *size,
+    ngx_uint_t *count)
 {
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
+    ngx_uint_t                    i;
+    ngx_http_file_cache_shard_t  *shard;
 
-    for ( ;; ) {
+    *size = 0;
+    *count = 0;
 
-        if (node->key < temp->key) {
+    for (i = 0; i < cache->sh->shards; i++) {
+        shard = &cache->sh->shard[i];
 
-            p = &temp->left;
+        ngx_shmtx_lock(shard->mutex);
 
-        } else if (node->key > temp->key) {
+        *size += shard->size;
+        *count += shard->count;
 
-            p = &temp->right;
+        ngx_shmtx_unlock(shard->mutex);
+    }
+}
 
-        } else { /* node->key == temp->key */
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+void
+ngx_http_file_cache_bytes(ngx_http_file_cache_t *cache, off_t *hit,
+    off_t *miss)
+{
+    ngx_uint_t                    i;
+    ngx_http_file_cache_shard_t  *shard;
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
-        }
+    /* the byte counters are kept in shards as they may not fit atomics */
 
-        if (*p == sentinel) {
-            break;
-        }
+    *hit = 0;
+    *miss = 0;
 
-        temp = *p;
-    }
+    for (i = 0; i < cache->sh->shards; i++) {
+        shard = &cache->sh->shard[i];
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+        ngx_shmtx_lock(shard->mutex);
+
+        *hit += shard->hit_bytes;
+        *miss += shard->miss_bytes;
+
+        ngx_shmtx_unlock(shard->mutex);
+    }
 }
 
 
+/*
+ * With the "slru" eviction, an entry used for the second time moves from
+ * the probationary queue to the protected "hot" queue, which is limited
+ * to three quarters of the entries; entries pushed out of it go back to
+ * the probationary queue.  A single pass over the cache thus does not
+ * evict entries which were used repeatedly.
+ */
+
 static void
-ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
-    u_char *hash)
+ngx_http_file_cache_link(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_http_file_cache_node_t *fcn)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *lru;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache vary: \"%*s\"", len, vary);
+    if (cache->eviction != NGX_HTTP_CACHE_SLRU
+        || !fcn->exists
+        || fcn->uses < 2)
+    {
+        ngx_queue_insert_head(&shard->queue, &fcn->queue);
+        return;
+    }
+
+    fcn->hot = 1;
+    shard->hot_count++;
+
+    ngx_queue_insert_head(&shard->hot, &fcn->queue);
+
+    if (shard->hot_count <= shard->count - shard->count / 4) {
+        return;
+    }
+
+    q = ngx_queue_last(&shard->hot);
+    lru = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    ngx_queue_remove(q);
+    lru->hot = 0;
+    shard->hot_count--;
+
+    ngx_queue_insert_head(&shard->queue, q);
+}
+
+
+static void
+ngx_http_file_cache_unlink(ngx_http_file_cache_shard_t *shard,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_queue_remove(&fcn->queue);
+
+    if (fcn->hot) {
+        fcn->hot = 0;
+        shard->hot_count--;
+    }
+}
+
+
+static ngx_queue_t *
+ngx_http_file_cache_lru(ngx_http_file_cache_shard_t *shard)
+{
+    ngx_queue_t                 *q, *h;
+    ngx_http_file_cache_node_t  *fcn, *hot;
+
+    /* the least recently used entry of both queues */
+
+    q = ngx_queue_empty(&shard->queue) ? NULL : ngx_queue_last(&shard->queue);
+    h = ngx_queue_empty(&shard->hot) ? NULL : ngx_queue_last(&shard->hot);
+
+    if (q == NULL || h == NULL) {
+        return q ? q : h;
+    }
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    hot = ngx_queue_data(h, ngx_http_file_cache_node_t, queue);
+
+    return (fcn->expire <= hot->expire) ? q : h;
+}
+
+
+static ngx_queue_t *
+ngx_http_file_cache_victim(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard)
+{
+    off_t                        size, best_size;
+    ngx_uint_t                   n, best_uses;
+    ngx_queue_t                 *q, *best;
+    ngx_http_file_cache_node_t  *fcn;
+
+    switch (cache->eviction) {
+
+    case NGX_HTTP_CACHE_SLRU:
+
+        /* the probationary queue is evicted first */
+
+        if (!ngx_queue_empty(&shard->queue)) {
+            return ngx_queue_last(&shard->queue);
+        }
+
+        if (!ngx_queue_empty(&shard->hot)) {
+            return ngx_queue_last(&shard->hot);
+        }
+
+        return NULL;
+
+    case NGX_HTTP_CACHE_GDSF:
+
+        /*
+         * among several least recently used entries not in use, the one
+         * with the lowest uses to size ratio is evicted; this approximates
+         * the greedy dual size frequency policy, with the queue order
+         * standing for its aging
+         */
+
+        best = NULL;
+        best_uses = 0;
+        best_size = 1;
+
+        for (q = ngx_queue_last(&shard->queue), n = 0;
+             q != ngx_queue_sentinel(&shard->queue)
+             && n < NGX_HTTP_FILE_CACHE_GDSF_SAMPLES;
+             q = ngx_queue_prev(q), n++)
+        {
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            if (fcn->count) {
+                continue;
+            }
+
+            size = fcn->fs_size ? fcn->fs_size : 1;
+
+            if (best == NULL
+                || (off_t) fcn->uses * best_size < (off_t) best_uses * size)
+            {
+                best = q;
+                best_uses = fcn->uses;
+                best_size = size;
+            }
+        }
+
+        if (best) {
+            return best;
+        }
+
+        /* fall through */
+
+    default: /* NGX_HTTP_CACHE_LRU */
+
+        if (ngx_queue_empty(&shard->queue)) {
+            return NULL;
+        }
+
+        return ngx_queue_last(&shard->queue);
+    }
+}
+
+
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
 
     ngx_md5_init(&md5);
     ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
@@ -1207,7 +1819,8 @@ ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
 static ngx_int_t
 ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                    "http file cache reopen");
@@ -1220,15 +1833,17 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_node_shard(cache, c->node);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(shard->mutex);
 
     c->node->count--;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(shard->mutex);
 
     c->secondary = 1;
+    c->memory = 0;
     c->file.name.len = 0;
     c->body_start = c->buf->end - c->buf->start;
 
@@ -1306,7 +1921,9 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 static ngx_int_t
 ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                    wakeup;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->secondary) {
         return NGX_OK;
@@ -1324,17 +1941,26 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
      */
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_node_shard(cache, c->node);
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache main key");
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(shard->mutex);
 
     c->node->count--;
     c->node->updating = 0;
+
+    wakeup = c->node->waiting;
+    c->node->waiting = 0;
+
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(shard->mutex);
+
+    if (wakeup) {
+        ngx_wakeup_processes((ngx_cycle_t *) ngx_cycle);
+    }
 
     c->file.name.len = 0;
 
@@ -1352,109 +1978,305 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 }
 
 
-void
-ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+ngx_int_t
+ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_event_pipe_t *p)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    size_t                        len;
+    ngx_uint_t                    wakeup;
+    ngx_temp_file_t              *tf;
+    ngx_http_cache_t             *c;
+    ngx_pool_cleanup_t           *cln;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
+    ngx_http_file_cache_shard_t  *shard;
 
     c = r->cache;
 
-    if (c->updated) {
-        return;
+    if (!c->updating) {
+        return NGX_OK;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update");
-
-    cache = c->file_cache;
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
 
-    c->updated = 1;
-    c->updating = 0;
+    /* the temp file name has to be known before the first write */
 
-    uniq = 0;
-    fs_size = 0;
+    tf = p->temp_file;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
+    if (ngx_create_temp_file(&tf->file, tf->path, tf->pool, tf->persistent,
+                             tf->clean, tf->access)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-    ext.access = NGX_FILE_OWNER_ACCESS;
-    ext.path_access = NGX_FILE_OWNER_ACCESS;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
+    cache = c->file_cache;
+    len = tf->file.name.len;
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    fill = ngx_slab_alloc(cache->shpool,
+                          sizeof(ngx_http_file_cache_fill_t) + len);
+    if (fill == NULL) {
+        return NGX_OK;
+    }
 
-    if (rc == NGX_OK) {
+    fill->progress.offset = 0;
+    fill->progress.waiting = 0;
+    fill->body_start = c->body_start;
+    fill->count = 1;
+    fill->done = 0;
+    fill->error = 0;
+    fill->len = len;
+    ngx_memcpy(fill->name, tf->file.name.data, len + 1);
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+    shard = ngx_http_file_cache_node_shard(cache, c->node);
 
-            rc = NGX_ERROR;
+    ngx_shmtx_lock(shard->mutex);
 
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
-        }
+    if (c->node->fill || c->node->lock_time != c->lock_time) {
+        ngx_shmtx_unlock(shard->mutex);
+        ngx_slab_free(cache->shpool, fill);
+        return NGX_OK;
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    c->node->fill = fill;
 
-    c->node->count--;
-    c->node->error = 0;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
+    wakeup = c->node->waiting;
+    c->node->waiting = 0;
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+    ngx_shmtx_unlock(shard->mutex);
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
-    }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill: \"%V\"", &tf->file.name);
 
-    c->node->updating = 0;
+    c->fill = fill;
+    p->progress = &fill->progress;
+
+    cln->handler = ngx_http_file_cache_fill_cleanup;
+    cln->data = c;
+
+    if (wakeup) {
+        ngx_wakeup_processes((ngx_cycle_t *) ngx_cycle);
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_OK;
 }
 
 
-void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
+/* called with the shard mutex locked */
+
+static ngx_uint_t
+ngx_http_file_cache_fill_ready(ngx_http_cache_t *c)
 {
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
+    ngx_http_file_cache_fill_t  *fill;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
+    fill = c->node->fill;
 
-    c = r->cache;
+    if (!c->lock_stream || fill == NULL) {
+        return 0;
+    }
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
+    /*
+     * the flag is set before the offset is tested, while the writer tests
+     * it after the offset is updated, see ngx_event_pipe.c
+     */
 
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+    (void) ngx_atomic_cmp_set(&fill->progress.waiting, 0, 1);
 
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
+    return fill->progress.offset >= fill->body_start;
+}
 
-        /* cache file may have been deleted */
 
-        if (err == NGX_ENOENT) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+static void
+ngx_http_file_cache_fill_end(ngx_http_cache_t *c, ngx_uint_t error)
+{
+    ngx_uint_t                    wakeup;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
+    ngx_http_file_cache_shard_t  *shard;
+
+    fill = c->fill;
+
+    if (fill == NULL || c->stream || fill->done || fill->error) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache fill end: %ui", error);
+
+    cache = c->file_cache;
+    shard = ngx_http_file_cache_node_shard(cache, c->node);
+
+    ngx_shmtx_lock(shard->mutex);
+
+    if (error) {
+        fill->error = 1;
+
+    } else {
+        fill->done = 1;
+    }
+
+    if (c->node->fill == fill) {
+        c->node->fill = NULL;
+    }
+
+    wakeup = ngx_atomic_cmp_set(&fill->progress.waiting, 1, 0);
+
+    ngx_shmtx_unlock(shard->mutex);
+
+    if (wakeup) {
+        ngx_wakeup_processes((ngx_cycle_t *) ngx_cycle);
+    }
+}
+
+
+static void
+ngx_http_file_cache_fill_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    ngx_http_file_cache_fill_t  *fill;
+
+    fill = c->fill;
+
+    if (fill == NULL) {
+        return;
+    }
+
+    ngx_http_file_cache_fill_end(c, 1);
+
+    c->fill = NULL;
+
+    if (ngx_atomic_fetch_add(&fill->count, -1) == 1) {
+        ngx_slab_free(c->file_cache->shpool, fill);
+    }
+}
+
+
+void
+ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                         fs_size, size;
+    ngx_int_t                     rc;
+    ngx_uint_t                    wakeup;
+    ngx_file_uniq_t               uniq;
+    ngx_file_info_t               fi;
+    ngx_http_cache_t             *c;
+    ngx_ext_rename_file_t         ext;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update");
+
+    cache = c->file_cache;
+
+    c->updated = 1;
+    c->updating = 0;
+
+    uniq = 0;
+    fs_size = 0;
+    size = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache rename: \"%s\" to \"%s\"",
+                   tf->file.name.data, c->file.name.data);
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = r->connection->log;
+
+    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+
+    if (rc == NGX_OK) {
+
+        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+
+            rc = NGX_ERROR;
+
+        } else {
+            uniq = ngx_file_uniq(&fi);
+            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+            size = ngx_file_size(&fi) - c->body_start;
+        }
+    }
+
+    ngx_http_file_cache_fill_end(c, 0);
+
+    shard = ngx_http_file_cache_node_shard(cache, c->node);
+
+    if (rc == NGX_OK && cache->memory_zone) {
+        ngx_http_file_cache_memory_delete(cache, c->key);
+    }
+
+    ngx_shmtx_lock(shard->mutex);
+
+    c->node->count--;
+    c->node->error = 0;
+    c->node->uniq = uniq;
+    c->node->body_start = c->body_start;
+
+    shard->size += fs_size - c->node->fs_size;
+    shard->miss_bytes += size;
+    c->node->fs_size = fs_size;
+
+    if (rc == NGX_OK) {
+        c->node->exists = 1;
+    }
+
+    c->node->updating = 0;
+
+    wakeup = c->node->waiting;
+    c->node->waiting = 0;
+
+    ngx_shmtx_unlock(shard->mutex);
+
+    if (wakeup) {
+        ngx_wakeup_processes((ngx_cycle_t *) ngx_cycle);
+    }
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "http file cache \"%s\" not found",
                            file.name.data);
             return;
@@ -1550,6 +2372,10 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     (void) ngx_write_file(&file, (u_char *) &h,
                           sizeof(ngx_http_file_cache_header_t), 0);
 
+    if (c->file_cache->memory_zone) {
+        ngx_http_file_cache_memory_delete(c->file_cache, c->key);
+    }
+
 done:
 
     if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
@@ -1562,16 +2388,31 @@ done:
 ngx_int_t
 ngx_http_cache_send(ngx_http_request_t *r)
 {
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_chain_t                   out;
+    ngx_http_cache_t             *c;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     c = r->cache;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache send: %s", c->file.name.data);
 
+    if (c->stream) {
+        return ngx_http_file_cache_stream_start(r, c);
+    }
+
+    cache = c->file_cache;
+    shard = ngx_http_file_cache_node_shard(cache, c->node);
+
+    (void) ngx_atomic_fetch_add(&cache->sh->hits, 1);
+
+    ngx_shmtx_lock(shard->mutex);
+    shard->hit_bytes += c->length - c->body_start;
+    ngx_shmtx_unlock(shard->mutex);
+
     if (r != r->main && c->length - c->body_start == 0) {
         return ngx_http_send_header(r);
     }
@@ -1583,6 +2424,26 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
+    if (c->memory) {
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+
+        b->pos = c->buf->pos + c->body_start;
+        b->last = c->buf->pos + c->length;
+
+        b->memory = (c->length - c->body_start) ? 1: 0;
+        b->last_buf = (r == r->main) ? 1: 0;
+        b->last_in_chain = 1;
+
+        out.buf = b;
+        out.next = NULL;
+
+        return ngx_http_output_filter(r, &out);
+    }
+
     b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
     if (b->file == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -1612,600 +2473,1942 @@ ngx_http_cache_send(ngx_http_request_t *r)
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static ngx_int_t
+ngx_http_file_cache_stream_open(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_err_t                    err;
+    ngx_pool_cleanup_t          *cln;
+    ngx_pool_cleanup_file_t     *clnf;
+    ngx_http_file_cache_fill_t  *fill;
 
-    if (c->updated || c->node == NULL) {
-        return;
+    fill = c->fill;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        if (ngx_atomic_fetch_add(&fill->count, -1) == 1) {
+            ngx_slab_free(c->file_cache->shpool, fill);
+        }
+
+        c->fill = NULL;
+        return NGX_ERROR;
     }
 
-    cache = c->file_cache;
+    cln->handler = ngx_http_file_cache_fill_cleanup;
+    cln->data = c;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    c->stream = 1;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    c->file.name.len = fill->len;
+    c->file.name.data = ngx_pnalloc(r->pool, fill->len + 1);
+    if (c->file.name.data == NULL) {
+        return NGX_ERROR;
+    }
 
-    fcn = c->node;
-    fcn->count--;
+    ngx_memcpy(c->file.name.data, fill->name, fill->len + 1);
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
     }
 
-    if (c->error) {
-        fcn->error = c->error;
+    c->file.fd = ngx_open_file(c->file.name.data, NGX_FILE_RDONLY,
+                               NGX_FILE_OPEN, 0);
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
+    if (c->file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          ngx_open_file_n " \"%s\" failed",
+                          c->file.name.data);
+            return NGX_ERROR;
         }
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
+        /* the response was completed or aborted meanwhile */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache stream gone: \"%s\"",
+                       c->file.name.data);
+
+        return NGX_HTTP_CACHE_SCARCE;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache stream: \"%s\", fd: %d",
+                   c->file.name.data, c->file.fd);
 
-    c->updated = 1;
-    c->updating = 0;
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
+    clnf->fd = c->file.fd;
+    clnf->name = c->file.name.data;
+    clnf->log = r->pool->log;
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
-            }
-        }
-    }
+    c->file.log = r->connection->log;
+    c->length = fill->progress.offset;
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
     }
+
+    return ngx_http_file_cache_stream_read(r, c);
 }
 
 
-static void
-ngx_http_file_cache_cleanup(void *data)
+static ngx_int_t
+ngx_http_file_cache_stream_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_cache_t  *c = data;
+    ngx_int_t  rc;
 
-    if (c->updated) {
-        return;
-    }
+    rc = ngx_http_file_cache_read(r, c);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+    if (rc == NGX_DECLINED) {
 
-    if (c->updating && !c->background) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
+        /*
+         * the response being cached cannot be used, e.g. it is
+         * another variant, so go to the upstream without caching
+         */
+
+        return NGX_HTTP_CACHE_SCARCE;
     }
 
-    ngx_http_file_cache_free(c, NULL);
+    return rc;
 }
 
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+static ngx_int_t
+ngx_http_file_cache_stream_start(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    ngx_int_t                  rc;
+    ngx_event_t               *wev;
+    ngx_http_file_cache_t     *cache;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    cache = c->file_cache;
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    (void) ngx_atomic_fetch_add(&cache->sh->hits, 1);
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
-
-    ngx_memcpy(name, path->name.data, path->name.len);
-
-    wait = 10;
-    tries = 20;
-    sentinel = NULL;
-
-    ngx_shmtx_lock(&cache->shpool->mutex);
-
-    for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            break;
-        }
+    /* the length of the response is not known yet */
 
-        q = ngx_queue_last(&cache->sh->queue);
+    r->allow_ranges = 0;
 
-        if (q == sentinel) {
-            break;
-        }
+    rc = ngx_http_send_header(r);
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    c->sent = c->body_start;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
-            break;
-        }
+    c->wait_event.handler = ngx_http_file_cache_stream_wait_handler;
+    c->wait_event.data = r;
+    c->wait_event.log = r->connection->log;
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+    r->write_event_handler = ngx_http_file_cache_stream_writer;
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+    rc = ngx_http_file_cache_stream_send(r, c);
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    if (rc != NGX_AGAIN) {
+        return rc;
+    }
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    if (!c->waiting) {
+        wev = r->connection->write;
+        clcf = ngx_http_get_module_loc_conf(r->main, ngx_http_core_module);
 
-        if (sentinel == NULL) {
-            sentinel = q;
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
         }
 
-        if (--tries) {
-            continue;
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            return NGX_ERROR;
         }
-
-        wait = 1;
-        break;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    ngx_free(name);
-
-    return wait;
+    return NGX_DONE;
 }
 
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+static ngx_int_t
+ngx_http_file_cache_stream_send(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
-
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    off_t                         offset;
+    ngx_int_t                     rc;
+    ngx_uint_t                    done, error;
+    ngx_buf_t                    *b;
+    ngx_chain_t                  *cl;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
+    ngx_http_file_cache_shard_t  *shard;
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
+    cache = c->file_cache;
+    fill = c->fill;
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    for ( ;; ) {
 
-    now = ngx_time();
+        offset = fill->progress.offset;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        if (c->sent < offset) {
 
-    for ( ;; ) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache stream send: %O-%O",
+                           c->sent, offset);
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+            cl = ngx_chain_get_free_buf(r->pool, &c->free);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
+            b = cl->buf;
 
-        q = ngx_queue_last(&cache->sh->queue);
+            ngx_memzero(b, sizeof(ngx_buf_t));
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+            b->tag = (ngx_buf_tag_t) &ngx_http_file_cache_stream_send;
+            b->file = &c->file;
+            b->file_pos = c->sent;
+            b->file_last = offset;
+            b->in_file = 1;
+            b->flush = 1;
 
-        wait = fcn->expire - now;
+            c->sent = offset;
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
+            rc = ngx_http_output_filter(r, cl);
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+            ngx_chain_update_chains(r->pool, &c->free, &c->busy, &cl, b->tag);
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
-        }
+            if (rc == NGX_ERROR || rc == NGX_AGAIN) {
+                return rc;
+            }
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
+            continue;
         }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+        shard = ngx_http_file_cache_node_shard(cache, c->node);
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+        ngx_shmtx_lock(shard->mutex);
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        done = fill->done;
+        error = fill->error;
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+        if (!done && !error) {
+            (void) ngx_atomic_cmp_set(&fill->progress.waiting, 0, 1);
+        }
 
-next:
+        ngx_shmtx_unlock(shard->mutex);
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
-            break;
+        if (c->sent < (off_t) fill->progress.offset) {
+            continue;
         }
 
-        ngx_time_update();
-
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        if (error) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "response being cached to \"%s\" was not completed",
+                          c->file.name.data);
+            return NGX_ERROR;
+        }
 
-        if (elapsed >= cache->manager_threshold) {
-            wait = 0;
+        if (done) {
             break;
         }
-    }
-
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    ngx_free(name);
-
-    return wait;
-}
 
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache stream wait: %O", c->sent);
 
-static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
-{
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+        if (!c->waiting) {
+            ngx_queue_insert_tail(&ngx_http_file_cache_waiting,
+                                  &c->wait_queue);
+            c->waiting = 1;
+        }
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        ngx_add_timer(&c->wait_event, NGX_HTTP_FILE_CACHE_STREAM_WAIT);
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+        return NGX_AGAIN;
+    }
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    ngx_shmtx_lock(shard->mutex);
+    shard->hit_bytes += c->sent - c->body_start;
+    ngx_shmtx_unlock(shard->mutex);
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (r != r->main) {
+        return NGX_OK;
+    }
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+    cl = ngx_chain_get_free_buf(r->pool, &c->free);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+    b = cl->buf;
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
-        }
+    ngx_memzero(b, sizeof(ngx_buf_t));
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
-    }
+    b->last_buf = 1;
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-    }
+    return ngx_http_output_filter(r, cl);
 }
 
 
-static ngx_msec_t
-ngx_http_file_cache_manager(void *data)
+static void
+ngx_http_file_cache_stream_writer(ngx_http_request_t *r)
 {
-    ngx_http_file_cache_t  *cache = data;
+    ngx_int_t                  rc;
+    ngx_event_t               *wev;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    off_t       size;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+    c = r->connection;
+    wev = c->write;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "http file cache stream writer: \"%V?%V\"",
+                   &r->uri, &r->args);
 
-    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+    clcf = ngx_http_get_module_loc_conf(r->main, ngx_http_core_module);
 
-    if (next == 0) {
-        next = cache->manager_sleep;
-        goto done;
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
     }
 
-    for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    if (wev->delayed || r->aio) {
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+        return;
+    }
 
-        if (size < cache->max_size && count < watermark) {
-            break;
-        }
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+    rc = ngx_http_file_cache_stream_send(r, r->cache);
 
-        if (wait > 0) {
-            next = (ngx_msec_t) wait * 1000;
-            break;
-        }
+    if (rc == NGX_AGAIN) {
 
-        if (ngx_quit || ngx_terminate) {
-            break;
+        if (r->cache->waiting) {
+            return;
         }
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
-            break;
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
         }
 
-        ngx_time_update();
-
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
-
-        if (elapsed >= cache->manager_threshold) {
-            next = cache->manager_sleep;
-            break;
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
         }
-    }
-
-done:
 
-    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        return;
+    }
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
+    r->write_event_handler = ngx_http_request_empty_handler;
 
-    return next;
+    ngx_http_finalize_request(r, rc);
 }
 
 
 static void
-ngx_http_file_cache_loader(void *data)
+ngx_http_file_cache_stream_wait_handler(ngx_event_t *ev)
 {
-    ngx_http_file_cache_t  *cache = data;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
 
-    ngx_tree_ctx_t  tree;
+    r = ev->data;
+    c = r->connection;
 
-    if (!cache->sh->cold || cache->sh->loading) {
-        return;
+    if (r->cache->waiting) {
+        ngx_queue_remove(&r->cache->wait_queue);
+        r->cache->waiting = 0;
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+    ngx_http_set_log_request(c->log, r);
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache stream wakeup: \"%V?%V\"",
+                   &r->uri, &r->args);
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    r->write_event_handler(r);
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
+    ngx_http_run_posted_requests(c);
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_uint_t                    wakeup;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    if (c->updated || c->node == NULL) {
         return;
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    cache = c->file_cache;
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    ngx_http_file_cache_fill_end(c, 1);
+
+    shard = ngx_http_file_cache_node_shard(cache, c->node);
+
+    ngx_shmtx_lock(shard->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    wakeup = 0;
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+
+        wakeup = fcn->waiting;
+        fcn->waiting = 0;
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_http_file_cache_unlink(shard, fcn);
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_http_file_cache_free_node(cache, fcn);
+        shard->count--;
+        c->node = NULL;
+    }
+
+    ngx_shmtx_unlock(shard->mutex);
+
+    if (wakeup) {
+        ngx_wakeup_processes((ngx_cycle_t *) ngx_cycle);
+    }
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->waiting) {
+        ngx_queue_remove(&c->wait_queue);
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    if (c->wait_event.posted) {
+        ngx_delete_posted_event(&c->wait_event);
+    }
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static void
+ngx_http_file_cache_cleanup(void *data)
 {
-    return NGX_OK;
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 {
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+    u_char                       *name;
+    size_t                        len;
+    time_t                        wait, w, expire;
+    ngx_uint_t                    i, n, oldest;
+    ngx_path_t                   *path;
+    ngx_queue_t                  *q;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
-    cache = ctx->data;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire");
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    ngx_memcpy(name, path->name.data, path->name.len);
 
-    } else {
-        ngx_time_update();
+    n = cache->sh->shards;
+    oldest = 0;
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    if (n > 1) {
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+        /*
+         * each shard keeps its own inactive queue, so the least recently
+         * used entry of the whole cache is the oldest of the queue tails
+         */
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
+        expire = NGX_MAX_TIME_T_VALUE;
+
+        for (i = 0; i < n; i++) {
+            shard = &cache->sh->shard[i];
+
+            ngx_shmtx_lock(shard->mutex);
+
+            q = ngx_http_file_cache_lru(shard);
+
+            if (q) {
+                fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+                if (fcn->expire < expire) {
+                    expire = fcn->expire;
+                    oldest = i;
+                }
+            }
+
+            ngx_shmtx_unlock(shard->mutex);
         }
     }
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+    wait = 10;
+
+    for (i = 0; i < n; i++) {
+        shard = &cache->sh->shard[(oldest + i) % n];
+
+        w = ngx_http_file_cache_forced_expire_shard(cache, shard, name);
+
+        if (w < wait) {
+            wait = w;
+        }
+
+        if (wait == 0) {
+            break;
+        }
+    }
+
+    ngx_free(name);
+
+    return wait;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static time_t
+ngx_http_file_cache_forced_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name)
 {
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
+    u_char                      *p;
+    size_t                       len;
+    time_t                       wait;
+    ngx_uint_t                   tries;
+    ngx_queue_t                 *q, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    wait = 10;
+    tries = 20;
+    sentinel = NULL;
+
+    ngx_shmtx_lock(shard->mutex);
+
+    for ( ;; ) {
+        q = ngx_http_file_cache_victim(cache, shard);
+
+        if (q == NULL) {
+            break;
+        }
+
+        if (q == sentinel) {
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, shard, q, name);
+            wait = 0;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_http_file_cache_unlink(shard, fcn);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_http_file_cache_link(cache, shard, fcn);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+        if (sentinel == NULL) {
+            sentinel = q;
+        }
+
+        if (--tries) {
+            continue;
+        }
+
+        wait = 1;
+        break;
     }
 
-    return NGX_OK;
+    ngx_shmtx_unlock(shard->mutex);
+
+    return wait;
 }
 
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 {
-    ngx_msleep(cache->loader_sleep);
+    u_char      *name;
+    size_t       len;
+    time_t       wait, w;
+    ngx_uint_t   i;
+    ngx_path_t  *path;
 
-    ngx_time_update();
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    wait = 10;
+
+    for (i = 0; i < cache->sh->shards; i++) {
+        w = ngx_http_file_cache_expire_shard(cache, &cache->sh->shard[i],
+                                             name);
+
+        if (w < wait) {
+            wait = w;
+        }
+
+        if (wait == 0) {
+            break;
+        }
+    }
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(shard->mutex);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        q = ngx_http_file_cache_lru(shard);
+
+        if (q == NULL) {
+            wait = 10;
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, shard, q, name);
+            goto next;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_http_file_cache_unlink(shard, fcn);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_http_file_cache_link(cache, shard, fcn);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+        if (++cache->files >= cache->manager_files) {
+            wait = 0;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(shard->mutex);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn->exists) {
+        shard->size -= fcn->fs_size;
+
+        path = cache->path;
+        p = name + path->name.len + 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        if (cache->memory_zone) {
+            ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            ngx_http_file_cache_memory_delete(cache, key);
+        }
+
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shmtx_unlock(shard->mutex);
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+
+        ngx_shmtx_lock(shard->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+        ngx_http_file_cache_unlink(shard, fcn);
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_http_file_cache_free_node(cache, fcn);
+        shard->count--;
+    }
+}
+
+
+static ngx_msec_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t       size;
+    time_t      wait;
+    ngx_msec_t  elapsed, next;
+    ngx_uint_t  count, watermark;
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    if (cache->snapshot
+        && !cache->sh->cold
+        && ngx_time() >= cache->snapshot_next)
+    {
+        ngx_http_file_cache_snapshot(cache);
+
+        ngx_time_update();
+        cache->snapshot_next = ngx_time() + cache->snapshot;
+    }
+
+    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+
+    if (next == 0) {
+        next = cache->manager_sleep;
+        goto done;
+    }
+
+    for ( ;; ) {
+        ngx_http_file_cache_total(cache, &size, &count);
+
+        watermark = cache->sh->watermark;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O c:%ui w:%i",
+                       size, count, (ngx_int_t) watermark);
+
+        if (size < cache->max_size && count < watermark) {
+            break;
+        }
+
+        wait = ngx_http_file_cache_forced_expire(cache);
+
+        if (wait > 0) {
+            next = (ngx_msec_t) wait * 1000;
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+
+        if (++cache->files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            next = cache->manager_sleep;
+            break;
+        }
+    }
+
+done:
+
+    if (cache->snapshot) {
+        wait = cache->snapshot_next - ngx_time();
+        next = ngx_min(next, (ngx_msec_t) ngx_max(wait, 1) * 1000);
+    }
+
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache manager: %ui e:%M n:%M",
+                   cache->files, elapsed, next);
+
+    return next;
+}
+
+
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t           size;
+    ngx_int_t       rc;
+    ngx_uint_t      count;
+    ngx_tree_ctx_t  tree;
+
+    if (!cache->sh->cold || cache->sh->loading) {
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    if (cache->snapshot) {
+        rc = ngx_http_file_cache_load_snapshot(cache);
+
+        if (rc == NGX_ABORT) {
+            cache->sh->loading = 0;
+            return;
+        }
+
+        if (rc == NGX_OK) {
+            goto done;
+        }
+    }
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+        cache->sh->loading = 0;
+        return;
+    }
+
+done:
+
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
+
+    ngx_http_file_cache_total(cache, &size, &count);
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
+
+    if (cache->snapshot
+        && path->len >= cache->snapshot_name.len
+        && ngx_strncmp(path->data, cache->snapshot_name.data,
+                       cache->snapshot_name.len) == 0)
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
+
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
+    }
+
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
+
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
+     */
+
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
+    }
+
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
+
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
+    }
+
+    return ngx_http_file_cache_add(cache, &c);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    ngx_shmtx_lock(shard->mutex);
+
+    fcn = ngx_http_file_cache_lookup(shard, c->key);
+
+    if (fcn == NULL) {
+
+        fcn = ngx_http_file_cache_alloc_node(cache);
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
+
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
+
+            ngx_shmtx_unlock(shard->mutex);
+            return NGX_ERROR;
+        }
+
+        shard->count++;
+
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_rbtree_insert(&shard->rbtree, &fcn->node);
+
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
+
+        shard->size += c->fs_size;
+
+    } else {
+        ngx_http_file_cache_unlink(shard, fcn);
+    }
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_http_file_cache_link(cache, shard, fcn);
+
+    ngx_shmtx_unlock(shard->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
+
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t  i, count;
+
+    /*
+     * called with a shard mutex locked, so the counters of other shards
+     * are read unlocked: the watermark is an estimate anyway
+     */
+
+    count = 0;
+
+    for (i = 0; i < cache->sh->shards; i++) {
+        count += cache->sh->shard[i].count;
+    }
+
+    cache->sh->watermark = count - count / 8;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_memory_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t              *cache;
+    ngx_http_file_cache_memory_node_t  *mn;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->memory_shpool->mutex);
+
+    mn = ngx_http_file_cache_memory_lookup(cache, c->key);
+
+    if (mn == NULL || mn->uniq != c->uniq) {
+        ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, mn->len);
+    if (c->buf == NULL) {
+        ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->buf->pos, mn->data, mn->len);
+
+    c->length = mn->len;
+
+    mn->uses++;
+
+    ngx_queue_remove(&mn->queue);
+    ngx_queue_insert_head(&cache->memory_sh->queue, &mn->queue);
+
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory: %O", c->length);
+
+    c->memory = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_memory_add(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                             *data;
+    size_t                              len, size;
+    ssize_t                             n;
+    ngx_uint_t                          uses, tries;
+    ngx_queue_t                        *q;
+    ngx_http_file_cache_t              *cache;
+    ngx_http_file_cache_memory_node_t  *mn;
+
+    cache = c->file_cache;
+
+    if (c->length > (off_t) cache->memory_object_size) {
+        return;
+    }
+
+    /* the counter is read unlocked as it is only an estimate */
+
+    uses = c->node->uses;
+
+    if (uses < cache->memory_min_uses) {
+        return;
+    }
+
+    len = (size_t) c->length;
+    size = c->buf->last - c->buf->pos;
+
+    data = ngx_pnalloc(r->pool, len);
+    if (data == NULL) {
+        return;
+    }
+
+    ngx_memcpy(data, c->buf->pos, size);
+
+    if (size < len) {
+        n = ngx_read_file(&c->file, data + size, len - size, size);
+
+        if (n == NGX_ERROR || (size_t) n != len - size) {
+            return;
+        }
+    }
+
+    size = offsetof(ngx_http_file_cache_memory_node_t, data) + len;
+
+    ngx_shmtx_lock(&cache->memory_shpool->mutex);
+
+    mn = ngx_http_file_cache_memory_lookup(cache, c->key);
+
+    if (mn) {
+        if (mn->uniq == c->uniq) {
+            goto done;
+        }
+
+        ngx_http_file_cache_memory_free(cache, mn);
+    }
+
+    for (tries = 0; /* void */ ; tries++) {
+
+        mn = ngx_slab_alloc_locked(cache->memory_shpool, size);
+
+        if (mn) {
+            break;
+        }
+
+        if (tries == NGX_HTTP_FILE_CACHE_MEMORY_TRIES
+            || ngx_queue_empty(&cache->memory_sh->queue))
+        {
+            goto done;
+        }
+
+        q = ngx_queue_last(&cache->memory_sh->queue);
+
+        mn = ngx_queue_data(q, ngx_http_file_cache_memory_node_t, queue);
+
+        /*
+         * the least recently used object stays if it is used more often
+         * than the new one, its counter is halved to let it age
+         */
+
+        if (mn->uses > uses) {
+            mn->uses /= 2;
+            goto done;
+        }
+
+        ngx_http_file_cache_memory_free(cache, mn);
+    }
+
+    ngx_memcpy((u_char *) &mn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+    ngx_memcpy(mn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    mn->uses = uses;
+    mn->uniq = c->uniq;
+    mn->len = len;
+
+    ngx_memcpy(mn->data, data, len);
+
+    ngx_rbtree_insert(&cache->memory_sh->rbtree, &mn->node);
+    ngx_queue_insert_head(&cache->memory_sh->queue, &mn->queue);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory add: %uz u:%ui", len, uses);
+
+done:
+
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+}
+
+
+static void
+ngx_http_file_cache_memory_delete(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_http_file_cache_memory_node_t  *mn;
+
+    ngx_shmtx_lock(&cache->memory_shpool->mutex);
+
+    mn = ngx_http_file_cache_memory_lookup(cache, key);
+
+    if (mn) {
+        ngx_http_file_cache_memory_free(cache, mn);
+    }
+
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+}
+
+
+static ngx_http_file_cache_memory_node_t *
+ngx_http_file_cache_memory_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                           rc;
+    ngx_rbtree_key_t                    node_key;
+    ngx_rbtree_node_t                  *node, *sentinel;
+    ngx_http_file_cache_memory_node_t  *mn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->memory_sh->rbtree.root;
+    sentinel = cache->memory_sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        mn = (ngx_http_file_cache_memory_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], mn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return mn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_memory_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_memory_node_t *mn)
+{
+    ngx_queue_remove(&mn->queue);
+    ngx_rbtree_delete(&cache->memory_sh->rbtree, &mn->node);
+    ngx_slab_free_locked(cache->memory_shpool, mn);
+}
+
+
+static void
+ngx_http_file_cache_memory_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                 **p;
+    ngx_http_file_cache_memory_node_t  *mn, *mnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            mn = (ngx_http_file_cache_memory_node_t *) node;
+            mnt = (ngx_http_file_cache_memory_node_t *) temp;
+
+            p = (ngx_memcmp(mn->key, mnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_file_cache_snapshot(ngx_http_file_cache_t *cache)
+{
+    u_char                               *key;
+    u_char                                last[NGX_HTTP_CACHE_KEY_LEN];
+    size_t                                size;
+    ssize_t                               n;
+    ngx_err_t                             err;
+    ngx_uint_t                            i, s;
+    ngx_file_t                            file;
+    ngx_rbtree_node_t                    *node;
+    ngx_http_file_cache_node_t           *fcn;
+    ngx_http_file_cache_shard_t          *shard;
+    ngx_http_file_cache_snapshot_t        header;
+    ngx_http_file_cache_snapshot_node_t  *buf, *sn;
+
+    buf = ngx_alloc(NGX_HTTP_FILE_CACHE_SNAPSHOT_BATCH
+                    * sizeof(ngx_http_file_cache_snapshot_node_t),
+                    ngx_cycle->log);
+    if (buf == NULL) {
+        return;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->snapshot_temp;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY,
+                            NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE && ngx_errno == NGX_ENOENT) {
+
+        err = ngx_create_full_path(file.name.data, 0700);
+
+        if (err) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_create_dir_n " \"%s\" failed", file.name.data);
+            ngx_free(buf);
+            return;
+        }
+
+        file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY,
+                                NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+    }
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        ngx_free(buf);
+        return;
+    }
+
+    ngx_memzero(&header, sizeof(ngx_http_file_cache_snapshot_t));
+
+    ngx_memcpy(header.magic, ngx_http_file_cache_snapshot_magic,
+               sizeof(header.magic));
+    header.version = NGX_HTTP_FILE_CACHE_SNAPSHOT_VERSION;
+    header.node_size = sizeof(ngx_http_file_cache_snapshot_node_t);
+    header.bsize = cache->bsize;
+    ngx_memcpy(header.level, cache->path->level, sizeof(header.level));
+
+    /*
+     * a file is renamed into the cache before its node is marked
+     * as existing, so the snapshot time is moved back a bit to make
+     * the loader rescan the directories of such files
+     */
+
+    header.time = ngx_time() - 1;
+
+    if (ngx_write_file(&file, (u_char *) &header, sizeof(header), 0)
+        == NGX_ERROR)
+    {
+        goto failed;
+    }
+
+    s = 0;
+    key = NULL;
+    fcn = NULL;
+
+    /*
+     * the trees are copied in batches in the key order, the position
+     * is found again by the last visited key after the mutex is released
+     */
+
+    for ( ;; ) {
+        sn = buf;
+        shard = &cache->sh->shard[s];
+
+        ngx_shmtx_lock(shard->mutex);
+
+        node = ngx_http_file_cache_snapshot_next(shard, key);
+
+        for (i = 0; node && i < NGX_HTTP_FILE_CACHE_SNAPSHOT_BATCH; i++) {
+
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            if (fcn->exists && !fcn->deleting) {
+                ngx_memcpy(sn->key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(&sn->key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+                sn->uniq = fcn->uniq;
+                sn->fs_size = fcn->fs_size;
+                sn->body_start = fcn->body_start;
+                sn++;
+            }
+
+            node = ngx_rbtree_next(&shard->rbtree, node);
+        }
+
+        if (node) {
+            ngx_memcpy(last, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&last[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+            key = last;
+        }
+
+        ngx_shmtx_unlock(shard->mutex);
+
+        n = sn - buf;
+
+        if (n) {
+            size = n * sizeof(ngx_http_file_cache_snapshot_node_t);
+
+            if (ngx_write_file(&file, (u_char *) buf, size, file.offset)
+                == NGX_ERROR)
+            {
+                goto failed;
+            }
+
+            header.count += n;
+        }
+
+        if (node == NULL) {
+            if (++s == cache->sh->shards) {
+                break;
+            }
+
+            key = NULL;
+        }
+    }
+
+    if (ngx_write_file(&file, (u_char *) &header, sizeof(header), 0)
+        == NGX_ERROR)
+    {
+        goto failed;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    if (ngx_rename_file(cache->snapshot_temp.data, cache->snapshot_name.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      cache->snapshot_temp.data, cache->snapshot_name.data);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache snapshot: \"%V\" %ui",
+                   &cache->snapshot_name, header.count);
+
+    ngx_free(buf);
+
+    return;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    if (ngx_delete_file(file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", file.name.data);
+    }
+
+    ngx_free(buf);
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_file_cache_snapshot_next(ngx_http_file_cache_shard_t *shard,
+    u_char *key)
+{
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel, *next;
+    ngx_http_file_cache_node_t  *fcn;
+
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
+
+    if (node == sentinel) {
+        return NULL;
+    }
+
+    if (key == NULL) {
+        return ngx_rbtree_min(node, sentinel);
+    }
+
+    /* the first node with a key greater than the key */
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    next = NULL;
+
+    while (node != sentinel) {
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        if (node_key < node->key
+            || (node_key == node->key
+                && ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                              NGX_HTTP_CACHE_KEY_LEN
+                              - sizeof(ngx_rbtree_key_t)) < 0))
+        {
+            next = node;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return next;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_load_snapshot(ngx_http_file_cache_t *cache)
+{
+    size_t                                size;
+    ssize_t                               n;
+    ngx_int_t                             rc;
+    ngx_uint_t                            i, levels, count, loaded;
+    ngx_err_t                             err;
+    ngx_file_t                            file;
+    ngx_file_info_t                       fi;
+    ngx_tree_ctx_t                        tree;
+    ngx_http_file_cache_snapshot_t        header;
+    ngx_http_file_cache_snapshot_node_t  *buf;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->snapshot_name;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_open_file_n " \"%s\" failed", file.name.data);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    rc = NGX_DECLINED;
+    buf = NULL;
+
+    n = ngx_read_file(&file, (u_char *) &header, sizeof(header), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(header)
+        || ngx_memcmp(header.magic, ngx_http_file_cache_snapshot_magic,
+                      sizeof(header.magic)) != 0
+        || header.version != NGX_HTTP_FILE_CACHE_SNAPSHOT_VERSION
+        || header.node_size != sizeof(ngx_http_file_cache_snapshot_node_t)
+        || header.bsize != cache->bsize
+        || ngx_memcmp(header.level, cache->path->level, sizeof(header.level))
+           != 0
+        || ngx_file_size(&fi) != (off_t) (sizeof(header)
+                                          + header.count * header.node_size))
+    {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "cache snapshot \"%s\" is invalid, ignored",
+                      file.name.data);
+        goto done;
+    }
+
+    levels = 0;
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        levels += cache->path->level[i];
+    }
+
+    /* a bit for each directory, 4 bits in a hex digit of directory names */
+
+    cache->snapshot_dirs = ngx_calloc(((size_t) 1 << (4 * levels)) / 8 + 1,
+                                      ngx_cycle->log);
+    if (cache->snapshot_dirs == NULL) {
+        goto done;
+    }
+
+    cache->snapshot_time = header.time;
+
+    /*
+     * find directories not changed after the snapshot was taken,
+     * removed directories are not visited and thus count as changed
+     */
+
+    if (levels == 0) {
+        if (ngx_file_info(cache->path->name.data, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_file_info_n " \"%s\" failed",
+                          cache->path->name.data);
+            goto done;
+        }
+
+        if (ngx_file_mtime(&fi) >= header.time) {
+            goto done;
+        }
+
+        cache->snapshot_dirs[0] = 1;
+
+    } else {
+        tree.init_handler = NULL;
+        tree.file_handler = ngx_http_file_cache_noop;
+        tree.pre_tree_handler = ngx_http_file_cache_snapshot_directory;
+        tree.post_tree_handler = ngx_http_file_cache_noop;
+        tree.spec_handler = ngx_http_file_cache_noop;
+        tree.data = cache;
+        tree.alloc = 0;
+        tree.log = ngx_cycle->log;
+
+        if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+            rc = NGX_ABORT;
+            goto done;
+        }
+    }
+
+    /* load the nodes of unchanged directories */
+
+    buf = ngx_alloc(NGX_HTTP_FILE_CACHE_SNAPSHOT_BATCH
+                    * sizeof(ngx_http_file_cache_snapshot_node_t),
+                    ngx_cycle->log);
+    if (buf == NULL) {
+        goto done;
+    }
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
-}
+    loaded = 0;
 
+    for (count = header.count; count; count -= i) {
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
-{
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+        i = ngx_min(count, NGX_HTTP_FILE_CACHE_SNAPSHOT_BATCH);
+        size = i * sizeof(ngx_http_file_cache_snapshot_node_t);
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
-    }
+        if (ngx_read_file(&file, (u_char *) buf, size, file.offset)
+            != (ssize_t) size)
+        {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0,
+                          "cache snapshot \"%s\" was truncated",
+                          file.name.data);
+            break;
+        }
 
-    /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
-     */
+        rc = ngx_http_file_cache_add_snapshot(cache, buf, i, &loaded);
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
-    {
-        return NGX_OK;
-    }
+        if (rc != NGX_OK) {
+            break;
+        }
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
+        if (ngx_quit || ngx_terminate) {
+            rc = NGX_ABORT;
+            goto done;
+        }
     }
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %ui of %ui nodes loaded from snapshot",
+                  &cache->path->name, loaded, header.count);
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    /* rescan the changed directories */
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+    rc = NGX_OK;
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+    if (levels) {
+        tree.init_handler = NULL;
+        tree.file_handler = ngx_http_file_cache_manage_file;
+        tree.pre_tree_handler = ngx_http_file_cache_changed_directory;
+        tree.post_tree_handler = ngx_http_file_cache_noop;
+        tree.spec_handler = ngx_http_file_cache_delete_file;
+        tree.data = cache;
+        tree.alloc = 0;
+        tree.log = ngx_cycle->log;
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
+        if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+            rc = NGX_ABORT;
         }
+    }
 
-        p += 2;
+done:
 
-        c.key[i] = (u_char) n;
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
     }
 
-    return ngx_http_file_cache_add(cache, &c);
+    if (buf) {
+        ngx_free(buf);
+    }
+
+    if (cache->snapshot_dirs) {
+        ngx_free(cache->snapshot_dirs);
+        cache->snapshot_dirs = NULL;
+    }
+
+    return rc;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+ngx_http_file_cache_add_snapshot(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_snapshot_node_t *sn, ngx_uint_t n, ngx_uint_t *loaded)
 {
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_uint_t                    dir;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    for ( /* void */ ; n; n--, sn++) {
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+        dir = ngx_http_file_cache_key_dir(cache, sn->key);
 
-    if (fcn == NULL) {
+        if (!(cache->snapshot_dirs[dir / 8] & (1 << (dir % 8)))) {
+            continue;
+        }
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
+        shard = ngx_http_file_cache_shard(cache, sn->key);
+
+        ngx_shmtx_lock(shard->mutex);
+
+        if (ngx_http_file_cache_lookup(shard, sn->key)) {
+            ngx_shmtx_unlock(shard->mutex);
+            continue;
+        }
+
+        fcn = ngx_http_file_cache_alloc_node(cache);
         if (fcn == NULL) {
             ngx_http_file_cache_set_watermark(cache);
 
@@ -2215,61 +4418,144 @@ ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
                            "could not allocate node%s", cache->shpool->log_ctx);
             }
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
+            ngx_shmtx_unlock(shard->mutex);
             return NGX_ERROR;
         }
 
-        cache->sh->count++;
+        shard->count++;
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy((u_char *) &fcn->node.key, sn->key,
+                   sizeof(ngx_rbtree_key_t));
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+        ngx_memcpy(fcn->key, &sn->key[sizeof(ngx_rbtree_key_t)],
                    NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        ngx_rbtree_insert(&shard->rbtree, &fcn->node);
 
         fcn->uses = 1;
         fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+        fcn->uniq = sn->uniq;
+        fcn->body_start = sn->body_start;
+        fcn->fs_size = sn->fs_size;
+        fcn->expire = ngx_time() + cache->inactive;
 
-        cache->sh->size += c->fs_size;
+        ngx_http_file_cache_link(cache, shard, fcn);
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
+        shard->size += sn->fs_size;
+
+        ngx_shmtx_unlock(shard->mutex);
+
+        (*loaded)++;
     }
 
-    fcn->expire = ngx_time() + cache->inactive;
+    return NGX_OK;
+}
+
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+static ngx_int_t
+ngx_http_file_cache_snapshot_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_int_t               dir;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (ngx_http_file_cache_manage_directory(ctx, path) == NGX_DECLINED) {
+        return NGX_DECLINED;
+    }
 
-    return NGX_OK;
+    if (path->len != cache->path->name.len + cache->path->len) {
+        return NGX_OK;
+    }
+
+    dir = ngx_http_file_cache_path_dir(cache, path);
+
+    if (dir != NGX_ERROR && ctx->mtime < cache->snapshot_time) {
+        cache->snapshot_dirs[dir / 8] |= 1 << (dir % 8);
+    }
+
+    return NGX_DECLINED;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+ngx_http_file_cache_changed_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    ngx_int_t               dir;
+    ngx_http_file_cache_t  *cache;
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+    cache = ctx->data;
+
+    if (ngx_http_file_cache_manage_directory(ctx, path) == NGX_DECLINED) {
+        return NGX_DECLINED;
     }
 
-    return NGX_OK;
+    if (path->len != cache->path->name.len + cache->path->len) {
+        return NGX_OK;
+    }
+
+    dir = ngx_http_file_cache_path_dir(cache, path);
+
+    if (dir != NGX_ERROR
+        && !(cache->snapshot_dirs[dir / 8] & (1 << (dir % 8))))
+    {
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
 }
 
 
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+/*
+ * directories are numbered by the hex digits of their names, the same
+ * digits are taken from the end of the key as ngx_create_hashed_filename()
+ * does
+ */
+
+static ngx_uint_t
+ngx_http_file_cache_key_dir(ngx_http_file_cache_t *cache, u_char *key)
 {
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    ngx_uint_t  i, n, j, dir;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+    dir = 0;
+    n = 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL && cache->path->level[i]; i++) {
+
+        n -= cache->path->level[i];
+
+        for (j = n; j < n + cache->path->level[i]; j++) {
+            dir = (dir << 4) | ((j & 1) ? (key[j / 2] & 0xf) : (key[j / 2] >> 4));
+        }
+    }
+
+    return dir;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_path_dir(ngx_http_file_cache_t *cache, ngx_str_t *path)
+{
+    u_char      *p;
+    ngx_int_t    n;
+    ngx_uint_t   i, dir;
+
+    dir = 0;
+    p = path->data + cache->path->name.len;
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL && cache->path->level[i]; i++) {
+
+        n = ngx_hextoi(p + 1, cache->path->level[i]);
+
+        if (*p != '/' || n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        dir = (dir << (4 * cache->path->level[i])) | n;
+        p += 1 + cache->path->level[i];
+    }
+
+    return dir;
 }
 
 
@@ -2299,6 +4585,25 @@ ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status)
 }
 
 
+/*
+ * the waiters of cache locks are per process, they are woken up by
+ * the NGX_CMD_WAKEUP channel command via ngx_wakeup_event
+ */
+
+void
+ngx_http_file_cache_init_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_init(&ngx_http_file_cache_waiting);
+
+    ngx_memzero(&ngx_http_file_cache_wakeup, sizeof(ngx_event_t));
+
+    ngx_http_file_cache_wakeup.handler = ngx_http_file_cache_wakeup_handler;
+    ngx_http_file_cache_wakeup.log = cycle->log;
+
+    ngx_wakeup_event = &ngx_http_file_cache_wakeup;
+}
+
+
 char *
 ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -2307,12 +4612,14 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     off_t                   max_size;
     u_char                 *last, *p;
     time_t                  inactive;
-    ssize_t                 size;
-    ngx_str_t               s, name, *value;
+    ssize_t                 size, memory_size, memory_object_size;
+    ngx_str_t               s, name, memory_name, *value;
     ngx_int_t               loader_files, manager_files;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    time_t                  snapshot;
+    ngx_uint_t              i, n, use_temp_path, shards, eviction,
+                            memory_min_uses;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
 
@@ -2329,6 +4636,13 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     use_temp_path = 1;
 
     inactive = 600;
+    snapshot = 0;
+    shards = 1;
+    eviction = NGX_HTTP_CACHE_LRU;
+
+    memory_size = 0;
+    memory_object_size = 16384;
+    memory_min_uses = 2;
 
     loader_files = 100;
     loader_sleep = 50;
@@ -2446,6 +4760,74 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "memory_zone=", 12) == 0) {
+
+            memory_name.data = value[i].data + 12;
+
+            p = (u_char *) ngx_strchr(memory_name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory zone size \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            memory_name.len = p - memory_name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            memory_size = ngx_parse_size(&s);
+
+            if (memory_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory zone size \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (memory_size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "memory zone \"%V\" is too small",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_object_size=", 19) == 0) {
+
+            s.len = value[i].len - 19;
+            s.data = value[i].data + 19;
+
+            memory_object_size = ngx_parse_size(&s);
+            if (memory_object_size == NGX_ERROR || memory_object_size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory_object_size value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_min_uses=", 16) == 0) {
+
+            memory_min_uses = ngx_atoi(value[i].data + 16, value[i].len - 16);
+            if (memory_min_uses == (ngx_uint_t) NGX_ERROR
+                || memory_min_uses == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory_min_uses value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
 
             s.len = value[i].len - 9;
@@ -2461,6 +4843,66 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "snapshot=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            snapshot = ngx_parse_time(&s, 1);
+            if (snapshot == (time_t) NGX_ERROR || snapshot == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid snapshot value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (n == (ngx_uint_t) NGX_ERROR || n == 0
+                || n > NGX_HTTP_FILE_CACHE_MAX_SHARDS)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            shards = n;
+
+            continue;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"shards\" parameter requires atomic operations "
+                               "support");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (ngx_strncmp(value[i].data, "eviction=", 9) == 0) {
+
+            if (ngx_strcmp(&value[i].data[9], "lru") == 0) {
+                eviction = NGX_HTTP_CACHE_LRU;
+
+            } else if (ngx_strcmp(&value[i].data[9], "slru") == 0) {
+                eviction = NGX_HTTP_CACHE_SLRU;
+
+            } else if (ngx_strcmp(&value[i].data[9], "gdsf") == 0) {
+                eviction = NGX_HTTP_CACHE_GDSF;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid eviction \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
 
             s.len = value[i].len - 9;
@@ -2583,6 +5025,33 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->manager_files = manager_files;
     cache->manager_sleep = manager_sleep;
     cache->manager_threshold = manager_threshold;
+    cache->shards = shards;
+    cache->eviction = eviction;
+
+    if (snapshot) {
+        cache->snapshot = snapshot;
+
+        n = cache->path->name.len + sizeof("/snapshot/keys") - 1;
+
+        cache->snapshot_name.len = n;
+        cache->snapshot_name.data = ngx_pnalloc(cf->pool, n + 1);
+        if (cache->snapshot_name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->snapshot_name.data, "%V/snapshot/keys%Z",
+                    &cache->path->name);
+
+        cache->snapshot_temp.len = n + sizeof(".tmp") - 1;
+        cache->snapshot_temp.data = ngx_pnalloc(cf->pool,
+                                                cache->snapshot_temp.len + 1);
+        if (cache->snapshot_temp.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->snapshot_temp.data, "%V.tmp%Z",
+                    &cache->snapshot_name);
+    }
 
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
@@ -2603,6 +5072,26 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->init = ngx_http_file_cache_init;
     cache->shm_zone->data = cache;
 
+    if (memory_size) {
+        cache->memory_zone = ngx_shared_memory_add(cf, &memory_name,
+                                                   memory_size, cmd->post);
+        if (cache->memory_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (cache->memory_zone->data) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate zone \"%V\"", &memory_name);
+            return NGX_CONF_ERROR;
+        }
+
+        cache->memory_zone->init = ngx_http_file_cache_memory_init;
+        cache->memory_zone->data = cache;
+
+        cache->memory_object_size = memory_object_size;
+        cache->memory_min_uses = memory_min_uses;
+    }
+
     cache->use_temp_path = use_temp_path;
 
     cache->inactive = inactive;
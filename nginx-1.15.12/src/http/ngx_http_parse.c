@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
 
 static uint32_t  usual[] = {
     0xffffdbfe, /* 1111 1111 1111 1111  1101 1011 1111 1110 */
@@ -33,6 +37,116 @@ static uint32_t  usual[] = {
 };
 
 
+#if (NGX_HAVE_SSE2)
+
+/*
+ * the scanners look at whole 16-byte blocks only and return either
+ * the first interesting byte or the end of the last block scanned,
+ * the tail of the buffer is left to the state machines
+ */
+
+static ngx_inline u_char *
+ngx_http_parse_uri_sse2(u_char *p, u_char *last)
+{
+    int      mask;
+    __m128i  v, sp, cr, lf, hash, zero;
+
+    sp = _mm_set1_epi8(' ');
+    cr = _mm_set1_epi8(CR);
+    lf = _mm_set1_epi8(LF);
+    hash = _mm_set1_epi8('#');
+    zero = _mm_setzero_si128();
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        mask = _mm_movemask_epi8(
+                   _mm_or_si128(
+                       _mm_or_si128(_mm_cmpeq_epi8(v, sp),
+                                    _mm_cmpeq_epi8(v, cr)),
+                       _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lf),
+                                                 _mm_cmpeq_epi8(v, hash)),
+                                    _mm_cmpeq_epi8(v, zero))));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+static ngx_inline u_char *
+ngx_http_parse_name_sse2(u_char *p, u_char *last)
+{
+    int      mask;
+    __m128i  v, lc, valid;
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        /* [a-zA-Z]: bytes above 0x7f are negative and never match */
+
+        lc = _mm_or_si128(v, _mm_set1_epi8(0x20));
+
+        valid = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)),
+                              _mm_cmplt_epi8(lc, _mm_set1_epi8('z' + 1)));
+
+        /* [0-9-] */
+
+        valid = _mm_or_si128(valid,
+                    _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))));
+
+        valid = _mm_or_si128(valid, _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+
+        mask = ~_mm_movemask_epi8(valid) & 0xffff;
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+static ngx_inline u_char *
+ngx_http_parse_value_sse2(u_char *p, u_char *last)
+{
+    int      mask;
+    __m128i  v, cr, lf, zero;
+
+    cr = _mm_set1_epi8(CR);
+    lf = _mm_set1_epi8(LF);
+    zero = _mm_setzero_si128();
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        mask = _mm_movemask_epi8(
+                   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                             _mm_cmpeq_epi8(v, lf)),
+                                _mm_cmpeq_epi8(v, zero)));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+#endif
+
+
 #if (NGX_HAVE_LITTLE_ENDIAN && NGX_HAVE_NONALIGNED)
 
 #define ngx_str3_cmp(m, c0, c1, c2, c3)                                       \
@@ -631,6 +745,20 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         /* URI */
         case sw_uri:
 
+#if (NGX_HAVE_SSE2)
+            if (b->last - p >= 16) {
+                m = ngx_http_parse_uri_sse2(p, b->last);
+
+                if (m == b->last) {
+                    p = m - 1;
+                    break;
+                }
+
+                p = m;
+                ch = *p;
+            }
+#endif
+
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
                 break;
             }
@@ -848,6 +976,9 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
 {
     u_char      c, ch, *p;
     ngx_uint_t  hash, i;
+#if (NGX_HAVE_SSE2)
+    u_char     *m;
+#endif
     enum {
         sw_start = 0,
         sw_name,
@@ -931,6 +1062,27 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
 
         /* header name */
         case sw_name:
+
+#if (NGX_HAVE_SSE2)
+            if (b->last - p >= 16) {
+                m = ngx_http_parse_name_sse2(p, b->last);
+
+                for ( /* void */ ; p < m; p++) {
+                    c = lowcase[*p];
+                    hash = ngx_hash(hash, c);
+                    r->lowcase_header[i++] = c;
+                    i &= (NGX_HTTP_LC_HEADER_LEN - 1);
+                }
+
+                if (p == b->last) {
+                    p--;
+                    break;
+                }
+
+                ch = *p;
+            }
+#endif
+
             c = lowcase[ch];
 
             if (c) {
@@ -1017,6 +1169,50 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
 
         /* header value */
         case sw_value:
+
+#if (NGX_HAVE_SSE2)
+            if (b->last - p >= 16) {
+                m = ngx_http_parse_value_sse2(p, b->last);
+
+                if (m != b->last && (*m == CR || *m == LF || *m == '\0')) {
+
+                    /*
+                     * up to the end of line only spaces could change
+                     * the state, so header_end is before trailing ones
+                     */
+
+                    if (*m == '\0') {
+                        return NGX_HTTP_PARSE_INVALID_HEADER;
+                    }
+
+                    for (r->header_end = m;
+                         r->header_end > p && r->header_end[-1] == ' ';
+                         r->header_end--)
+                    { /* void */ }
+
+                    p = m;
+
+                    if (*p == LF) {
+                        goto done;
+                    }
+
+                    state = sw_almost_done;
+                    break;
+                }
+
+                /* leave trailing spaces to the state machine */
+
+                while (m > p && m[-1] == ' ') {
+                    m--;
+                }
+
+                if (m > p) {
+                    p = m - 1;
+                    break;
+                }
+            }
+#endif
+
             switch (ch) {
             case ' ':
                 r->header_end = p;
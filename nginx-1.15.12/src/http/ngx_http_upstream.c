@@ -27,6 +27,10 @@ static ngx_int_t ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_counter(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_bytes(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 #endif
 
 static void ngx_http_upstream_init_request(ngx_http_request_t *r);
@@ -180,6 +184,7 @@ static ngx_int_t ngx_http_upstream_set_local(ngx_http_request_t *r,
 
 static void *ngx_http_upstream_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf);
+static ngx_int_t ngx_http_upstream_init_process(ngx_cycle_t *cycle);
 
 #if (NGX_HTTP_SSL)
 static void ngx_http_upstream_ssl_init_connection(ngx_http_request_t *,
@@ -370,7 +375,7 @@ ngx_module_t  ngx_http_upstream_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_init_process,        /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -427,6 +432,24 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_cache_etag, 0,
       NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
 
+    { ngx_string("upstream_cache_hits"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, hits),
+      NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
+
+    { ngx_string("upstream_cache_misses"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, misses),
+      NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
+
+    { ngx_string("upstream_cache_hit_bytes"), NULL,
+      ngx_http_upstream_cache_bytes, 1,
+      NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
+
+    { ngx_string("upstream_cache_miss_bytes"), NULL,
+      ngx_http_upstream_cache_bytes, 0,
+      NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
+
 #endif
 
     { ngx_string("upstream_http_"), NULL, ngx_http_upstream_header_variable,
@@ -596,6 +619,9 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
                 u->buffer.start = NULL;
                 u->cache_status = NGX_HTTP_CACHE_MISS;
                 u->request_sent = 1;
+
+                (void) ngx_atomic_fetch_add(&r->cache->file_cache->sh->misses,
+                                            1);
             }
 
             if (ngx_http_upstream_cache_background_update(r, u) != NGX_OK) {
@@ -885,6 +911,7 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->lock = u->conf->cache_lock;
         c->lock_timeout = u->conf->cache_lock_timeout;
         c->lock_age = u->conf->cache_lock_age;
+        c->lock_stream = u->conf->cache_lock_stream;
 
         u->cache_status = NGX_HTTP_CACHE_MISS;
     }
@@ -979,6 +1006,10 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return rc;
     }
 
+    /* the response is not sent from the cache */
+
+    (void) ngx_atomic_fetch_add(&c->file_cache->sh->misses, 1);
+
     if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
         u->cacheable = 0;
     }
@@ -3161,6 +3192,15 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     p->max_temp_file_size = u->conf->max_temp_file_size;
     p->temp_file_write_size = u->conf->temp_file_write_size;
 
+#if (NGX_HTTP_CACHE)
+    if (u->cacheable && r->cache->lock_stream) {
+        if (ngx_http_file_cache_fill(r, p) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+#endif
+
 #if (NGX_THREADS)
     if (clcf->aio == NGX_HTTP_AIO_THREADS && clcf->aio_write) {
         p->thread_handler = ngx_http_upstream_thread_handler;
@@ -5689,6 +5729,64 @@ ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+
+static ngx_int_t
+ngx_http_upstream_cache_counter(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char        *p;
+    ngx_atomic_t  *counter;
+
+    if (r->upstream == NULL || r->cache == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    counter = (ngx_atomic_t *) ((char *) r->cache->file_cache->sh + data);
+
+    p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%uA", *counter) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_bytes(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char  *p;
+    off_t    hit, miss;
+
+    if (r->upstream == NULL || r->cache == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    ngx_http_file_cache_bytes(r->cache->file_cache, &hit, &miss);
+
+    p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%O", data ? hit : miss) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
 #endif
 
 
@@ -6476,3 +6574,14 @@ ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static ngx_int_t
+ngx_http_upstream_init_process(ngx_cycle_t *cycle)
+{
+#if (NGX_HTTP_CACHE)
+    ngx_http_file_cache_init_process(cycle);
+#endif
+
+    return NGX_OK;
+}
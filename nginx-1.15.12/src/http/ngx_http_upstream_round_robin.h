@@ -53,6 +53,11 @@ struct ngx_http_upstream_rr_peer_s {
 
     NGX_COMPAT_BEGIN(32)
     NGX_COMPAT_END
+
+#if (NGX_HTTP_UPSTREAM_EWMA)
+    ngx_msec_t                      ewma;
+    ngx_msec_t                      ewma_updated;
+#endif
 };
 
 
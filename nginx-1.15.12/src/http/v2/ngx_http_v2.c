@@ -54,12 +54,17 @@ typedef struct {
 
 #define NGX_HTTP_V2_FRAME_BUFFER_SIZE            24
 
+/* the amount of stream frames passed to send_chain() at once */
+#define NGX_HTTP_V2_SEND_LIMIT                   (1024 * 1024)
+
 #define NGX_HTTP_V2_ROOT                         (void *) -1
 
 
 static void ngx_http_v2_read_handler(ngx_event_t *rev);
 static void ngx_http_v2_write_handler(ngx_event_t *wev);
 static void ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c);
+static void ngx_http_v2_frame_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
 static u_char *ngx_http_v2_state_proxy_protocol(ngx_http_v2_connection_t *h2c,
     u_char *pos, u_char *end);
@@ -270,6 +275,11 @@ ngx_http_v2_init(ngx_event_t *rev)
 
     h2c->frame_size = NGX_HTTP_V2_DEFAULT_FRAME_SIZE;
 
+    h2c->hpack_enc.size = NGX_HTTP_V2_TABLE_SIZE;
+
+    ngx_rbtree_init(&h2c->out_tree, &h2c->out_sentinel,
+                    ngx_http_v2_frame_insert_value);
+
     h2scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v2_module);
 
     h2c->concurrent_pushes = h2scf->concurrent_pushes;
@@ -425,7 +435,9 @@ ngx_http_v2_read_handler(ngx_event_t *rev)
         return;
     }
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if (ngx_http_v2_output_queued(h2c)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -464,7 +476,7 @@ ngx_http_v2_write_handler(ngx_event_t *wev)
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 write handler");
 
-    if (h2c->last_out == NULL && !c->buffered) {
+    if (!ngx_http_v2_output_queued(h2c) && !c->buffered) {
 
         if (wev->timer_set) {
             ngx_del_timer(wev);
@@ -497,8 +509,10 @@ ngx_int_t
 ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
 {
     int                        tcp_nodelay;
+    size_t                     size;
     ngx_chain_t               *cl;
     ngx_event_t               *wev;
+    ngx_rbtree_node_t         *node, *root, *sentinel;
     ngx_connection_t          *c;
     ngx_http_v2_out_frame_t   *out, *frame, *fn;
     ngx_http_core_loc_conf_t  *clcf;
@@ -515,10 +529,40 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         return NGX_AGAIN;
     }
 
+    /*
+     * The frames of the output tree follow the list, which is kept
+     * in the reverse order, so they are prepended to it backwards.
+     * Only the first frames of the tree, up to NGX_HTTP_V2_SEND_LIMIT
+     * bytes, are taken, so a write does not walk all queued frames
+     * when the client is slow; the rest is sent from a posted event.
+     */
+
+    frame = h2c->last_out;
+
+    root = h2c->out_tree.root;
+    sentinel = h2c->out_tree.sentinel;
+
+    node = NULL;
+
+    if (root != sentinel) {
+        size = 0;
+
+        for (node = ngx_rbtree_min(root, sentinel);
+             node && size < NGX_HTTP_V2_SEND_LIMIT;
+             node = ngx_rbtree_next(&h2c->out_tree, node))
+        {
+            fn = (ngx_http_v2_out_frame_t *) node;
+            fn->next = frame;
+            frame = fn;
+
+            size += fn->length;
+        }
+    }
+
     cl = NULL;
     out = NULL;
 
-    for (frame = h2c->last_out; frame; frame = fn) {
+    for ( /* void */ ; frame; frame = fn) {
         frame->last->next = cl;
         cl = frame->first;
 
@@ -565,6 +609,15 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
     for ( /* void */ ; out; out = fn) {
         fn = out->next;
 
+        if (out->scheduled) {
+            ngx_rbtree_delete(&h2c->out_tree, &out->node);
+            out->scheduled = 0;
+
+            if ((ngx_rbtree_key_int_t) (out->node.key - h2c->out_vtime) > 0) {
+                h2c->out_vtime = out->node.key;
+            }
+        }
+
         if (out->handler(h2c, out) != NGX_OK) {
             out->blocked = 1;
             break;
@@ -580,6 +633,11 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
 
     for ( /* void */ ; out; out = fn) {
         fn = out->next;
+
+        if (out->scheduled) {
+            continue;
+        }
+
         out->next = frame;
         frame = out;
     }
@@ -591,6 +649,10 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         return NGX_AGAIN;
     }
 
+    if (node) {
+        ngx_post_event(wev, &ngx_posted_events);
+    }
+
     if (wev->timer_set) {
         ngx_del_timer(wev);
     }
@@ -609,6 +671,88 @@ error:
 }
 
 
+/*
+ * Stream frames are served in the order of their virtual finish time:
+ * it advances by the frame length divided by the share of the stream
+ * in the dependency tree, starting from the finish time of the last
+ * frame sent.  Streams closer to the root of the tree still go first.
+ */
+
+void
+ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame)
+{
+    double                 weight;
+    ngx_uint_t             rank;
+    ngx_http_v2_stream_t  *stream;
+
+    stream = frame->stream;
+
+    rank = stream->node->rank;
+
+    /* the frames of a stream are never reordered */
+
+    if (stream->queued && rank < stream->rank) {
+        rank = stream->rank;
+    }
+
+    if ((ngx_rbtree_key_int_t) (stream->vtime - h2c->out_vtime) < 0) {
+        stream->vtime = h2c->out_vtime;
+    }
+
+    weight = ngx_max(stream->node->rel_weight, 1.0 / 256);
+
+    stream->vtime += (ngx_rbtree_key_t) (frame->length / weight);
+    stream->rank = rank;
+
+    frame->node.key = stream->vtime;
+    frame->rank = rank;
+    frame->scheduled = 1;
+
+    ngx_rbtree_insert(&h2c->out_tree, &frame->node);
+}
+
+
+static void
+ngx_http_v2_frame_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t        **p;
+    ngx_http_v2_out_frame_t   *frame, *t;
+
+    frame = (ngx_http_v2_out_frame_t *) node;
+
+    for ( ;; ) {
+
+        t = (ngx_http_v2_out_frame_t *) temp;
+
+        /* frames with equal keys are kept in the order they were queued */
+
+        if (frame->rank < t->rank
+            || (frame->rank == t->rank
+                && (ngx_rbtree_key_int_t) (node->key - temp->key) < 0))
+        {
+            p = &temp->left;
+
+        } else {
+            p = &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
 static void
 ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
 {
@@ -616,7 +760,7 @@ ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
     ngx_connection_t        *c;
     ngx_http_v2_srv_conf_t  *h2scf;
 
-    if (h2c->last_out || h2c->processing || h2c->pushing) {
+    if (ngx_http_v2_output_queued(h2c) || h2c->processing || h2c->pushing) {
         return;
     }
 
@@ -2076,7 +2220,7 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
 
         case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
 
-            h2c->table_update = 1;
+            ngx_http_v2_table_encoder_size(h2c, value);
             break;
 
         default:
@@ -4465,7 +4609,9 @@ ngx_http_v2_handle_connection_handler(ngx_event_t *rev)
         return;
     }
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if (ngx_http_v2_output_queued(h2c)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -4571,6 +4717,9 @@ ngx_http_v2_finalize_connection(ngx_http_v2_connection_t *h2c,
 
     h2c->last_out = NULL;
 
+    ngx_rbtree_init(&h2c->out_tree, &h2c->out_sentinel,
+                    ngx_http_v2_frame_insert_value);
+
     h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
                                          ngx_http_v2_module);
 
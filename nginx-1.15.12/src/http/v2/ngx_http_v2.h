@@ -115,6 +115,23 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    ngx_http_v2_header_t            *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+
+    size_t                           size;
+    size_t                           used;
+
+    size_t                           update;
+    size_t                           update_min;
+
+    u_char                          *storage;
+    u_char                          *pos;
+} ngx_http_v2_hpack_enc_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -137,6 +154,7 @@ struct ngx_http_v2_connection_s {
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_enc_t          hpack_enc;
 
     ngx_pool_t                      *pool;
 
@@ -147,6 +165,10 @@ struct ngx_http_v2_connection_s {
 
     ngx_http_v2_out_frame_t         *last_out;
 
+    ngx_rbtree_t                     out_tree;
+    ngx_rbtree_node_t                out_sentinel;
+    ngx_rbtree_key_t                 out_vtime;
+
     ngx_queue_t                      dependencies;
     ngx_queue_t                      closed;
 
@@ -183,6 +205,10 @@ struct ngx_http_v2_stream_s {
 
     ngx_uint_t                       queued;
 
+    /* the position of the last frame put into the output tree */
+    ngx_uint_t                       rank;
+    ngx_rbtree_key_t                 vtime;
+
     /*
      * A change to SETTINGS_INITIAL_WINDOW_SIZE could cause the
      * send_window to become negative, hence it's signed.
@@ -214,6 +240,9 @@ struct ngx_http_v2_stream_s {
 
 
 struct ngx_http_v2_out_frame_s {
+    ngx_rbtree_node_t                node;
+    ngx_uint_t                       rank;
+
     ngx_http_v2_out_frame_t         *next;
     ngx_chain_t                     *first;
     ngx_chain_t                     *last;
@@ -225,50 +254,27 @@ struct ngx_http_v2_out_frame_s {
 
     unsigned                         blocked:1;
     unsigned                         fin:1;
+    unsigned                         scheduled:1;
 };
 
 
-static ngx_inline void
-ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
-    ngx_http_v2_out_frame_t *frame)
-{
-    ngx_http_v2_out_frame_t  **out;
-
-    for (out = &h2c->last_out; *out; out = &(*out)->next) {
+#define ngx_http_v2_output_queued(h2c)                                        \
+    ((h2c)->last_out || (h2c)->out_tree.root != (h2c)->out_tree.sentinel)
 
-        if ((*out)->blocked || (*out)->stream == NULL) {
-            break;
-        }
-
-        if ((*out)->stream->node->rank < frame->stream->node->rank
-            || ((*out)->stream->node->rank == frame->stream->node->rank
-                && (*out)->stream->node->rel_weight
-                   >= frame->stream->node->rel_weight))
-        {
-            break;
-        }
-    }
-
-    frame->next = *out;
-    *out = frame;
-}
 
+/*
+ * Stream frames are kept in the output tree, and the list only holds
+ * control and blocked frames, which are all sent before the tree.
+ */
 
 static ngx_inline void
 ngx_http_v2_queue_blocked_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
-    ngx_http_v2_out_frame_t  **out;
-
-    for (out = &h2c->last_out; *out; out = &(*out)->next) {
+    frame->scheduled = 0;
 
-        if ((*out)->blocked || (*out)->stream == NULL) {
-            break;
-        }
-    }
-
-    frame->next = *out;
-    *out = frame;
+    frame->next = h2c->last_out;
+    h2c->last_out = frame;
 }
 
 
@@ -276,6 +282,8 @@ static ngx_inline void
 ngx_http_v2_queue_ordered_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
+    frame->scheduled = 0;
+
     frame->next = h2c->last_out;
     h2c->last_out = frame;
 }
@@ -291,6 +299,8 @@ ngx_http_v2_stream_t *ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent,
 
 void ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc);
 
+void ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame);
 ngx_int_t ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c);
 
 
@@ -303,6 +313,14 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+u_char *ngx_http_v2_table_encode(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, ngx_uint_t indexing,
+    u_char *tmp);
+void ngx_http_v2_table_encoder_size(ngx_http_v2_connection_t *h2c,
+    size_t size);
+u_char *ngx_http_v2_table_size_update(ngx_http_v2_connection_t *h2c,
+    u_char *pos);
+
 
 ngx_int_t ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len,
     u_char **dst, ngx_uint_t last, ngx_log_t *log);
@@ -312,6 +330,8 @@ size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
 
 #define ngx_http_v2_prefix(bits)  ((1 << (bits)) - 1)
 
+#define NGX_HTTP_V2_TABLE_SIZE    4096
+
 
 #if (NGX_HAVE_NONALIGNED)
 
@@ -398,18 +418,25 @@ size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
 
 #define NGX_HTTP_V2_ACCEPT_ENCODING_INDEX 16
 #define NGX_HTTP_V2_ACCEPT_LANGUAGE_INDEX 17
+#define NGX_HTTP_V2_AGE_INDEX             21
 #define NGX_HTTP_V2_CONTENT_LENGTH_INDEX  28
+#define NGX_HTTP_V2_CONTENT_RANGE_INDEX   30
 #define NGX_HTTP_V2_CONTENT_TYPE_INDEX    31
 #define NGX_HTTP_V2_DATE_INDEX            33
+#define NGX_HTTP_V2_ETAG_INDEX            34
+#define NGX_HTTP_V2_EXPIRES_INDEX         36
 #define NGX_HTTP_V2_LAST_MODIFIED_INDEX   44
 #define NGX_HTTP_V2_LOCATION_INDEX        46
 #define NGX_HTTP_V2_SERVER_INDEX          54
+#define NGX_HTTP_V2_SET_COOKIE_INDEX      55
 #define NGX_HTTP_V2_USER_AGENT_INDEX      58
 #define NGX_HTTP_V2_VARY_INDEX            59
 
 
 u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
     u_char *tmp, ngx_uint_t lower);
+u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
+    ngx_uint_t value);
 
 
 #endif /* _NGX_HTTP_V2_H_INCLUDED_ */
@@ -23,6 +23,13 @@
 #define ngx_http_v2_literal_size(h)                                           \
     (ngx_http_v2_integer_octets(sizeof(h) - 1) + sizeof(h) - 1)
 
+/*
+ * A header with a static name index takes up to 2 octets before
+ * its value if it is not indexed, and so does a dynamic table index.
+ */
+
+#define NGX_HTTP_V2_INDEX_OCTETS          2
+
 
 #define NGX_HTTP_V2_NO_TRAILERS           (ngx_http_v2_out_frame_t *) -1
 
@@ -135,7 +142,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
     u_char                     status, *pos, *start, *p, *tmp;
     size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
+    ngx_str_t                  host, location, value;
     ngx_uint_t                 i, port, fin;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
@@ -147,20 +154,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     buf[sizeof("Wed, 31 Dec 1986 18:00:00 GMT")];
 
-    static const u_char nginx[5] = "\x84\xaa\x63\x55\xe7";
+    static ngx_str_t  nginx = ngx_string("nginx");
+    static ngx_str_t  nginx_ver = ngx_string(NGINX_VER);
+    static ngx_str_t  nginx_ver_build = ngx_string(NGINX_VER_BUILD);
 #if (NGX_HTTP_GZIP)
-    static const u_char accept_encoding[12] =
-        "\x8b\x84\x84\x2d\x69\x5b\x05\x44\x3c\x86\xaa\x6f";
+    static ngx_str_t  accept_encoding = ngx_string("Accept-Encoding");
 #endif
 
-    static size_t nginx_ver_len = ngx_http_v2_literal_size(NGINX_VER);
-    static u_char nginx_ver[ngx_http_v2_literal_size(NGINX_VER)];
-
-    static size_t nginx_ver_build_len =
-                                  ngx_http_v2_literal_size(NGINX_VER_BUILD);
-    static u_char nginx_ver_build[ngx_http_v2_literal_size(NGINX_VER_BUILD)];
-
     stream = r->stream;
 
     if (!stream) {
@@ -253,31 +255,36 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
-    len = h2c->table_update ? 1 : 0;
+    len = h2c->table_update ? 2 * 3 : 0;
 
-    len += status ? 1 : 1 + ngx_http_v2_literal_size("418");
+    len += status ? 1 : NGX_HTTP_V2_INDEX_OCTETS
+                        + ngx_http_v2_literal_size("418");
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (r->headers_out.server == NULL) {
 
         if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            len += 1 + nginx_ver_len;
+            len += NGX_HTTP_V2_INDEX_OCTETS
+                   + ngx_http_v2_literal_size(NGINX_VER);
 
         } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            len += 1 + nginx_ver_build_len;
+            len += NGX_HTTP_V2_INDEX_OCTETS
+                   + ngx_http_v2_literal_size(NGINX_VER_BUILD);
 
         } else {
-            len += 1 + sizeof(nginx);
+            len += NGX_HTTP_V2_INDEX_OCTETS + ngx_http_v2_literal_size("nginx");
         }
     }
 
     if (r->headers_out.date == NULL) {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += NGX_HTTP_V2_INDEX_OCTETS
+               + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.content_type.len) {
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
+        len += NGX_HTTP_V2_INDEX_OCTETS + NGX_HTTP_V2_INT_OCTETS
+               + r->headers_out.content_type.len;
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -289,13 +296,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
-        len += 1 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
+        len += NGX_HTTP_V2_INDEX_OCTETS
+               + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += NGX_HTTP_V2_INDEX_OCTETS
+               + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -373,7 +382,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
         r->headers_out.location->hash = 0;
 
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
+        len += NGX_HTTP_V2_INDEX_OCTETS + NGX_HTTP_V2_INT_OCTETS
+               + r->headers_out.location->value.len;
     }
 
     tmp_len = len;
@@ -381,7 +391,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 #if (NGX_HTTP_GZIP)
     if (r->gzip_vary) {
         if (clcf->gzip_vary) {
-            len += 1 + sizeof(accept_encoding);
+            len += NGX_HTTP_V2_INDEX_OCTETS
+                   + ngx_http_v2_literal_size("Accept-Encoding");
 
         } else {
             r->gzip_vary = 0;
@@ -444,10 +455,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+        pos = ngx_http_v2_table_size_update(h2c, pos);
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -458,9 +466,11 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         *pos++ = status;
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
-        *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
-        pos = ngx_sprintf(pos, "%03ui", r->headers_out.status);
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%03ui", r->headers_out.status) - buf;
+
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_STATUS_INDEX,
+                                       NULL, &value, 1, tmp);
     }
 
     if (r->headers_out.server == NULL) {
@@ -480,30 +490,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                            "http2 output header: \"server: nginx\"");
         }
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
-
-        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            if (nginx_ver[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver, (u_char *) NGINX_VER,
-                                            sizeof(NGINX_VER) - 1, tmp);
-                nginx_ver_len = p - nginx_ver;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver, nginx_ver_len);
-
-        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            if (nginx_ver_build[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver_build,
-                                            (u_char *) NGINX_VER_BUILD,
-                                            sizeof(NGINX_VER_BUILD) - 1, tmp);
-                nginx_ver_build_len = p - nginx_ver_build;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver_build, nginx_ver_build_len);
-
-        } else {
-            pos = ngx_cpymem(pos, nginx, sizeof(nginx));
-        }
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_SERVER_INDEX,
+                          NULL,
+                          clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON
+                          ? &nginx_ver
+                          : clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD
+                            ? &nginx_ver_build : &nginx,
+                          1, tmp);
     }
 
     if (r->headers_out.date == NULL) {
@@ -511,13 +504,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"date: %V\"",
                        &ngx_cached_http_time);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
-        pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
-                                      ngx_cached_http_time.len, tmp);
+        value = ngx_cached_http_time;
+
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_DATE_INDEX, NULL,
+                                       &value, 1, tmp);
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -548,8 +541,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos,
+                                       NGX_HTTP_V2_CONTENT_TYPE_INDEX, NULL,
+                                       &r->headers_out.content_type, 1, tmp);
     }
 
     if (r->headers_out.content_length == NULL
@@ -559,30 +553,29 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%O", r->headers_out.content_length_n)
+                    - buf;
 
-        p = pos;
-        pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
-        *p = NGX_HTTP_V2_ENCODE_RAW | (u_char) (pos - p - 1);
+        pos = ngx_http_v2_table_encode(h2c, pos,
+                                       NGX_HTTP_V2_CONTENT_LENGTH_INDEX, NULL,
+                                       &value, 0, tmp);
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
-
-        ngx_http_time(pos, r->headers_out.last_modified_time);
-        len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
+        value.data = buf;
+        value.len = ngx_http_time(buf, r->headers_out.last_modified_time)
+                    - buf;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 output header: \"last-modified: %*s\"",
-                       len, pos);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"last-modified: %V\"",
+                       &value);
 
-        /*
-         * Date will always be encoded using huffman in the temporary buffer,
-         * so it's safe here to use src and dst pointing to the same address.
-         */
-        pos = ngx_http_v2_write_value(pos, pos, len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos,
+                                       NGX_HTTP_V2_LAST_MODIFIED_INDEX, NULL,
+                                       &value, 0, tmp);
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -590,9 +583,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
-                                      r->headers_out.location->value.len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_LOCATION_INDEX,
+                                       NULL, &r->headers_out.location->value,
+                                       0, tmp);
     }
 
 #if (NGX_HTTP_GZIP)
@@ -600,8 +593,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_VARY_INDEX, NULL,
+                                       &accept_encoding, 1, tmp);
     }
 #endif
 
@@ -634,13 +627,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
 #endif
 
-        *pos++ = 0;
-
-        pos = ngx_http_v2_write_name(pos, header[i].key.data,
-                                     header[i].key.len, tmp);
-
-        pos = ngx_http_v2_write_value(pos, header[i].value.data,
-                                      header[i].value.len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos, 0, &header[i].key,
+                                       &header[i].value, 1, tmp);
     }
 
     fin = r->header_only
@@ -975,7 +963,8 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
             value = &(*h)->value;
 
-            len = 1 + NGX_HTTP_V2_INT_OCTETS + value->len;
+            len = NGX_HTTP_V2_INDEX_OCTETS + NGX_HTTP_V2_INT_OCTETS
+                  + value->len;
 
             pos = ngx_pnalloc(r->pool, len);
             if (pos == NULL) {
@@ -984,17 +973,21 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
             binary[i].data = pos;
 
-            *pos++ = ngx_http_v2_inc_indexed(ph[i].index);
+            /* the encoded headers are reused, so they are not indexed */
+
+            *pos = 0;
+            pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4),
+                                        ph[i].index);
             pos = ngx_http_v2_write_value(pos, value->data, value->len, tmp);
 
             binary[i].len = pos - binary[i].data;
         }
     }
 
-    len = (h2c->table_update ? 1 : 0)
+    len = (h2c->table_update ? 2 * 3 : 0)
           + 1
-          + 1 + NGX_HTTP_V2_INT_OCTETS + path->len
-          + 1 + NGX_HTTP_V2_INT_OCTETS + r->schema.len;
+          + NGX_HTTP_V2_INDEX_OCTETS + NGX_HTTP_V2_INT_OCTETS + path->len
+          + NGX_HTTP_V2_INDEX_OCTETS + NGX_HTTP_V2_INT_OCTETS + r->schema.len;
 
     for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
         len += binary[i].len;
@@ -1008,10 +1001,7 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+        pos = ngx_http_v2_table_size_update(h2c, pos);
     }
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -1022,8 +1012,8 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 push header: \":path: %V\"", path);
 
-    *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_PATH_INDEX);
-    pos = ngx_http_v2_write_value(pos, path->data, path->len, tmp);
+    pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_PATH_INDEX, NULL,
+                                   path, 0, tmp);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 push header: \":scheme: %V\"", &r->schema);
@@ -1037,8 +1027,9 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
         *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->schema.data, r->schema.len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos,
+                                       NGX_HTTP_V2_SCHEME_HTTP_INDEX, NULL,
+                                       &r->schema, 0, tmp);
     }
 
     for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
@@ -2073,7 +2064,8 @@ ngx_http_v2_filter_cleanup(void *data)
     size_t                     window;
     ngx_event_t               *wev;
     ngx_queue_t               *q;
-    ngx_http_v2_out_frame_t   *frame, **fn;
+    ngx_rbtree_node_t         *node, *next;
+    ngx_http_v2_out_frame_t   *frame;
     ngx_http_v2_connection_t  *h2c;
 
     if (stream->waiting) {
@@ -2087,28 +2079,31 @@ ngx_http_v2_filter_cleanup(void *data)
 
     window = 0;
     h2c = stream->connection;
-    fn = &h2c->last_out;
 
-    for ( ;; ) {
-        frame = *fn;
+    if (h2c->out_tree.root != h2c->out_tree.sentinel) {
 
-        if (frame == NULL) {
-            break;
-        }
+        for (node = ngx_rbtree_min(h2c->out_tree.root,
+                                   h2c->out_tree.sentinel);
+             node;
+             node = next)
+        {
+            next = ngx_rbtree_next(&h2c->out_tree, node);
 
-        if (frame->stream == stream && !frame->blocked) {
-            *fn = frame->next;
+            frame = (ngx_http_v2_out_frame_t *) node;
+
+            if (frame->stream != stream || frame->blocked) {
+                continue;
+            }
+
+            ngx_rbtree_delete(&h2c->out_tree, node);
+            frame->scheduled = 0;
 
             window += frame->length;
 
             if (--stream->queued == 0) {
                 break;
             }
-
-            continue;
         }
-
-        fn = &frame->next;
     }
 
     if (h2c->send_window == 0 && window) {
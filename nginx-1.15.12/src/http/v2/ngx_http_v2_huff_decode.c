@@ -18,10 +18,6 @@ typedef struct {
 } ngx_http_v2_huff_decode_code_t;
 
 
-static ngx_inline ngx_int_t ngx_http_v2_huff_decode_bits(u_char *state,
-    u_char *ending, ngx_uint_t bits, u_char **dst);
-
-
 static ngx_http_v2_huff_decode_code_t  ngx_http_v2_huff_decode_codes[256][16] =
 {
     /* 0 */
@@ -2643,39 +2639,61 @@ ngx_int_t
 ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
     ngx_uint_t last, ngx_log_t *log)
 {
-    u_char  *end, ch, ending;
+    u_char                           *end, *p, ch, st;
+    ngx_http_v2_huff_decode_code_t    code;
+
+    /*
+     * the state and the output position are kept in local variables,
+     * as stores through the output pointer would otherwise force them
+     * to be reloaded from memory for each nibble
+     */
 
     ch = 0;
-    ending = 1;
+    code.ending = 1;
+
+    st = *state;
+    p = *dst;
 
     end = src + len;
 
     while (src != end) {
         ch = *src++;
 
-        if (ngx_http_v2_huff_decode_bits(state, &ending, ch >> 4, dst)
-            != NGX_OK)
-        {
+        code = ngx_http_v2_huff_decode_codes[st][ch >> 4];
+
+        if (code.next == st) {
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
                            "http2 huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch >> 4);
+                           "bad code 0x%Xd", st, ch >> 4);
+            goto failed;
+        }
 
-            return NGX_ERROR;
+        if (code.emit) {
+            *p++ = code.sym;
         }
 
-        if (ngx_http_v2_huff_decode_bits(state, &ending, ch & 0xf, dst)
-            != NGX_OK)
-        {
+        st = code.next;
+
+        code = ngx_http_v2_huff_decode_codes[st][ch & 0xf];
+
+        if (code.next == st) {
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
                            "http2 huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch & 0xf);
+                           "bad code 0x%Xd", st, ch & 0xf);
+            goto failed;
+        }
 
-            return NGX_ERROR;
+        if (code.emit) {
+            *p++ = code.sym;
         }
+
+        st = code.next;
     }
 
+    *dst = p;
+
     if (last) {
-        if (!ending) {
+        if (!code.ending) {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                            "http2 huffman decoding error: "
                            "incomplete code 0x%Xd", ch);
@@ -2683,32 +2701,17 @@ ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
             return NGX_ERROR;
         }
 
-        *state = 0;
+        st = 0;
     }
 
-    return NGX_OK;
-}
-
-
-
-static ngx_inline ngx_int_t
-ngx_http_v2_huff_decode_bits(u_char *state, u_char *ending, ngx_uint_t bits,
-    u_char **dst)
-{
-    ngx_http_v2_huff_decode_code_t  code;
-
-    code = ngx_http_v2_huff_decode_codes[*state][bits];
+    *state = st;
 
-    if (code.next == *state) {
-        return NGX_ERROR;
-    }
+    return NGX_OK;
 
-    if (code.emit) {
-        *(*dst)++ = code.sym;
-    }
+failed:
 
-    *ending = code.ending;
-    *state = code.next;
+    *dst = p;
+    *state = st;
 
-    return NGX_OK;
+    return NGX_ERROR;
 }
@@ -10,12 +10,17 @@
 #include <ngx_http.h>
 
 
-#define NGX_HTTP_V2_TABLE_SIZE  4096
-
-
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
 
+static ngx_uint_t ngx_http_v2_table_find(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t *name_index);
+static ngx_uint_t ngx_http_v2_table_static_index(ngx_str_t *name);
+static ngx_int_t ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value);
+static void ngx_http_v2_table_evict(ngx_http_v2_hpack_enc_t *enc,
+    size_t size);
+
 
 static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
     { ngx_string(":authority"), ngx_string("") },
@@ -361,3 +366,292 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+/*
+ * The encoder side of the table mirrors the entries the client adds
+ * from our header blocks.  As header blocks are queued in the order
+ * they are encoded, the client always decodes them against the same
+ * table state.  An entry is stored contiguously, and the storage is
+ * twice the maximum table size, so a new entry always fits after
+ * the oldest one is evicted.
+ */
+
+u_char *
+ngx_http_v2_table_encode(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, ngx_uint_t indexing,
+    u_char *tmp)
+{
+    ngx_uint_t  found, name_index, prefix;
+
+    if (name == NULL) {
+        name = &ngx_http_v2_static_table[index - 1].name;
+
+    } else if (index == 0) {
+        index = ngx_http_v2_table_static_index(name);
+    }
+
+    switch (index) {
+
+    /* the values are unique to the response */
+
+    case NGX_HTTP_V2_AGE_INDEX:
+    case NGX_HTTP_V2_CONTENT_LENGTH_INDEX:
+    case NGX_HTTP_V2_CONTENT_RANGE_INDEX:
+    case NGX_HTTP_V2_ETAG_INDEX:
+    case NGX_HTTP_V2_EXPIRES_INDEX:
+    case NGX_HTTP_V2_LAST_MODIFIED_INDEX:
+    case NGX_HTTP_V2_LOCATION_INDEX:
+    case NGX_HTTP_V2_SET_COOKIE_INDEX:
+        indexing = 0;
+        break;
+    }
+
+    name_index = 0;
+
+    found = ngx_http_v2_table_find(h2c, name, value, &name_index);
+
+    if (found) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table index: %ui", found);
+
+        *pos = ngx_http_v2_indexed(0);
+        return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), found);
+    }
+
+    /* the name index is resolved before the new entry is added */
+
+    if (index == 0) {
+        index = name_index;
+    }
+
+    if (indexing && ngx_http_v2_table_insert(h2c, name, value) == NGX_OK) {
+        *pos = ngx_http_v2_inc_indexed(0);
+        prefix = ngx_http_v2_prefix(6);
+
+    } else {
+        *pos = 0;
+        prefix = ngx_http_v2_prefix(4);
+    }
+
+    if (index) {
+        pos = ngx_http_v2_write_int(pos, prefix, index);
+
+    } else {
+        pos = ngx_http_v2_write_name(pos + 1, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+}
+
+
+static ngx_uint_t
+ngx_http_v2_table_find(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t *name_index)
+{
+    ngx_uint_t                i, index;
+    ngx_http_v2_header_t     *entry;
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    for (i = enc->added; i != enc->deleted; i--) {
+
+        entry = &enc->entries[(i - 1) % (NGX_HTTP_V2_TABLE_SIZE / 32)];
+
+        if (entry->name.len != name->len
+            || ngx_strncasecmp(entry->name.data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + 1 + enc->added - i;
+
+        if (entry->value.len == value->len
+            && ngx_memcmp(entry->value.data, value->data, value->len) == 0)
+        {
+            return index;
+        }
+
+        if (*name_index == 0) {
+            *name_index = index;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_uint_t
+ngx_http_v2_table_static_index(ngx_str_t *name)
+{
+    ngx_uint_t  i;
+
+    /* response header names follow the pseudo-headers */
+
+    for (i = NGX_HTTP_V2_STATUS_500_INDEX;
+         i < NGX_HTTP_V2_STATIC_TABLE_ENTRIES;
+         i++)
+    {
+        if (ngx_http_v2_static_table[i].name.len == name->len
+            && ngx_strncasecmp(ngx_http_v2_static_table[i].name.data,
+                               name->data, name->len)
+               == 0)
+        {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    u_char                   *start;
+    size_t                    len;
+    ngx_http_v2_header_t     *entry;
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    len = name->len + value->len;
+
+    if (len + 32 > enc->size) {
+        return NGX_DECLINED;
+    }
+
+    if (enc->entries == NULL) {
+        enc->entries = ngx_palloc(h2c->connection->pool,
+                                  sizeof(ngx_http_v2_header_t)
+                                  * (NGX_HTTP_V2_TABLE_SIZE / 32));
+        if (enc->entries == NULL) {
+            return NGX_ERROR;
+        }
+
+        enc->storage = ngx_pnalloc(h2c->connection->pool,
+                                   2 * NGX_HTTP_V2_TABLE_SIZE);
+        if (enc->storage == NULL) {
+            return NGX_ERROR;
+        }
+
+        enc->pos = enc->storage;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table encoder add: \"%V: %V\"", name, value);
+
+    ngx_http_v2_table_evict(enc, enc->size - len - 32);
+
+    if (enc->added == enc->deleted) {
+        enc->pos = enc->storage;
+
+    } else {
+        start = enc->entries[enc->deleted % (NGX_HTTP_V2_TABLE_SIZE / 32)]
+                .name.data;
+
+        if (enc->pos >= start
+            && (size_t) (enc->storage + 2 * NGX_HTTP_V2_TABLE_SIZE - enc->pos)
+               < len)
+        {
+            enc->pos = enc->storage;
+        }
+    }
+
+    entry = &enc->entries[enc->added++ % (NGX_HTTP_V2_TABLE_SIZE / 32)];
+
+    entry->name.len = name->len;
+    entry->name.data = enc->pos;
+
+    ngx_strlow(enc->pos, name->data, name->len);
+
+    entry->value.len = value->len;
+    entry->value.data = enc->pos + name->len;
+
+    enc->pos = ngx_cpymem(entry->value.data, value->data, value->len);
+
+    enc->used += len + 32;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_table_evict(ngx_http_v2_hpack_enc_t *enc, size_t size)
+{
+    ngx_http_v2_header_t  *entry;
+
+    while (enc->used > size) {
+        entry = &enc->entries[enc->deleted++ % (NGX_HTTP_V2_TABLE_SIZE / 32)];
+        enc->used -= 32 + entry->name.len + entry->value.len;
+    }
+}
+
+
+void
+ngx_http_v2_table_encoder_size(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    size = ngx_min(size, NGX_HTTP_V2_TABLE_SIZE);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 client hpack table size: %uz was:%uz",
+                   size, enc->size);
+
+    if (!h2c->table_update) {
+        if (size == enc->size) {
+            return;
+        }
+
+        enc->update_min = size;
+
+    } else if (size < enc->update_min) {
+        enc->update_min = size;
+    }
+
+    enc->update = size;
+    h2c->table_update = 1;
+}
+
+
+/*
+ * a size update takes up to 3 octets, and two updates are sent
+ * if the size was reduced and then increased again
+ */
+
+u_char *
+ngx_http_v2_table_size_update(ngx_http_v2_connection_t *h2c, u_char *pos)
+{
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    if (enc->update_min < enc->update) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table size update: %uz", enc->update_min);
+
+        ngx_http_v2_table_evict(enc, enc->update_min);
+
+        *pos = 1 << 5;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5),
+                                    enc->update_min);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table size update: %uz", enc->update);
+
+    ngx_http_v2_table_evict(enc, enc->update);
+
+    *pos = 1 << 5;
+    pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), enc->update);
+
+    enc->size = enc->update;
+    h2c->table_update = 0;
+
+    return pos;
+}
@@ -172,6 +172,23 @@ ngx_read_channel(ngx_socket_t s, ngx_channel_t *ch, size_t size, ngx_log_t *log)
         ngx_memcpy(&ch->fd, CMSG_DATA(&cmsg.cm), sizeof(int));
     }
 
+    if (ch->command == NGX_CMD_PASS_SOCKET) {
+
+        /* the socket may be lost, e.g. if we are out of descriptors */
+
+        if (msg.msg_controllen < (socklen_t) CMSG_LEN(sizeof(int))
+            || cmsg.cm.cmsg_level != SOL_SOCKET
+            || cmsg.cm.cmsg_type != SCM_RIGHTS)
+        {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "recvmsg() returned no passed socket");
+            ch->fd = -1;
+
+        } else {
+            ngx_memcpy(&ch->fd, CMSG_DATA(&cmsg.cm), sizeof(int));
+        }
+    }
+
     if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
         ngx_log_error(NGX_LOG_ALERT, log, 0,
                       "recvmsg() truncated data");
@@ -189,6 +206,17 @@ ngx_read_channel(ngx_socket_t s, ngx_channel_t *ch, size_t size, ngx_log_t *log)
         ch->fd = fd;
     }
 
+    if (ch->command == NGX_CMD_PASS_SOCKET) {
+        if (msg.msg_accrightslen != sizeof(int)) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "recvmsg() returned no passed socket");
+            ch->fd = -1;
+
+        } else {
+            ch->fd = fd;
+        }
+    }
+
 #endif
 
     return n;
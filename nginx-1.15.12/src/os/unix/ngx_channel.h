@@ -19,6 +19,7 @@ typedef struct {
     ngx_pid_t   pid;
     ngx_int_t   slot;	//表示发送命令方在 ngx_processes进程数组间的序号
     ngx_fd_t    fd;
+    ngx_uint_t  tag;
 } ngx_channel_t;
 
 
@@ -26,6 +26,7 @@ static void ngx_channel_handler(ngx_event_t *ev);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_handler(ngx_event_t *ev);
 static void ngx_cache_loader_process_handler(ngx_event_t *ev);
+static void ngx_wakeup_processes_handler(ngx_event_t *ev);
 
 
 ngx_uint_t    ngx_process;
@@ -48,6 +49,9 @@ ngx_pid_t     ngx_new_binary;
 ngx_uint_t    ngx_inherited;
 ngx_uint_t    ngx_daemonized;
 
+ngx_event_t  *ngx_wakeup_event;
+ngx_pass_socket_pt  ngx_pass_socket_handler;
+
 sig_atomic_t  ngx_noaccept;
 ngx_uint_t    ngx_noaccepting;
 ngx_uint_t    ngx_restart;
@@ -69,6 +73,8 @@ static ngx_cycle_t      ngx_exit_cycle;
 static ngx_log_t        ngx_exit_log;
 static ngx_open_file_t  ngx_exit_log_file;
 
+static ngx_event_t      ngx_wakeup_processes_event;
+
 // ngx多进程循环
 void
 ngx_master_process_cycle(ngx_cycle_t *cycle)
@@ -1018,6 +1024,8 @@ ngx_worker_process_exit(ngx_cycle_t *cycle)
         }
     }
 
+    ngx_slab_flush_caches();
+
     if (ngx_exiting) {
         c = cycle->connections;
         for (i = 0; i < cycle->connection_n; i++) {
@@ -1134,6 +1142,13 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].pid = ch.pid;
             ngx_processes[ch.slot].channel[0] = ch.fd;
+
+            /* processes spawned after us, see ngx_wakeup_processes() */
+
+            if (ch.slot >= ngx_last_process) {
+                ngx_last_process = ch.slot + 1;
+            }
+
             break;
 
         case NGX_CMD_CLOSE_CHANNEL:
@@ -1150,11 +1165,138 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].channel[0] = -1;
             break;
+
+        case NGX_CMD_WAKEUP:
+
+            if (ngx_wakeup_event) {
+                ngx_post_event(ngx_wakeup_event, &ngx_posted_events);
+            }
+
+            break;
+
+        case NGX_CMD_PASS_SOCKET:
+
+            ngx_log_debug3(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                           "get socket s:%i pid:%P fd:%d",
+                           ch.slot, ch.pid, ch.fd);
+
+            if (ch.fd == -1) {
+                break;
+            }
+
+            if (ngx_pass_socket_handler) {
+                ngx_pass_socket_handler(ch.fd, ch.tag);
+                break;
+            }
+
+            if (ngx_close_socket(ch.fd) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_socket_errno,
+                              ngx_close_socket_n " failed");
+            }
+
+            break;
         }
     }
 }
 
 
+/*
+ * wakes up the ngx_wakeup_event handlers of all processes
+ * including the current one, e.g. when a shared resource they may
+ * wait for is released; the other processes are notified once
+ * per event loop iteration however many wakeups it requests
+ */
+
+void
+ngx_wakeup_processes(ngx_cycle_t *cycle)
+{
+    if ((ngx_process == NGX_PROCESS_WORKER
+         || ngx_process == NGX_PROCESS_HELPER)
+        && !ngx_wakeup_processes_event.posted)
+    {
+        ngx_wakeup_processes_event.handler = ngx_wakeup_processes_handler;
+        ngx_wakeup_processes_event.log = cycle->log;
+
+        ngx_post_event(&ngx_wakeup_processes_event, &ngx_posted_events);
+    }
+
+    if (ngx_wakeup_event) {
+        ngx_post_event(ngx_wakeup_event, &ngx_posted_events);
+    }
+}
+
+
+static void
+ngx_wakeup_processes_handler(ngx_event_t *ev)
+{
+    ngx_int_t      i;
+    ngx_channel_t  ch;
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_WAKEUP;
+    ch.pid = ngx_pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = -1;
+
+    for (i = 0; i < ngx_last_process; i++) {
+
+        if (i == ngx_process_slot
+            || ngx_processes[i].pid == -1
+            || ngx_processes[i].channel[0] == -1)
+        {
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                       "wakeup process %P s:%i", ngx_processes[i].pid, i);
+
+        /* a lost wakeup is recovered by the waiter's timer */
+
+        (void) ngx_write_channel(ngx_processes[i].channel[0],
+                                 &ch, sizeof(ngx_channel_t), ev->log);
+    }
+}
+
+
+/*
+ * passes a duplicate of the socket to the ngx_pass_socket_handler
+ * of the worker process in the slot, the caller closes its own copy
+ */
+
+ngx_int_t
+ngx_pass_socket(ngx_cycle_t *cycle, ngx_int_t slot, ngx_socket_t s,
+    ngx_uint_t tag)
+{
+    ngx_channel_t  ch;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        || slot < 0
+        || slot == ngx_process_slot
+        || slot >= ngx_last_process
+        || ngx_processes[slot].pid == -1
+        || ngx_processes[slot].channel[0] == -1)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, cycle->log, 0,
+                   "pass socket %d to process %P s:%i",
+                   s, ngx_processes[slot].pid, slot);
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_PASS_SOCKET;
+    ch.pid = ngx_pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = s;
+    ch.tag = tag;
+
+    return ngx_write_channel(ngx_processes[slot].channel[0],
+                             &ch, sizeof(ngx_channel_t), cycle->log);
+}
+
+
 static void
 ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data)
 {
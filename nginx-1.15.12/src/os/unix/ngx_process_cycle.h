@@ -18,6 +18,8 @@
 #define NGX_CMD_QUIT           3
 #define NGX_CMD_TERMINATE      4
 #define NGX_CMD_REOPEN         5
+#define NGX_CMD_WAKEUP         6
+#define NGX_CMD_PASS_SOCKET    7
 
 
 #define NGX_PROCESS_SINGLE     0
@@ -27,6 +29,9 @@
 #define NGX_PROCESS_HELPER     4	// 辅助进程
 
 
+typedef void (*ngx_pass_socket_pt)(ngx_socket_t s, ngx_uint_t tag);
+
+
 typedef struct {
     ngx_event_handler_pt       handler;
     char                      *name;
@@ -36,6 +41,9 @@ typedef struct {
 
 void ngx_master_process_cycle(ngx_cycle_t *cycle);
 void ngx_single_process_cycle(ngx_cycle_t *cycle);
+void ngx_wakeup_processes(ngx_cycle_t *cycle);
+ngx_int_t ngx_pass_socket(ngx_cycle_t *cycle, ngx_int_t slot, ngx_socket_t s,
+    ngx_uint_t tag);
 
 
 extern ngx_uint_t      ngx_process;
@@ -45,6 +53,8 @@ extern ngx_pid_t       ngx_new_binary;
 extern ngx_uint_t      ngx_inherited;
 extern ngx_uint_t      ngx_daemonized;
 extern ngx_uint_t      ngx_exiting;
+extern ngx_event_t    *ngx_wakeup_event;
+extern ngx_pass_socket_pt  ngx_pass_socket_handler;
 
 extern sig_atomic_t    ngx_reap;
 extern sig_atomic_t    ngx_sigio;
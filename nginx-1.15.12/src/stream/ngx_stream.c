@@ -512,6 +512,7 @@ ngx_stream_optimize_servers(ngx_conf_t *cf, ngx_array_t *ports)
 
 #if (NGX_HAVE_REUSEPORT)
             ls->reuseport = addr[i].opt.reuseport;
+            ls->reuseport_steer = addr[i].opt.reuseport_steer;
 #endif
 
             stport = ngx_palloc(cf->pool, sizeof(ngx_stream_port_t));
@@ -707,6 +707,31 @@ ngx_stream_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 #endif
         }
 
+        if (ngx_strncmp(value[i].data, "reuseport=", 10) == 0) {
+#if (NGX_HAVE_REUSEPORT_CBPF)
+            if (ngx_strcmp(&value[i].data[10], "cpu") == 0) {
+                ls->reuseport_steer = NGX_REUSEPORT_STEER_CPU;
+
+            } else if (ngx_strcmp(&value[i].data[10], "queue") == 0) {
+                ls->reuseport_steer = NGX_REUSEPORT_STEER_QUEUE;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid reuseport \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            ls->reuseport = 1;
+            ls->bind = 1;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "reuseport steering is not supported "
+                               "on this platform");
+            return NGX_CONF_ERROR;
+#endif
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "reuseport") == 0) {
 #if (NGX_HAVE_REUSEPORT)
             ls->reuseport = 1;
@@ -33,6 +33,7 @@ typedef struct {
     ngx_flag_t                       proxy_protocol;
     ngx_stream_upstream_local_t     *local;
     ngx_flag_t                       socket_keepalive;
+    ngx_flag_t                       splice;
 
 #if (NGX_STREAM_SSL)
     ngx_flag_t                       ssl_enable;
@@ -58,6 +59,24 @@ typedef struct {
 } ngx_stream_proxy_srv_conf_t;
 
 
+#if (NGX_HAVE_SPLICE)
+
+typedef struct {
+    ngx_fd_t                         fd[2];
+    size_t                           size;      /* bytes in the pipe */
+    size_t                           capacity;
+} ngx_stream_proxy_pipe_t;
+
+
+typedef struct {
+    /* indexed by from_upstream */
+    ngx_stream_proxy_pipe_t          pipe[2];
+    unsigned                         disabled:1;
+} ngx_stream_proxy_ctx_t;
+
+#endif
+
+
 static void ngx_stream_proxy_handler(ngx_stream_session_t *s);
 static ngx_int_t ngx_stream_proxy_eval(ngx_stream_session_t *s,
     ngx_stream_proxy_srv_conf_t *pscf);
@@ -76,6 +95,13 @@ static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
 static ngx_int_t ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_stream_proxy_init_splice(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_proxy_splice(ngx_stream_session_t *s,
+    ngx_stream_proxy_pipe_t *p, ngx_uint_t from_upstream, size_t limit_rate,
+    off_t *received, ngx_uint_t *packets);
+static void ngx_stream_proxy_splice_cleanup(void *data);
+#endif
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc);
 static u_char *ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf,
@@ -147,6 +173,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, socket_keepalive),
       NULL },
 
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
     { ngx_string("proxy_connect_timeout"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -895,6 +928,22 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
         u->proxy_protocol = 0;
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    if (pscf->splice && pc->type == SOCK_STREAM
+#if (NGX_SSL)
+        && c->ssl == NULL && pc->ssl == NULL
+#endif
+       )
+    {
+        if (ngx_stream_proxy_init_splice(s) != NGX_OK) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+#endif
+
     u->connected = 1;
 
     pc->read->handler = ngx_stream_proxy_upstream_handler;
@@ -1505,6 +1554,9 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
     ngx_log_handler_pt            handler;
     ngx_stream_upstream_t        *u;
     ngx_stream_proxy_srv_conf_t  *pscf;
+#if (NGX_HAVE_SPLICE)
+    ngx_stream_proxy_ctx_t       *ctx;
+#endif
 
     u = s->upstream;
 
@@ -1553,6 +1605,41 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         send_action = "proxying and sending to upstream";
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    /*
+     * the data already read into the buffer, such as the preread data
+     * or the PROXY protocol header, are sent first, then the direction
+     * is switched to splice() and its chains stay empty; if a pipe
+     * cannot be created, the directions without a pipe are proxied
+     * through the buffers
+     */
+
+    if (ctx && dst && *out == NULL && *busy == NULL
+        && !(dst->buffered & ~NGX_STREAM_SPLICE_BUFFERED)
+        && (!ctx->disabled
+            || ctx->pipe[from_upstream].fd[0] != NGX_INVALID_FILE))
+    {
+        rc = ngx_stream_proxy_splice(s, &ctx->pipe[from_upstream],
+                                     from_upstream, limit_rate, received,
+                                     packets);
+
+        if (rc == NGX_ERROR) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+            return;
+        }
+
+        if (rc == NGX_OK) {
+            goto done;
+        }
+
+        ctx->disabled = 1;
+    }
+
+#endif
+
     for ( ;; ) {
 
         if (do_write && dst) {
@@ -1659,6 +1746,10 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         break;
     }
 
+#if (NGX_HAVE_SPLICE)
+done:
+#endif
+
     c->log->action = "proxying connection";
 
     if (ngx_stream_proxy_test_finalize(s, from_upstream) == NGX_OK) {
@@ -1769,6 +1860,252 @@ ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_stream_proxy_init_splice(ngx_stream_session_t *s)
+{
+    ngx_uint_t               i;
+    ngx_pool_cleanup_t      *cln;
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx) {
+        return NGX_OK;
+    }
+
+    ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_stream_proxy_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the pipes are created on the first use of a direction */
+
+    for (i = 0; i < 2; i++) {
+        ctx->pipe[i].fd[0] = NGX_INVALID_FILE;
+        ctx->pipe[i].fd[1] = NGX_INVALID_FILE;
+    }
+
+    cln->handler = ngx_stream_proxy_splice_cleanup;
+    cln->data = ctx;
+
+    ngx_stream_set_ctx(s, ctx, ngx_stream_proxy_module);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_splice(ngx_stream_session_t *s, ngx_stream_proxy_pipe_t *p,
+    ngx_uint_t from_upstream, size_t limit_rate, off_t *received,
+    ngx_uint_t *packets)
+{
+    int                     size;
+    off_t                   limit;
+    ssize_t                 n;
+    ngx_err_t               err;
+    ngx_msec_t              delay;
+    ngx_connection_t       *c, *src, *dst;
+    ngx_stream_upstream_t  *u;
+
+    u = s->upstream;
+    c = s->connection;
+
+    if (from_upstream) {
+        src = u->peer.connection;
+        dst = c;
+
+    } else {
+        src = c;
+        dst = u->peer.connection;
+    }
+
+    if (p->fd[0] == NGX_INVALID_FILE) {
+        if (pipe2(p->fd, O_NONBLOCK) == -1) {
+            ngx_log_error(NGX_LOG_ERR, c->log, ngx_errno,
+                          "pipe2() failed, splice disabled");
+            p->fd[0] = NGX_INVALID_FILE;
+            p->fd[1] = NGX_INVALID_FILE;
+            return NGX_DECLINED;
+        }
+
+        size = fcntl(p->fd[0], F_GETPIPE_SZ);
+
+        if (size == -1) {
+            ngx_log_error(NGX_LOG_ERR, c->log, ngx_errno,
+                          "fcntl(F_GETPIPE_SZ) failed, splice disabled");
+            (void) close(p->fd[0]);
+            (void) close(p->fd[1]);
+            p->fd[0] = NGX_INVALID_FILE;
+            p->fd[1] = NGX_INVALID_FILE;
+            return NGX_DECLINED;
+        }
+
+        p->capacity = size;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "stream proxy splice pipe: %d:%d %uz",
+                       p->fd[0], p->fd[1], p->capacity);
+    }
+
+    for ( ;; ) {
+
+        if (p->size && dst->write->ready) {
+            c->log->action = from_upstream ? "proxying and sending to client"
+                                           : "proxying and sending to upstream";
+
+            n = splice(p->fd[0], NULL, dst->fd, NULL, p->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice to socket: %z of %uz", n, p->size);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+                    dst->write->ready = 0;
+
+                } else if (err != NGX_EINTR) {
+                    dst->write->error = 1;
+                    ngx_connection_error(dst, err, "splice() failed");
+                    return NGX_ERROR;
+                }
+
+            } else {
+                p->size -= n;
+                dst->sent += n;
+            }
+        }
+
+        if (p->size) {
+            dst->buffered |= NGX_STREAM_SPLICE_BUFFERED;
+
+        } else {
+            dst->buffered &= ~NGX_STREAM_SPLICE_BUFFERED;
+        }
+
+        if (p->size == p->capacity
+            || !src->read->ready || src->read->delayed
+            || src->read->error || src->read->eof)
+        {
+            break;
+        }
+
+        n = p->capacity - p->size;
+
+        if (limit_rate) {
+            limit = (off_t) limit_rate * (ngx_time() - u->start_sec + 1)
+                    - *received;
+
+            if (limit <= 0) {
+                src->read->delayed = 1;
+                delay = (ngx_msec_t) (- limit * 1000 / limit_rate + 1);
+                ngx_add_timer(src->read, delay);
+                break;
+            }
+
+            if ((off_t) n > limit) {
+                n = (ssize_t) limit;
+            }
+        }
+
+        c->log->action = from_upstream ? "proxying and reading from upstream"
+                                       : "proxying and reading from client";
+
+        n = splice(src->fd, NULL, p->fd[1], NULL, n,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "splice from socket: %z, pipe: %uz", n, p->size);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err != NGX_EAGAIN) {
+                src->read->eof = 1;
+                src->read->error = 1;
+                ngx_connection_error(src, err, "splice() failed");
+                break;
+            }
+
+            /*
+             * EAGAIN is also returned when the pipe runs out of buffers
+             * before its byte capacity is reached, the socket is assumed
+             * to be drained only when the pipe is empty
+             */
+
+            if (p->size == 0) {
+                src->read->ready = 0;
+                break;
+            }
+
+            if (dst->write->ready) {
+                continue;
+            }
+
+            break;
+        }
+
+        if (n == 0) {
+            src->read->eof = 1;
+            continue;
+        }
+
+        if (limit_rate) {
+            delay = (ngx_msec_t) (n * 1000 / limit_rate);
+
+            if (delay > 0) {
+                src->read->delayed = 1;
+                ngx_add_timer(src->read, delay);
+            }
+        }
+
+        if (from_upstream) {
+            if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                u->state->first_byte_time = ngx_current_msec - u->start_time;
+            }
+        }
+
+        (*packets)++;
+        *received += n;
+        p->size += n;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_splice_cleanup(void *data)
+{
+    ngx_stream_proxy_ctx_t  *ctx = data;
+
+    ngx_uint_t  i;
+
+    for (i = 0; i < 2; i++) {
+        if (ctx->pipe[i].fd[0] == NGX_INVALID_FILE) {
+            continue;
+        }
+
+        (void) close(ctx->pipe[i].fd[0]);
+        (void) close(ctx->pipe[i].fd[1]);
+    }
+}
+
+#endif
+
+
 static void
 ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
 {
@@ -1973,6 +2310,7 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->proxy_protocol = NGX_CONF_UNSET;
     conf->local = NGX_CONF_UNSET_PTR;
     conf->socket_keepalive = NGX_CONF_UNSET;
+    conf->splice = NGX_CONF_UNSET;
 
 #if (NGX_STREAM_SSL)
     conf->ssl_enable = NGX_CONF_UNSET;
@@ -2029,6 +2367,8 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->socket_keepalive,
                               prev->socket_keepalive, 0);
 
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+
 #if (NGX_STREAM_SSL)
 
     ngx_conf_merge_value(conf->ssl_enable, prev->ssl_enable, 0);